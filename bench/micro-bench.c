@@ -0,0 +1,397 @@
+#include <math.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+/*
+ * Microbenchmarks of the data structures of the splice engine: the timeout
+ * queue, the knock check of first_data(), the HTTP routing of
+ * first_http_data(), the allocation of proxies, the token buckets of the
+ * rate limits, the heavy hitter sketches and the adaptive knock deadline.
+ * The engine is included, so that its static functions can be called.
+ *
+ * Prints ns and (when the kernel allows perf events) cache misses per
+ * operation, for 1k up to 1M entries.
+ */
+#include "proxy-splice.c"
+
+#define ZIPF_EXPONENT 0.99
+#define SAMPLES (1 << 20)
+
+static uint64_t random_state = 0x9e3779b97f4a7c15ull;
+
+static uint32_t next_random(uint32_t range) {
+    // xorshift64*, so runs are repeatable
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (uint32_t)(((random_state * 2685821657736338717ull) >> 32) % range);
+}
+
+static int cache_misses = -1;
+
+static void open_counter(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    cache_misses = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+struct measurement {
+    struct timespec started;
+};
+
+static void begin(struct measurement* m) {
+    if (cache_misses != -1) {
+        ioctl(cache_misses, PERF_EVENT_IOC_RESET, 0);
+        ioctl(cache_misses, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &m->started);
+}
+
+static void end(struct measurement* m, const char* name, size_t entries, size_t operations) {
+    struct timespec stopped;
+    clock_gettime(CLOCK_MONOTONIC, &stopped);
+    double took = (double)(stopped.tv_sec - m->started.tv_sec) * 1e9 + (double)(stopped.tv_nsec - m->started.tv_nsec);
+    printf("%s,%zu,%.1f,", name, entries, took / (double)operations);
+    uint64_t misses;
+    if (cache_misses != -1 && read(cache_misses, &misses, sizeof(misses)) == sizeof(misses)) {
+        ioctl(cache_misses, PERF_EVENT_IOC_DISABLE, 0);
+        printf("%.2f\n", (double)misses / (double)operations);
+    }
+    else {
+        printf("n/a\n");
+    }
+}
+
+static void shuffle(struct proxy** proxies, size_t size) {
+    for (size_t i = size - 1; i > 0; i--) {
+        size_t j = next_random((uint32_t)(i + 1));
+        struct proxy* tmp = proxies[i];
+        proxies[i] = proxies[j];
+        proxies[j] = tmp;
+    }
+}
+
+/* zipfian distributed indexes, index 0 is the most popular one */
+static uint32_t* zipf_samples(size_t entries) {
+    double* cdf = malloc(entries * sizeof(double));
+    uint32_t* samples = malloc(SAMPLES * sizeof(uint32_t));
+    if (!cdf || !samples) {
+        perror("Cannot allocate samples");
+        exit(1);
+    }
+    double sum = 0;
+    for (size_t i = 0; i < entries; i++) {
+        sum += 1.0 / pow((double)(i + 1), ZIPF_EXPONENT);
+        cdf[i] = sum;
+    }
+    for (size_t s = 0; s < SAMPLES; s++) {
+        double target = (double)next_random(UINT32_MAX) / (double)UINT32_MAX * sum;
+        size_t low = 0, high = entries - 1;
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+            if (cdf[middle] < target) {
+                low = middle + 1;
+            }
+            else {
+                high = middle;
+            }
+        }
+        samples[s] = (uint32_t)low;
+    }
+    free(cdf);
+    return samples;
+}
+
+static struct proxy** new_proxies(size_t entries) {
+    struct proxy** proxies = malloc(entries * sizeof(struct proxy*));
+    if (!proxies) {
+        perror("Cannot allocate proxies");
+        exit(1);
+    }
+    for (size_t i = 0; i < entries; i++) {
+        proxies[i] = calloc(1, sizeof(struct proxy));
+        if (proxies[i]) {
+            proxies[i]->state = calloc(1, sizeof(struct front_state));
+        }
+        if (!proxies[i] || !proxies[i]->state) {
+            perror("Cannot allocate proxies");
+            exit(1);
+        }
+    }
+    // like real connections, the order in memory has nothing to do with the order in the queue
+    shuffle(proxies, entries);
+    return proxies;
+}
+
+static void free_proxies(struct proxy** proxies, size_t entries) {
+    for (size_t i = 0; i < entries; i++) {
+        free(proxies[i]->state);
+        free(proxies[i]);
+    }
+    free(proxies);
+}
+
+static void bench_timeout_queue(size_t entries) {
+    struct proxy** proxies = new_proxies(entries);
+    uint32_t* samples = zipf_samples(entries);
+    struct measurement m;
+    timeout_queue.head = timeout_queue.tail = NULL;
+    current_time = 0;
+
+    begin(&m);
+    for (size_t i = 0; i < entries; i++) {
+        current_time++;
+        add_new_timeout_queue(&timeout_queue, proxies[i]);
+    }
+    end(&m, "queue_add", entries, entries);
+
+    begin(&m);
+    for (size_t i = 0; i < SAMPLES; i++) {
+        current_time++;
+        touch(proxies[samples[i]]);
+    }
+    end(&m, "queue_touch_zipf", entries, SAMPLES);
+
+    begin(&m);
+    for (size_t i = 0; i < SAMPLES; i++) {
+        current_time++;
+        touch(proxies[next_random((uint32_t)entries)]);
+    }
+    end(&m, "queue_touch_uniform", entries, SAMPLES);
+
+    // like the timeout scan after a quiet period: the oldest half times out at once
+    time_t threshold = timeout_queue.tail->last_recieved + (current_time - timeout_queue.tail->last_recieved) / 2;
+    size_t expired = 0;
+    begin(&m);
+    while (timeout_queue.tail && timeout_queue.tail->last_recieved < threshold) {
+        remove_from_timeout_queue(timeout_queue.tail);
+        expired++;
+    }
+    end(&m, "queue_expire_bulk", entries, expired ? expired : 1);
+
+    // the rest closes in random order
+    size_t removed = 0;
+    begin(&m);
+    for (size_t i = 0; i < entries; i++) {
+        if (proxies[i]->last_recieved >= threshold) {
+            remove_from_timeout_queue(proxies[i]);
+            removed++;
+        }
+    }
+    end(&m, "queue_remove_random", entries, removed ? removed : 1);
+
+    free(samples);
+    free_proxies(proxies, entries);
+}
+
+static void bench_allocation(size_t entries) {
+    struct proxy** proxies = new_proxies(entries);
+    struct measurement m;
+    // connections come and go, while the rest stays open
+    begin(&m);
+    for (size_t i = 0; i < SAMPLES; i++) {
+        uint32_t victim = next_random((uint32_t)entries);
+        free(proxies[victim]->state);
+        free(proxies[victim]);
+        proxies[victim] = malloc(sizeof(struct proxy));
+        proxies[victim]->state = malloc(sizeof(struct front_state));
+        proxies[victim]->closed = false;
+    }
+    end(&m, "proxy_alloc_churn", entries, SAMPLES);
+    free_proxies(proxies, entries);
+}
+
+static void bench_shaping(size_t entries) {
+    struct proxy** proxies = new_proxies(entries);
+    struct measurement m;
+    current_time = 0;
+    token_bucket_init(&route_buckets[0], 1 << 30, 0);
+    for (size_t i = 0; i < entries; i++) {
+        token_bucket_init(&proxies[i]->state->bucket, 1 << 20, 0);
+    }
+    // what do_proxy does for every splice of a shaped connection
+    size_t allowed = 0;
+    begin(&m);
+    for (size_t i = 0; i < SAMPLES; i++) {
+        current_time += i & 1;
+        struct proxy* proxy = proxies[next_random((uint32_t)entries)];
+        size_t available = token_bucket_available(&proxy->state->bucket, (uint64_t)current_time);
+        size_t route_available = token_bucket_available(&route_buckets[0], (uint64_t)current_time);
+        size_t bytes = (available < route_available ? available : route_available) & 0xfff;
+        take_tokens(proxy, bytes);
+        allowed += bytes;
+    }
+    end(&m, "shape_splice", entries, SAMPLES);
+    if (allowed == 0) {
+        fprintf(stderr, "shaping never allowed anything\n");
+        exit(1);
+    }
+    free_proxies(proxies, entries);
+}
+
+static void bench_topk(size_t entries) {
+    uint32_t* samples = zipf_samples(entries);
+    struct measurement m;
+    topk_init(&top_bytes);
+    // what do_proxy does after every splice, with entries different prefixes
+    begin(&m);
+    for (size_t i = 0; i < SAMPLES; i++) {
+        topk_add(&top_bytes, TOP_PREFIX(samples[i] << 8), 1 + (i & 0xffff));
+    }
+    end(&m, "topk_add_zipf", entries, SAMPLES);
+
+    begin(&m);
+    for (size_t i = 0; i < SAMPLES; i++) {
+        topk_add(&top_bytes, TOP_PREFIX(next_random((uint32_t)entries) << 8), 1 + (i & 0xffff));
+    }
+    end(&m, "topk_add_uniform", entries, SAMPLES);
+    free(samples);
+}
+
+static void bench_knock(const char* name, struct config* knock_config, const uint8_t* knock) {
+    struct knock_matcher matcher;
+    knock_matcher_init(&matcher, knock_config);
+    uint8_t wrong[64];
+    memset(wrong, 'G', sizeof(wrong));
+    char full_name[64];
+    size_t matches = 0;
+    struct measurement m;
+
+    snprintf(full_name, sizeof(full_name), "%s_match", name);
+    begin(&m);
+    for (size_t i = 0; i < SAMPLES; i++) {
+        matches += knock_matches(&matcher, knock, knock_config->knock_size);
+    }
+    end(&m, full_name, 1, SAMPLES);
+
+    snprintf(full_name, sizeof(full_name), "%s_mismatch", name);
+    begin(&m);
+    for (size_t i = 0; i < SAMPLES; i++) {
+        matches += knock_matches(&matcher, wrong, knock_config->knock_size);
+    }
+    end(&m, full_name, 1, SAMPLES);
+    if (matches != SAMPLES) {
+        fprintf(stderr, "%s matched %zu times instead of %d\n", name, matches, SAMPLES);
+        exit(1);
+    }
+}
+
+/* a client that talks first after delay ms, 2% of them slowly */
+static uint32_t client_delay(void) {
+    return next_random(100) < 98 ? 1 + next_random(50) : 100 + next_random(1900);
+}
+
+static void bench_knock_delays(void) {
+    struct config delays_config;
+    memset(&delays_config, 0, sizeof(delays_config));
+    delays_config.adaptive_knock = true;
+    delays_config.knock_timeout.tv_sec = 5;
+    knock_delays_init(&knock_delays, &delays_config);
+    // what the engine sees: the slow clients past the deadline only expire
+    uint32_t lowest = UINT32_MAX;
+    struct measurement m;
+    begin(&m);
+    for (size_t i = 0; i < SAMPLES; i++) {
+        uint32_t delay = client_delay();
+        uint32_t deadline = knock_delays_deadline(&knock_delays);
+        if (delay < deadline) {
+            knock_delays_record(&knock_delays, delay);
+        }
+        else {
+            knock_delays_expired(&knock_delays, deadline);
+        }
+        if (i >= SAMPLES / 4 && knock_delays_deadline(&knock_delays) < lowest) {
+            lowest = knock_delays_deadline(&knock_delays);
+        }
+    }
+    end(&m, "knock_delays_record", 1, SAMPLES);
+    // the 99th percentile of client_delay() is at 1050 ms, once the first
+    // estimate from KNOCK_DELAYS_MIN_SAMPLES samples has been corrected
+    if (lowest < 1050) {
+        fprintf(stderr, "a stable delay distribution shrank the knock deadline to %u ms\n", lowest);
+        exit(1);
+    }
+}
+
+/* a browser request, where the Host header comes late */
+static const char* http_head =
+    "GET /assets/application-4f3a9b.css HTTP/1.1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://www.example.com/\r\n"
+    "Connection: keep-alive\r\n"
+    "Host: www.example.com\r\n"
+    "\r\n";
+
+static void bench_http(const char* name, struct config* http_config, const char* head, size_t segment, enum http_route_result expected) {
+    size_t size = strlen(head);
+    size_t wrong = 0;
+    struct measurement m;
+    begin(&m);
+    for (size_t i = 0; i < SAMPLES; i++) {
+        struct http_route route;
+        http_route_init(&route);
+        enum http_route_result result = HTTP_ROUTE_MORE;
+        for (size_t offset = 0; offset < size && result == HTTP_ROUTE_MORE; offset += segment) {
+            result = http_route_parse(&route, http_config, (const uint8_t*)head + offset, size - offset < segment ? size - offset : segment);
+        }
+        wrong += result != expected;
+    }
+    end(&m, name, 1, SAMPLES);
+    if (wrong) {
+        fprintf(stderr, "%s routed %zu requests wrong\n", name, wrong);
+        exit(1);
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t max_entries = 1000000;
+    if (argc > 1) {
+        max_entries = strtoull(argv[1], NULL, 10);
+    }
+    open_counter();
+
+    printf("benchmark,entries,ns_per_op,cache_misses_per_op\n");
+    struct config knock_config;
+    memset(&knock_config, 0, sizeof(knock_config));
+    knock_config.knock_value = "open-sesame";
+    knock_config.knock_size = knock_config.knock_secret_size = strlen(knock_config.knock_value);
+    bench_knock("knock_static", &knock_config, (const uint8_t*)knock_config.knock_value);
+
+    knock_config.totp_period = 30;
+    knock_config.knock_size = TOTP_DIGITS;
+    char token[TOTP_DIGITS];
+    totp_token((const uint8_t*)knock_config.knock_value, knock_config.knock_secret_size, (uint64_t)time(NULL) / 30, token);
+    bench_knock("knock_totp", &knock_config, (const uint8_t*)token);
+
+    struct config http_config;
+    memset(&http_config, 0, sizeof(http_config));
+    http_config.http_host = "secret.example.com";
+    http_config.http_host_size = strlen(http_config.http_host);
+    http_config.http_path = "/hidden/";
+    http_config.http_path_size = strlen(http_config.http_path);
+    bench_http("http_route_whole_head", &http_config, http_head, SIZE_MAX, HTTP_ROUTE_NORMAL);
+    bench_http("http_route_segments", &http_config, http_head, 64, HTTP_ROUTE_NORMAL);
+    bench_http("http_route_path", &http_config, "GET /hidden/file HTTP/1.1\r\n", SIZE_MAX, HTTP_ROUTE_HIDDEN);
+
+    bench_knock_delays();
+
+    for (size_t entries = 1000; entries <= max_entries; entries *= 10) {
+        bench_timeout_queue(entries);
+        bench_allocation(entries);
+        bench_shaping(entries);
+        bench_topk(entries);
+    }
+    if (cache_misses != -1) {
+        close(cache_misses);
+    }
+    return 0;
+}
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "knock-common.h"
+#include "knock-cache.h"
+#include "proxy-splice.h"
+#include "sim-io.h"
+
+/*
+ * Pushes simulated connections through the real state machine of
+ * proxy-splice.c, on top of the in-memory kernel of sim-io.c, to measure
+ * the user space cost per connection without the cost of the kernel.
+ *
+ * Every client connects, waits a bit and sends a request (with or without
+ * the knock), waits until the echo backend send it all back and closes.
+ * Some clients never send anything (and go through the knock and proxy
+ * timeouts), some reset their connection halfway, and some backends
+ * refuse the connection.
+ */
+
+#define LISTEN_PORT 4000
+#define NORMAL_PORT 4001
+#define HIDDEN_PORT 4002
+#define KNOCK "open-sesame"
+#define REQUEST_START "GET / HTTP/1.1\r\n"
+#define SEND_DELAY 1
+
+enum client_kind { HIDDEN, NORMAL, IDLE, RESET, KINDS };
+static const char* kind_names[KINDS] = { "hidden", "normal", "idle", "reset" };
+
+struct client {
+    enum client_kind kind;
+    struct sim_endpoint* front;
+    size_t expected;
+    size_t received;
+    uint64_t send_at;
+    bool closing;
+    struct client* next;
+};
+
+static uint64_t total = 1000000;
+static uint64_t concurrency = 1000;
+static size_t request_size = 4096;
+static uint32_t percentage[KINDS] = { 40, 40, 1, 4 };
+static uint32_t refuse_percentage = 1;
+
+static struct client* clients;
+static struct client* spare_clients = NULL;
+static struct client* send_first = NULL;
+static struct client* send_last = NULL;
+static uint64_t started = 0;
+static uint64_t finished = 0;
+static uint64_t active = 0;
+static uint64_t kinds[KINDS];
+static uint64_t refused = 0;
+static uint64_t random_state = 0x9e3779b97f4a7c15ull;
+
+static uint32_t next_random(uint32_t range) {
+    // xorshift64*, so runs are repeatable
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (uint32_t)(((random_state * 2685821657736338717ull) >> 32) % range);
+}
+
+static bool backend_connect(struct sim_endpoint* UNUSED(backend), uint16_t UNUSED(port)) {
+    if (next_random(100) < refuse_percentage) {
+        refused++;
+        return false;
+    }
+    return true;
+}
+
+static void start_client(void) {
+    struct client* client = spare_clients;
+    spare_clients = client->next;
+
+    uint32_t pick = next_random(100);
+    client->kind = NORMAL;
+    for (int k = 0; k < KINDS; k++) {
+        if (pick < percentage[k]) {
+            client->kind = (enum client_kind)k;
+            break;
+        }
+        pick -= percentage[k];
+    }
+    kinds[client->kind]++;
+
+    client->front = sim_connect(LISTEN_PORT, 0x0a000000 + (uint32_t)(started % 0xffffff));
+    sim_set_user(client->front, client);
+    client->received = 0;
+    client->closing = false;
+    client->expected = client->kind == HIDDEN ? request_size - strlen(KNOCK) : request_size;
+    if (client->kind != IDLE) {
+        client->send_at = sim_now() + SEND_DELAY;
+        client->next = NULL;
+        if (send_last) {
+            send_last->next = client;
+        }
+        else {
+            send_first = client;
+        }
+        send_last = client;
+    }
+    started++;
+    active++;
+}
+
+static void send_request(struct client* client) {
+    if (sim_proxy_closed(client->front)) {
+        return;
+    }
+    const char* start = client->kind == HIDDEN ? KNOCK : REQUEST_START;
+    sim_send(client->front, start, strlen(start));
+    sim_send(client->front, NULL, request_size - strlen(start));
+}
+
+static void finish_client(struct client* client) {
+    sim_release(client->front);
+    client->next = spare_clients;
+    spare_clients = client;
+    active--;
+    finished++;
+}
+
+static int64_t drive(void) {
+    uint64_t now = sim_now();
+    while (send_first && send_first->send_at <= now) {
+        struct client* client = send_first;
+        send_first = client->next;
+        if (!send_first) {
+            send_last = NULL;
+        }
+        send_request(client);
+    }
+
+    struct sim_endpoint* endpoint;
+    while ((endpoint = sim_next_activity())) {
+        struct client* client = sim_user(endpoint);
+        if (!client) {
+            // the backend echoes everything
+            size_t received = sim_receive(endpoint, SIZE_MAX);
+            if (sim_proxy_closed(endpoint)) {
+                sim_release(endpoint);
+            }
+            else if (received > 0) {
+                sim_send(endpoint, NULL, received);
+            }
+            continue;
+        }
+        client->received += sim_receive(endpoint, SIZE_MAX);
+        if (sim_proxy_closed(endpoint)) {
+            if (client->closing || client->kind == IDLE || client->kind == RESET || client->received < client->expected) {
+                finish_client(client);
+            }
+            else {
+                fprintf(stderr, "Connection closed before it was done\n");
+                exit(1);
+            }
+        }
+        else if (!client->closing && client->kind == RESET && client->received >= client->expected / 2) {
+            client->closing = true;
+            sim_reset(endpoint);
+        }
+        else if (!client->closing && client->received >= client->expected) {
+            client->closing = true;
+            sim_close(endpoint);
+        }
+    }
+
+    while (active < concurrency && started < total) {
+        start_client();
+    }
+    if (finished == total) {
+        sim_stop();
+        return -1;
+    }
+    return send_first ? (int64_t)send_first->send_at : -1;
+}
+
+static double seconds(void) {
+    struct timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return (double)tm.tv_sec + (double)tm.tv_nsec / 1e9;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-n connections] [-c concurrency] [-s request size] [-i idle %%] [-r reset %%] [-f refused %%]\n", name);
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:s:i:r:f:")) != -1) {
+        switch (opt) {
+            case 'n': total = strtoull(optarg, NULL, 10); break;
+            case 'c': concurrency = strtoull(optarg, NULL, 10); break;
+            case 's': request_size = strtoull(optarg, NULL, 10); break;
+            case 'i': percentage[IDLE] = (uint32_t)atoi(optarg); break;
+            case 'r': percentage[RESET] = (uint32_t)atoi(optarg); break;
+            case 'f': refuse_percentage = (uint32_t)atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (total == 0 || concurrency == 0 || request_size < strlen(REQUEST_START) + strlen(KNOCK) || percentage[IDLE] + percentage[RESET] > 100) {
+        usage(argv[0]);
+    }
+    percentage[HIDDEN] = percentage[NORMAL] = (100 - percentage[IDLE] - percentage[RESET]) / 2;
+
+    clients = calloc(concurrency, sizeof(struct client));
+    if (!clients) {
+        perror("Cannot allocate clients");
+        return 1;
+    }
+    for (uint64_t i = 0; i < concurrency; i++) {
+        clients[i].next = spare_clients;
+        spare_clients = &clients[i];
+    }
+
+    struct config config;
+    memset(&config, 0, sizeof(config));
+    config.external_port = LISTEN_PORT;
+    config.normal_port = NORMAL_PORT;
+    config.hidden_port = HIDDEN_PORT;
+    config.default_timeout.tv_sec = 30;
+    config.knock_timeout.tv_sec = 2;
+    config.knock_value = KNOCK;
+    config.knock_size = config.knock_secret_size = config.first_data_size = strlen(KNOCK);
+    config.threads = 1;
+    config.backlog = 128;
+    knock_cache_init(&config);
+
+    sim_init(backend_connect, drive);
+    double begin = seconds();
+    if (start(&config) != 0) {
+        fprintf(stderr, "Proxy stopped before all connections were done\n");
+        return 1;
+    }
+    double took = seconds() - begin;
+
+    const struct sim_stats* stats = sim_stats();
+    printf("connections: %lu (", (unsigned long)finished);
+    for (int k = 0; k < KINDS; k++) {
+        printf("%s%s %lu", k ? ", " : "", kind_names[k], (unsigned long)kinds[k]);
+    }
+    printf(", refused backends %lu)\n", (unsigned long)refused);
+    printf("time: %.3f s, %.0f ns per connection\n", took, took * 1e9 / (double)finished);
+    printf("simulated: %lu calls, %lu epoll_waits, %lu events, %lu MB, %.1f s of virtual time\n",
+            (unsigned long)stats->calls, (unsigned long)stats->epoll_waits, (unsigned long)stats->events,
+            (unsigned long)(stats->bytes >> 20), (double)(sim_now() - SIM_START_TIME) / 1000);
+    if (stats->open_files != 0) {
+        fprintf(stderr, "%lu descriptors were not closed\n", (unsigned long)stats->open_files);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "knock-cache.h"
+
+#define PROBE_LENGTH 8
+
+/* the coarse clock is Linux only, a second resolution is all we need */
+#ifndef CLOCK_MONOTONIC_COARSE
+#define CLOCK_MONOTONIC_COARSE CLOCK_MONOTONIC
+#endif
+
+static uint64_t slots[KNOCK_CACHE_SLOTS];
+static uint32_t ttl = 0;
+
+#define SLOT(address, expires) (((uint64_t)(address) << 32) | (expires))
+#define SLOT_ADDRESS(slot) ((uint32_t)((slot) >> 32))
+#define SLOT_EXPIRES(slot) ((uint32_t)(slot))
+
+static uint32_t now() {
+    struct timespec tm;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &tm);
+    return (uint32_t)tm.tv_sec;
+}
+
+static uint32_t slot_index(uint32_t address) {
+    // fibonacci hashing, take the top 12 bits
+    return (uint32_t)((address * 2654435769u) >> 20) % KNOCK_CACHE_SLOTS;
+}
+
+void knock_cache_init(const struct config* config) {
+    ttl = config->knock_cache_ttl;
+    memset(slots, 0, sizeof(slots));
+}
+
+void knock_cache_remember(uint32_t address) {
+    if (ttl == 0 || address == 0) {
+        return;
+    }
+    uint32_t current = now();
+    uint32_t index = slot_index(address);
+    uint32_t victim = index;
+    uint32_t victim_expires = UINT32_MAX;
+    for (uint32_t i = 0; i < PROBE_LENGTH; i++) {
+        uint32_t probe = (index + i) % KNOCK_CACHE_SLOTS;
+        uint64_t slot = __atomic_load_n(&slots[probe], __ATOMIC_RELAXED);
+        if (SLOT_ADDRESS(slot) == address || SLOT_EXPIRES(slot) <= current) {
+            victim = probe;
+            break;
+        }
+        if (SLOT_EXPIRES(slot) < victim_expires) {
+            // full, so replace the one that would expire first
+            victim = probe;
+            victim_expires = SLOT_EXPIRES(slot);
+        }
+    }
+    __atomic_store_n(&slots[victim], SLOT(address, current + ttl), __ATOMIC_RELAXED);
+}
+
+bool knock_cache_contains(uint32_t address) {
+    if (ttl == 0 || address == 0) {
+        return false;
+    }
+    uint32_t index = slot_index(address);
+    for (uint32_t i = 0; i < PROBE_LENGTH; i++) {
+        uint64_t slot = __atomic_load_n(&slots[(index + i) % KNOCK_CACHE_SLOTS], __ATOMIC_RELAXED);
+        if (SLOT_ADDRESS(slot) == address) {
+            return SLOT_EXPIRES(slot) > now();
+        }
+    }
+    return false;
+}
+
+void knock_cache_remember_peer(int socket) {
+    if (ttl == 0) {
+        return;
+    }
+    struct sockaddr_in address;
+    socklen_t address_size = sizeof(address);
+    if (getpeername(socket, (struct sockaddr*)&address, &address_size) == 0 && address.sin_family == AF_INET) {
+        knock_cache_remember(ntohl(address.sin_addr.s_addr));
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef KNOCK_CACHE_H
+#define KNOCK_CACHE_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "knock-common.h"
+
+/*
+ * Remembers the sources that recently send a correct knock, so that new
+ * connections from them can be forwarded to the hidden port right away.
+ *
+ * The cache is a fixed size open addressing table of 64bit slots (IPv4
+ * address and expiry time), shared between threads without locks: a lost
+ * update only means a source has to knock once more.
+ */
+#define KNOCK_CACHE_SLOTS 4096
+
+void knock_cache_init(const struct config* config);
+void knock_cache_remember(uint32_t address);
+bool knock_cache_contains(uint32_t address);
+/* remember the remote address of a connected socket */
+void knock_cache_remember_peer(int socket);
+
+#endif
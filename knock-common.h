@@ -2,15 +2,57 @@
 #define KNOCK_COMMON_H
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+#define MAX_FINGERPRINTS 16
+
+struct fingerprint {
+    uint8_t* value;
+    size_t size;
+};
+
+struct rate_limit {
+    /* bytes per second, 0 is unlimited */
+    uint32_t route;
+    uint32_t connection;
+};
+
 struct config {
     uint32_t external_port;
     uint32_t normal_port;
     uint32_t hidden_port;
     struct timeval default_timeout;
     struct timeval knock_timeout;
+    bool adaptive_knock;
     bool verbose;
     char* knock_value;
     size_t knock_size;
+    size_t knock_secret_size;
+    uint32_t totp_period;
+    uint32_t knock_cache_ttl;
+    struct fingerprint tarpit[MAX_FINGERPRINTS];
+    uint32_t tarpit_count;
+    uint32_t tarpit_timeout;
+    /* amount of bytes to look at before choosing where a connection goes */
+    size_t first_data_size;
+    uint32_t threads;
+    /* with more than threads, workers are started and stopped on load */
+    uint32_t max_threads;
+    /* workers of the hidden route only, 0 to share them with the normal route */
+    uint32_t hidden_threads;
+    uint32_t backlog;
+    /* send large writes with MSG_ZEROCOPY (libevent engine) */
+    bool zero_copy;
+    char* control_path;
+    /* where to record the shape of the traffic, NULL if not recording */
+    char* record_path;
+    /* HTTP routing to the hidden port, NULL if not used */
+    char* http_host;
+    size_t http_host_size;
+    char* http_path;
+    size_t http_path_size;
+    /* indexed by hidden, so the normal route comes first */
+    struct rate_limit rate_limits[2];
 };
 
 #ifdef __GNUC__
@@ -0,0 +1,84 @@
+#include <string.h>
+#include "knock-delays.h"
+
+#define RECALCULATE_EVERY 64
+
+static uint32_t bucket_of(uint32_t delay) {
+    if (delay < 8) {
+        return delay;
+    }
+    if (delay > 0x7fff) {
+        delay = 0x7fff;
+    }
+    uint32_t msb = 31 - (uint32_t)__builtin_clz(delay);
+    return (msb - 1) * 4 + ((delay >> (msb - 2)) & 3);
+}
+
+/* first delay that is no longer in the bucket */
+static uint32_t bucket_end(uint32_t bucket) {
+    if (bucket < 8) {
+        return bucket + 1;
+    }
+    uint32_t msb = bucket / 4 + 1;
+    return (5 + bucket % 4) << (msb - 2);
+}
+
+void knock_delays_init(struct knock_delays* delays, const struct config* config) {
+    memset(delays, 0, sizeof(struct knock_delays));
+    delays->adaptive = config->adaptive_knock;
+    delays->ceiling = (uint32_t)(config->knock_timeout.tv_sec * 1000);
+    delays->deadline = delays->ceiling;
+    delays->deadline_class = KNOCK_DELAYS_CLASSES - 1;
+}
+
+static void recalculate(struct knock_delays* delays) {
+    if (delays->total < KNOCK_DELAYS_MIN_SAMPLES) {
+        delays->deadline = delays->ceiling;
+        delays->deadline_class = KNOCK_DELAYS_CLASSES - 1;
+        return;
+    }
+    uint32_t wanted = delays->total - delays->total / 100;
+    uint32_t seen = 0;
+    uint32_t bucket = 0;
+    for (; bucket < KNOCK_DELAYS_BUCKETS - 1; bucket++) {
+        seen += delays->buckets[bucket];
+        if (seen >= wanted) {
+            break;
+        }
+    }
+    uint32_t end = bucket_end(bucket);
+    uint32_t deadline = end + end / 4;
+    if (deadline < KNOCK_DELAYS_MIN_DEADLINE) {
+        deadline = KNOCK_DELAYS_MIN_DEADLINE;
+    }
+    if (deadline < delays->ceiling) {
+        delays->deadline = deadline;
+        delays->deadline_class = bucket;
+    }
+    else {
+        delays->deadline = delays->ceiling;
+        delays->deadline_class = KNOCK_DELAYS_CLASSES - 1;
+    }
+}
+
+void knock_delays_record(struct knock_delays* delays, uint32_t delay) {
+    if (!delays->adaptive) {
+        return;
+    }
+    delays->buckets[bucket_of(delay)]++;
+    delays->total++;
+    if (++delays->samples % KNOCK_DELAYS_HISTORY == 0) {
+        delays->total = 0;
+        for (int i = 0; i < KNOCK_DELAYS_BUCKETS; i++) {
+            delays->buckets[i] /= 2;
+            delays->total += delays->buckets[i];
+        }
+    }
+    if (delays->samples % RECALCULATE_EVERY == 0) {
+        recalculate(delays);
+    }
+}
+
+void knock_delays_expired(struct knock_delays* delays, uint32_t waited) {
+    knock_delays_record(delays, waited > delays->deadline ? waited : delays->deadline);
+}
@@ -0,0 +1,56 @@
+#ifndef KNOCK_DELAYS_H
+#define KNOCK_DELAYS_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "knock-common.h"
+
+/*
+ * Adaptive knock timeout: a histogram of how long clients that send data
+ * first took to send it. New connections get a knock deadline just above
+ * the 99th percentile of that, so clients that wait for the server to talk
+ * first don't have to sit out the full knock timeout. The configured knock
+ * timeout stays the upper bound.
+ *
+ * Connections that are still silent at their deadline count as a delay at
+ * that deadline, so more than 1% of clients waiting for the server keep the
+ * deadline at the ceiling, as they can't be told apart from slow clients.
+ *
+ * The buckets are quarter octaves of milliseconds, and the histogram slowly
+ * forgets old samples by halving all buckets every KNOCK_DELAYS_HISTORY samples.
+ */
+#define KNOCK_DELAYS_BUCKETS 64
+#define KNOCK_DELAYS_HISTORY 8192
+#define KNOCK_DELAYS_MIN_SAMPLES 128
+#define KNOCK_DELAYS_MIN_DEADLINE 20
+/*
+ * Every deadline comes from one bucket, so connections with the same class
+ * have the same deadline. The last bucket is always above the ceiling, so
+ * its class is also used for the ceiling.
+ */
+#define KNOCK_DELAYS_CLASSES KNOCK_DELAYS_BUCKETS
+
+struct knock_delays {
+    bool adaptive;
+    uint32_t ceiling;
+    uint32_t deadline;
+    uint32_t deadline_class;
+    uint32_t samples;
+    uint32_t total;
+    uint32_t buckets[KNOCK_DELAYS_BUCKETS];
+};
+
+void knock_delays_init(struct knock_delays* delays, const struct config* config);
+/* record the delay (in ms) between accepting a connection and its first data */
+void knock_delays_record(struct knock_delays* delays, uint32_t delay);
+/*
+ * record a connection whose knock deadline expired after waited ms, at least
+ * at the current deadline, otherwise slow clients would never be seen and the
+ * deadline could only go down
+ */
+void knock_delays_expired(struct knock_delays* delays, uint32_t waited);
+/* knock deadline (in ms) for a new connection */
+#define knock_delays_deadline(delays) ((delays)->deadline)
+/* class of that deadline, below KNOCK_DELAYS_CLASSES */
+#define knock_delays_class(delays) ((delays)->deadline_class)
+
+#endif
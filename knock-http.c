@@ -0,0 +1,171 @@
+#include <ctype.h>
+#include <string.h>
+#include "knock-http.h"
+
+enum {
+    METHOD,
+    TARGET,
+    VERSION,
+    REQUEST_LINE_END,
+    LINE_LF,
+    HEADER_START,
+    HEADER_NAME,
+    HOST_SPACE,
+    HOST_VALUE,
+    HEADER_VALUE,
+};
+
+#define MAX_METHOD 16
+#define NO_MATCH UINT16_MAX
+
+static const char version[] = "HTTP/1.";
+static const char host[] = "host";
+
+static bool is_token(uint8_t c) {
+    // the bits of the characters from 0x20 to 0x7f that are valid in a method or header name
+    static const uint64_t tokens[2] = { 0xc7fffffe03ff6cfaull, 0x57ffffffull };
+    return c >= 0x20 && c < 0x80 && (tokens[(c - 0x20) >> 6] >> ((c - 0x20) & 63) & 1);
+}
+
+/* most of the head are values nobody looks at, so skip to the end of the line at once */
+static size_t skip_to(const uint8_t* data, size_t i, size_t size, uint8_t c) {
+    const uint8_t* found = memchr(data + i, c, size - i);
+    return found ? (size_t)(found - data) : size;
+}
+
+void http_route_init(struct http_route* route) {
+    memset(route, 0, sizeof(struct http_route));
+    route->state = METHOD;
+}
+
+enum http_route_result http_route_parse(struct http_route* route, const struct config* config, const uint8_t* data, size_t size) {
+    if (size > (size_t)(HTTP_ROUTE_MAX_HEAD - route->parsed)) {
+        size = HTTP_ROUTE_MAX_HEAD - route->parsed;
+    }
+    for (size_t i = 0; i < size; i++) {
+        uint8_t c = data[i];
+        switch (route->state) {
+            case METHOD:
+                if (c == ' ' && route->matched > 0) {
+                    route->state = TARGET;
+                    route->matched = 0;
+                }
+                else if (!is_token(c) || ++route->matched > MAX_METHOD) {
+                    return HTTP_ROUTE_NORMAL;
+                }
+                break;
+            case TARGET:
+                if (c == ' ') {
+                    // the prefix matched before the end of the target, if it did
+                    route->path_mismatch = config->http_path != NULL;
+                    if (!config->http_host) {
+                        return HTTP_ROUTE_NORMAL;
+                    }
+                    route->state = VERSION;
+                    route->matched = 0;
+                }
+                else if (c < ' ' || c == 0x7f) {
+                    return HTTP_ROUTE_NORMAL;
+                }
+                else if (config->http_path && !route->path_mismatch) {
+                    if (c != (uint8_t)config->http_path[route->matched]) {
+                        route->path_mismatch = true;
+                        if (!config->http_host) {
+                            return HTTP_ROUTE_NORMAL;
+                        }
+                    }
+                    else if (++route->matched == config->http_path_size) {
+                        return HTTP_ROUTE_HIDDEN;
+                    }
+                }
+                else {
+                    // the rest of the target doesn't matter (a space or the end of the segment stops it)
+                    i = skip_to(data, i, size, ' ') - 1;
+                }
+                break;
+            case VERSION:
+                if (route->matched < sizeof(version) - 1) {
+                    if (c != (uint8_t)version[route->matched++]) {
+                        return HTTP_ROUTE_NORMAL;
+                    }
+                }
+                else if (isdigit(c)) {
+                    route->state = REQUEST_LINE_END;
+                }
+                else {
+                    return HTTP_ROUTE_NORMAL;
+                }
+                break;
+            case REQUEST_LINE_END:
+                if (c == '\r') {
+                    route->state = LINE_LF;
+                }
+                else if (c == '\n') {
+                    route->state = HEADER_START;
+                }
+                else {
+                    return HTTP_ROUTE_NORMAL;
+                }
+                break;
+            case LINE_LF:
+                if (c != '\n') {
+                    return HTTP_ROUTE_NORMAL;
+                }
+                route->state = HEADER_START;
+                break;
+            case HEADER_START:
+                if (!is_token(c)) {
+                    // the end of the head (or garbage), without a Host header that matched
+                    return HTTP_ROUTE_NORMAL;
+                }
+                route->state = HEADER_NAME;
+                route->matched = 0;
+                // fall through
+            case HEADER_NAME:
+                if (c == ':') {
+                    route->state = route->matched == sizeof(host) - 1 ? HOST_SPACE : HEADER_VALUE;
+                    route->matched = 0;
+                }
+                else if (!is_token(c)) {
+                    return HTTP_ROUTE_NORMAL;
+                }
+                else if (route->matched < sizeof(host) - 1 && tolower(c) == host[route->matched]) {
+                    route->matched++;
+                }
+                else {
+                    // not the Host header, so only its end matters
+                    route->matched = NO_MATCH;
+                    i = skip_to(data, i, size, ':') - 1;
+                }
+                break;
+            case HOST_SPACE:
+                if (c == ' ' || c == '\t') {
+                    break;
+                }
+                route->state = HOST_VALUE;
+                // fall through
+            case HOST_VALUE:
+                if (route->matched < config->http_host_size) {
+                    if (tolower(c) != tolower((uint8_t)config->http_host[route->matched++])) {
+                        return HTTP_ROUTE_NORMAL;
+                    }
+                }
+                else {
+                    // the whole host, unless it continues
+                    return c == '\r' || c == '\n' || c == ':' || c == ' ' || c == '\t' ? HTTP_ROUTE_HIDDEN : HTTP_ROUTE_NORMAL;
+                }
+                break;
+            case HEADER_VALUE:
+                if (c == '\n') {
+                    route->state = HEADER_START;
+                }
+                else {
+                    // a CR is only allowed at the end, which the LF after it checks
+                    i = skip_to(data, i, size, '\n') - 1;
+                }
+                break;
+        }
+    }
+    route->parsed = (uint16_t)(route->parsed + size);
+    return route->parsed >= HTTP_ROUTE_MAX_HEAD ? HTTP_ROUTE_NORMAL : HTTP_ROUTE_MORE;
+}
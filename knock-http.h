@@ -0,0 +1,39 @@
+#ifndef KNOCK_HTTP_H
+#define KNOCK_HTTP_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "knock-common.h"
+
+/*
+ * HTTP routing: an incremental parser of the HTTP/1.x request head that
+ * decides the route as soon as it can. A request target that starts with
+ * the configured path, or a Host header with the configured host, goes to
+ * the hidden port; everything else (including a malformed head, or one
+ * longer than HTTP_ROUTE_MAX_HEAD) to the normal port.
+ *
+ * The parser only looks at every byte once, and keeps no copy: it is fed
+ * the segments as they arrive, and the caller forwards them unchanged.
+ */
+#define HTTP_ROUTE_MAX_HEAD 8192
+
+enum http_route_result {
+    HTTP_ROUTE_MORE,
+    HTTP_ROUTE_NORMAL,
+    HTTP_ROUTE_HIDDEN,
+};
+
+struct http_route {
+    uint16_t parsed;
+    uint8_t state;
+    bool path_mismatch;
+    uint16_t matched;
+};
+
+#define http_routing(config) ((config)->http_host || (config)->http_path)
+
+void http_route_init(struct http_route* route);
+/* parse the next segment of the head, the bytes after the ones parsed before */
+enum http_route_result http_route_parse(struct http_route* route, const struct config* config, const uint8_t* data, size_t size);
+
+#endif
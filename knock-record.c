@@ -0,0 +1,105 @@
+#include <string.h>
+#include "knock-record.h"
+
+#define RECORD_MAX_EVENT (1 + 4 * 10)
+
+static size_t put_number(uint8_t* target, uint64_t value) {
+    size_t size = 0;
+    while (value >= 0x80) {
+        target[size++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    target[size++] = (uint8_t)value;
+    return size;
+}
+
+static void write_event(struct recorder* recorder, uint8_t type, uint64_t connection, uint64_t a, uint64_t b, uint64_t c, int numbers) {
+    uint8_t event[RECORD_MAX_EVENT];
+    uint64_t values[4] = { connection, a, b, c };
+    size_t size = 0;
+    event[size++] = type;
+    for (int i = 0; i < numbers; i++) {
+        size += put_number(event + size, values[i]);
+    }
+    if (fwrite(event, 1, size, recorder->file) != size) {
+        // a full disk shouldn't stop the proxy, only the recording
+        perror("Cannot write recording, stopped recording");
+        fclose(recorder->file);
+        recorder->file = NULL;
+    }
+}
+
+bool recorder_open(struct recorder* recorder, const char* path, uint64_t now) {
+    memset(recorder, 0, sizeof(struct recorder));
+    recorder->file = fopen(path, "wbe");
+    if (!recorder->file) {
+        perror("Cannot open recording");
+        return false;
+    }
+    recorder->started = now;
+    recorder->flushed = now;
+    uint8_t header[sizeof(RECORD_MAGIC) - 1 + 10];
+    memcpy(header, RECORD_MAGIC, sizeof(RECORD_MAGIC) - 1);
+    size_t size = sizeof(RECORD_MAGIC) - 1 + put_number(header + sizeof(RECORD_MAGIC) - 1, RECORD_INTERVAL_MS);
+    if (fwrite(header, 1, size, recorder->file) != size) {
+        perror("Cannot write recording");
+        recorder_close(recorder);
+        return false;
+    }
+    return true;
+}
+
+void recorder_close(struct recorder* recorder) {
+    if (recorder->file) {
+        fclose(recorder->file);
+        recorder->file = NULL;
+    }
+}
+
+void recorder_flush(struct recorder* recorder, uint64_t now) {
+    if (recorder->file && now >= recorder->flushed + RECORD_FLUSH_MS) {
+        fflush(recorder->file);
+        recorder->flushed = now;
+    }
+}
+
+void record_accept(struct recorder* recorder, struct record_flow* flow, uint64_t now) {
+    memset(flow, 0, sizeof(struct record_flow));
+    if (recorder->file) {
+        flow->connection = recorder->connections++;
+        write_event(recorder, RECORD_ACCEPT, flow->connection, now - recorder->started, 0, 0, 2);
+    }
+}
+
+void record_route(struct recorder* recorder, struct record_flow* flow, uint64_t now, enum record_route route) {
+    if (recorder->file) {
+        write_event(recorder, RECORD_ROUTE, flow->connection, now - recorder->started, route, 0, 3);
+    }
+}
+
+static void flush_flow(struct recorder* recorder, struct record_flow* flow) {
+    if (flow->bytes[0] || flow->bytes[1]) {
+        write_event(recorder, RECORD_BYTES, flow->connection, flow->interval, flow->bytes[0], flow->bytes[1], 4);
+        flow->bytes[0] = flow->bytes[1] = 0;
+    }
+}
+
+void record_bytes(struct recorder* recorder, struct record_flow* flow, uint64_t now, bool to_client, uint64_t bytes) {
+    if (recorder->file) {
+        uint32_t interval = (uint32_t)((now - recorder->started) / RECORD_INTERVAL_MS);
+        if (interval != flow->interval) {
+            flush_flow(recorder, flow);
+            flow->interval = interval;
+        }
+        flow->bytes[to_client] += bytes;
+    }
+}
+
+void record_close(struct recorder* recorder, struct record_flow* flow, uint64_t now) {
+    if (recorder->file) {
+        flush_flow(recorder, flow);
+        if (recorder->file) {
+            write_event(recorder, RECORD_CLOSE, flow->connection, now - recorder->started, 0, 0, 2);
+        }
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef KNOCK_RECORD_H
+#define KNOCK_RECORD_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Workload recorder: writes the shape of the traffic, but none of the
+ * payload, to a file that test/replay.go can play back against a test
+ * instance. The file starts with RECORD_MAGIC and the interval length in
+ * ms, followed by events: a type byte and unsigned LEB128 numbers.
+ *
+ *  accept: connection, ms
+ *  route:  connection, ms, record_route
+ *  bytes:  connection, interval, bytes to the backend, bytes to the client
+ *  close:  connection, ms
+ *
+ * Connections are numbered in the order they were accepted, times are ms
+ * since the recording started and intervals are RECORD_INTERVAL_MS of
+ * those. The bytes of a connection are summed per interval, so a busy
+ * connection writes one event per interval, and an idle one nothing.
+ */
+#define RECORD_MAGIC "L7KREC1\n"
+#define RECORD_INTERVAL_MS 100
+/* how long written events may stay in the buffer of the file */
+#define RECORD_FLUSH_MS 1000
+
+enum record_event {
+    RECORD_ACCEPT = 1,
+    RECORD_ROUTE = 2,
+    RECORD_BYTES = 3,
+    RECORD_CLOSE = 4,
+};
+
+enum record_route {
+    RECORD_NORMAL = 0,
+    RECORD_HIDDEN = 1,
+    /* to the normal port, after the knock timeout */
+    RECORD_SILENT = 2,
+    RECORD_TARPIT = 3,
+};
+
+struct recorder {
+    /* NULL when not recording, or after a write failed */
+    FILE* file;
+    uint64_t started;
+    uint64_t flushed;
+    uint64_t connections;
+};
+
+/* the bytes of one connection in the current interval */
+struct record_flow {
+    uint64_t connection;
+    uint32_t interval;
+    /* indexed by the side that read them: to the backend, to the client */
+    uint64_t bytes[2];
+};
+
+/* now in ms, on any clock, as long as it is the same for all calls */
+bool recorder_open(struct recorder* recorder, const char* path, uint64_t now);
+void recorder_close(struct recorder* recorder);
+/* writes the buffered events, if the last flush was long enough ago */
+void recorder_flush(struct recorder* recorder, uint64_t now);
+
+void record_accept(struct recorder* recorder, struct record_flow* flow, uint64_t now);
+void record_route(struct recorder* recorder, struct record_flow* flow, uint64_t now, enum record_route route);
+void record_bytes(struct recorder* recorder, struct record_flow* flow, uint64_t now, bool to_client, uint64_t bytes);
+void record_close(struct recorder* recorder, struct record_flow* flow, uint64_t now);
+
+#endif
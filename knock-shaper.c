@@ -0,0 +1,49 @@
+#include "knock-shaper.h"
+
+void token_bucket_init(struct token_bucket* bucket, uint32_t rate, uint64_t now) {
+    uint64_t burst = rate / 10;
+    bucket->rate = rate;
+    bucket->burst = (burst > TOKEN_BUCKET_MIN_BURST ? burst : TOKEN_BUCKET_MIN_BURST) * 1000;
+    bucket->tokens = bucket->burst;
+    bucket->updated = now;
+}
+
+size_t token_bucket_available(struct token_bucket* bucket, uint64_t now) {
+    if (!bucket->rate) {
+        return SIZE_MAX;
+    }
+    if (now > bucket->updated) {
+        uint64_t elapsed = now - bucket->updated;
+        // a long quiet period would overflow, and fills the bucket anyway
+        if (elapsed >= bucket->burst / bucket->rate) {
+            bucket->tokens = bucket->burst;
+        }
+        else {
+            bucket->tokens += elapsed * bucket->rate;
+            if (bucket->tokens > bucket->burst) {
+                bucket->tokens = bucket->burst;
+            }
+        }
+        bucket->updated = now;
+    }
+    return (size_t)(bucket->tokens / 1000);
+}
+
+void token_bucket_take(struct token_bucket* bucket, size_t bytes) {
+    uint64_t taken = (uint64_t)bytes * 1000;
+    bucket->tokens = taken < bucket->tokens ? bucket->tokens - taken : 0;
+}
+
+uint64_t token_bucket_wait(const struct token_bucket* bucket, size_t wanted) {
+    if (!bucket->rate) {
+        return 0;
+    }
+    uint64_t needed = (uint64_t)wanted * 1000;
+    if (needed > bucket->burst) {
+        needed = bucket->burst;
+    }
+    if (bucket->tokens >= needed) {
+        return 0;
+    }
+    return (needed - bucket->tokens + bucket->rate - 1) / bucket->rate;
+}
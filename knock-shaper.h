@@ -0,0 +1,30 @@
+#ifndef KNOCK_SHAPER_H
+#define KNOCK_SHAPER_H
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Token bucket for the rate limits. Tokens are kept in thousandths of a
+ * byte, so that refilling every millisecond doesn't lose anything at low
+ * rates. The bucket holds at most a tenth of a second of traffic (but at
+ * least TOKEN_BUCKET_MIN_BURST bytes), which is what a connection can send
+ * at once after being quiet. Every call is O(1).
+ */
+#define TOKEN_BUCKET_MIN_BURST 4096
+
+struct token_bucket {
+    uint64_t rate;      /* bytes per second, 0 is unlimited */
+    uint64_t burst;     /* in thousandths of bytes */
+    uint64_t tokens;    /* in thousandths of bytes */
+    uint64_t updated;   /* ms */
+};
+
+/* rate in bytes per second, now in ms */
+void token_bucket_init(struct token_bucket* bucket, uint32_t rate, uint64_t now);
+/* bytes that can be taken now, SIZE_MAX when unlimited */
+size_t token_bucket_available(struct token_bucket* bucket, uint64_t now);
+void token_bucket_take(struct token_bucket* bucket, size_t bytes);
+/* ms until the wanted bytes (or a full bucket, if less) are available */
+uint64_t token_bucket_wait(const struct token_bucket* bucket, size_t wanted);
+
+#endif
@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "knock-tarpit.h"
+
+bool tarpit_init(struct tarpit* tarpit, const struct config* config) {
+    memset(tarpit, 0, sizeof(struct tarpit));
+    if (config->tarpit_count == 0) {
+        return true;
+    }
+    tarpit->timeout = config->tarpit_timeout;
+    tarpit->capacity = TARPIT_CAPACITY_DEFAULT;
+    tarpit->entries = malloc(tarpit->capacity * sizeof(struct tarpit_entry));
+    if (!tarpit->entries) {
+        perror("Cannot allocate tarpit");
+        return false;
+    }
+    return true;
+}
+
+void tarpit_free(struct tarpit* tarpit) {
+    tarpit_expire(tarpit, UINT32_MAX);
+    free(tarpit->entries);
+    tarpit->entries = NULL;
+}
+
+bool tarpit_matches(const struct config* config, const uint8_t* data, size_t size) {
+    for (uint32_t i = 0; i < config->tarpit_count; i++) {
+        const struct fingerprint* fingerprint = &(config->tarpit[i]);
+        if (size >= fingerprint->size && memcmp(fingerprint->value, data, fingerprint->size) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void release_first(struct tarpit* tarpit) {
+    close(tarpit->entries[tarpit->first].socket);
+    tarpit->first = (tarpit->first + 1) % tarpit->capacity;
+    tarpit->size--;
+}
+
+void tarpit_add(struct tarpit* tarpit, int socket, uint32_t now) {
+    if (tarpit->size == tarpit->capacity) {
+        release_first(tarpit);
+    }
+    // the smallest receive buffer bounds what the kernel queues for the scanner, but the window
+    // it already advertised only shrinks with the clamp
+    int smallest = 1;
+#ifdef TCP_WINDOW_CLAMP
+    setsockopt(socket, IPPROTO_TCP, TCP_WINDOW_CLAMP, &smallest, sizeof(smallest));
+#endif
+    setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &smallest, sizeof(smallest));
+
+    struct tarpit_entry* entry = &(tarpit->entries[(tarpit->first + tarpit->size) % tarpit->capacity]);
+    entry->socket = socket;
+    entry->until = now + tarpit->timeout;
+    tarpit->size++;
+}
+
+void tarpit_expire(struct tarpit* tarpit, uint32_t now) {
+    while (tarpit->size > 0 && tarpit->entries[tarpit->first].until <= now) {
+        release_first(tarpit);
+    }
+}
+
+int64_t tarpit_next(const struct tarpit* tarpit, uint32_t now) {
+    if (tarpit->size == 0) {
+        return -1;
+    }
+    uint32_t until = tarpit->entries[tarpit->first].until;
+    return until <= now ? 0 : until - now;
+}
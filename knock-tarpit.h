@@ -0,0 +1,41 @@
+#ifndef KNOCK_TARPIT_H
+#define KNOCK_TARPIT_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "knock-common.h"
+
+/*
+ * Connections that start with the fingerprint of a scanner are not proxied,
+ * but held open (without reading, with the smallest receive buffer, and on
+ * Linux the window clamped to match) until the tarpit timeout passes. They only cost their socket and an entry in a
+ * ring buffer; since they all get the same timeout, the oldest is always at
+ * the front. When the ring is full, the oldest connection is closed early.
+ */
+#define TARPIT_CAPACITY_DEFAULT 65536
+
+struct tarpit_entry {
+    int socket;
+    uint32_t until;
+};
+
+struct tarpit {
+    uint32_t timeout;
+    uint32_t capacity;
+    uint32_t first;
+    uint32_t size;
+    struct tarpit_entry* entries;
+};
+
+bool tarpit_init(struct tarpit* tarpit, const struct config* config);
+void tarpit_free(struct tarpit* tarpit);
+/* does the first data of a connection match one of the fingerprints */
+bool tarpit_matches(const struct config* config, const uint8_t* data, size_t size);
+/* take over the socket, now in seconds */
+void tarpit_add(struct tarpit* tarpit, int socket, uint32_t now);
+/* close all sockets that have been held long enough */
+void tarpit_expire(struct tarpit* tarpit, uint32_t now);
+/* seconds until the next socket is released, or -1 if empty */
+int64_t tarpit_next(const struct tarpit* tarpit, uint32_t now);
+
+#endif
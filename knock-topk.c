@@ -0,0 +1,110 @@
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include "knock-topk.h"
+
+void topk_init(struct topk* topk) {
+    memset(topk, 0, sizeof(struct topk));
+}
+
+static uint32_t slot_of(uint32_t key) {
+    return (key * 0x9e3779b1u) >> 25; // 7 bits: TOPK_SLOTS
+}
+
+/* the slot that holds the key, or the empty slot where it would go */
+static uint32_t find_slot(const struct topk* topk, uint32_t key) {
+    uint32_t slot = slot_of(key);
+    while (topk->slots[slot] && topk->heap[topk->slots[slot] - 1].key != key) {
+        slot = (slot + 1) % TOPK_SLOTS;
+    }
+    return slot;
+}
+
+/* empty the slot, and move later entries of its run back so lookups still find them */
+static void remove_slot(struct topk* topk, uint32_t slot) {
+    uint32_t hole = slot;
+    uint32_t next = (slot + 1) % TOPK_SLOTS;
+    while (topk->slots[next]) {
+        uint32_t home = slot_of(topk->heap[topk->slots[next] - 1].key);
+        // can the entry at next move to the hole without passing its home?
+        if ((next - home) % TOPK_SLOTS >= (next - hole) % TOPK_SLOTS) {
+            topk->slots[hole] = topk->slots[next];
+            topk->heap[topk->slots[hole] - 1].slot = hole;
+            hole = next;
+        }
+        next = (next + 1) % TOPK_SLOTS;
+    }
+    topk->slots[hole] = 0;
+}
+
+static void place(struct topk* topk, uint32_t position, struct topk_entry entry) {
+    topk->heap[position] = entry;
+    topk->slots[entry.slot] = (uint8_t)(position + 1);
+}
+
+/* the count at position grew, so move it down to its place */
+static void sift_down(struct topk* topk, uint32_t position) {
+    struct topk_entry entry = topk->heap[position];
+    while (true) {
+        uint32_t child = position * 2 + 1;
+        if (child >= topk->size) {
+            break;
+        }
+        if (child + 1 < topk->size && topk->heap[child + 1].count < topk->heap[child].count) {
+            child++;
+        }
+        if (topk->heap[child].count >= entry.count) {
+            break;
+        }
+        place(topk, position, topk->heap[child]);
+        position = child;
+    }
+    place(topk, position, entry);
+}
+
+static void sift_up(struct topk* topk, uint32_t position) {
+    struct topk_entry entry = topk->heap[position];
+    while (position > 0 && topk->heap[(position - 1) / 2].count > entry.count) {
+        place(topk, position, topk->heap[(position - 1) / 2]);
+        position = (position - 1) / 2;
+    }
+    place(topk, position, entry);
+}
+
+void topk_add(struct topk* topk, uint32_t key, uint64_t weight) {
+    uint32_t slot = find_slot(topk, key);
+    if (topk->slots[slot]) {
+        uint32_t position = topk->slots[slot] - 1u;
+        topk->heap[position].count += weight;
+        sift_down(topk, position);
+        return;
+    }
+    if (topk->size < TOPK_SIZE) {
+        uint32_t position = topk->size++;
+        topk->heap[position] = (struct topk_entry){ key, slot, weight, 0 };
+        sift_up(topk, position);
+        return;
+    }
+    // replace the smallest, the new key might have had all of its count
+    struct topk_entry* smallest = &(topk->heap[0]);
+    remove_slot(topk, smallest->slot);
+    slot = find_slot(topk, key);
+    smallest->key = key;
+    smallest->slot = slot;
+    smallest->error = smallest->count;
+    smallest->count += weight;
+    topk->slots[slot] = 1;
+    sift_down(topk, 0);
+}
+
+static int larger_first(const void* a, const void* b) {
+    uint64_t left = ((const struct topk_entry*)a)->count;
+    uint64_t right = ((const struct topk_entry*)b)->count;
+    return left < right ? 1 : left > right ? -1 : 0;
+}
+
+size_t topk_sorted(const struct topk* topk, struct topk_entry result[TOPK_SIZE]) {
+    memcpy(result, topk->heap, topk->size * sizeof(struct topk_entry));
+    qsort(result, topk->size, sizeof(struct topk_entry), larger_first);
+    return topk->size;
+}
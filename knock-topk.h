@@ -0,0 +1,39 @@
+#ifndef KNOCK_TOPK_H
+#define KNOCK_TOPK_H
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Space-saving top-K sketch: keeps the TOPK_SIZE keys with the largest
+ * counts in fixed memory, however many different keys there are. A key
+ * that is not tracked replaces the smallest one and inherits its count,
+ * which is remembered as the error of the new count: the true count is
+ * between count - error and count, and every key with a true count above
+ * the smallest tracked count is in the sketch.
+ *
+ * The entries form a min-heap on count, with an open addressing table from
+ * key to heap position, so an update is O(log TOPK_SIZE).
+ */
+#define TOPK_SIZE 64
+#define TOPK_SLOTS (TOPK_SIZE * 2)
+
+struct topk_entry {
+    uint32_t key;
+    uint32_t slot;
+    uint64_t count;
+    uint64_t error;
+};
+
+struct topk {
+    struct topk_entry heap[TOPK_SIZE];
+    /* heap position + 1 of the key hashed here, 0 for an empty slot */
+    uint8_t slots[TOPK_SLOTS];
+    uint32_t size;
+};
+
+void topk_init(struct topk* topk);
+void topk_add(struct topk* topk, uint32_t key, uint64_t weight);
+/* copies the entries to result, largest count first, returns the amount */
+size_t topk_sorted(const struct topk* topk, struct topk_entry result[TOPK_SIZE]);
+
+#endif
@@ -0,0 +1,195 @@
+#include <string.h>
+#include "knock-totp.h"
+
+#define SHA1_BLOCK 64
+#define SHA1_DIGEST 20
+
+struct sha1 {
+    uint32_t state[5];
+    uint64_t size;
+    uint8_t block[SHA1_BLOCK];
+};
+
+static uint32_t rol(uint32_t value, int bits) {
+    return (value << bits) | (value >> (32 - bits));
+}
+
+static void sha1_compress(struct sha1* ctx) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)ctx->block[i * 4] << 24 | (uint32_t)ctx->block[i * 4 + 1] << 16 | (uint32_t)ctx->block[i * 4 + 2] << 8 | ctx->block[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3], e = ctx->state[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        }
+        else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        }
+        else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        }
+        else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        uint32_t temp = rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol(b, 30);
+        b = a;
+        a = temp;
+    }
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+    ctx->state[4] += e;
+}
+
+static void sha1_init(struct sha1* ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xEFCDAB89;
+    ctx->state[2] = 0x98BADCFE;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xC3D2E1F0;
+    ctx->size = 0;
+}
+
+static void sha1_update(struct sha1* ctx, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        ctx->block[ctx->size++ % SHA1_BLOCK] = data[i];
+        if (ctx->size % SHA1_BLOCK == 0) {
+            sha1_compress(ctx);
+        }
+    }
+}
+
+static void sha1_final(struct sha1* ctx, uint8_t* digest) {
+    uint64_t bits = ctx->size * 8;
+    uint8_t padding = 0x80;
+    sha1_update(ctx, &padding, 1);
+    padding = 0;
+    while (ctx->size % SHA1_BLOCK != SHA1_BLOCK - 8) {
+        sha1_update(ctx, &padding, 1);
+    }
+    for (int i = 7; i >= 0; i--) {
+        uint8_t b = (uint8_t)(bits >> (i * 8));
+        sha1_update(ctx, &b, 1);
+    }
+    for (int i = 0; i < 5; i++) {
+        digest[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)ctx->state[i];
+    }
+}
+
+static void hmac_sha1(const uint8_t* key, size_t key_size, const uint8_t* data, size_t size, uint8_t* digest) {
+    uint8_t key_block[SHA1_BLOCK];
+    memset(key_block, 0, SHA1_BLOCK);
+    struct sha1 ctx;
+    if (key_size > SHA1_BLOCK) {
+        sha1_init(&ctx);
+        sha1_update(&ctx, key, key_size);
+        sha1_final(&ctx, key_block);
+    }
+    else {
+        memcpy(key_block, key, key_size);
+    }
+
+    uint8_t pad[SHA1_BLOCK];
+    for (int i = 0; i < SHA1_BLOCK; i++) {
+        pad[i] = key_block[i] ^ 0x36;
+    }
+    uint8_t inner[SHA1_DIGEST];
+    sha1_init(&ctx);
+    sha1_update(&ctx, pad, SHA1_BLOCK);
+    sha1_update(&ctx, data, size);
+    sha1_final(&ctx, inner);
+
+    for (int i = 0; i < SHA1_BLOCK; i++) {
+        pad[i] = key_block[i] ^ 0x5c;
+    }
+    sha1_init(&ctx);
+    sha1_update(&ctx, pad, SHA1_BLOCK);
+    sha1_update(&ctx, inner, SHA1_DIGEST);
+    sha1_final(&ctx, digest);
+}
+
+void totp_token(const uint8_t* secret, size_t secret_size, uint64_t window, char* result) {
+    uint8_t counter[8];
+    for (int i = 7; i >= 0; i--) {
+        counter[i] = (uint8_t)window;
+        window >>= 8;
+    }
+    uint8_t digest[SHA1_DIGEST];
+    hmac_sha1(secret, secret_size, counter, sizeof(counter), digest);
+
+    /* dynamic truncation */
+    int offset = digest[SHA1_DIGEST - 1] & 0xf;
+    uint32_t code = ((uint32_t)(digest[offset] & 0x7f) << 24) | (uint32_t)digest[offset + 1] << 16 | (uint32_t)digest[offset + 2] << 8 | digest[offset + 3];
+    for (int i = TOTP_DIGITS - 1; i >= 0; i--) {
+        result[i] = (char)('0' + code % 10);
+        code /= 10;
+    }
+}
+
+static void refresh_tokens(struct knock_matcher* matcher, uint64_t window) {
+    const struct config* config = matcher->config;
+    for (int i = 0; i < TOTP_WINDOWS; i++) {
+        totp_token((const uint8_t*)config->knock_value, config->knock_secret_size, window + i - 1, matcher->tokens[i]);
+    }
+    matcher->window = window;
+}
+
+void knock_matcher_init(struct knock_matcher* matcher, const struct config* config) {
+    matcher->config = config;
+    if (config->totp_period) {
+        refresh_tokens(matcher, (uint64_t)time(NULL) / config->totp_period);
+    }
+}
+
+bool knock_matches(struct knock_matcher* matcher, const uint8_t* data, size_t size) {
+    const struct config* config = matcher->config;
+    if (size != config->knock_size) {
+        return false;
+    }
+    if (!config->totp_period) {
+        return memcmp(config->knock_value, data, size) == 0;
+    }
+    uint64_t window = (uint64_t)time(NULL) / config->totp_period;
+    if (window != matcher->window) {
+        refresh_tokens(matcher, window);
+    }
+    for (int i = 0; i < TOTP_WINDOWS; i++) {
+        if (memcmp(matcher->tokens[i], data, TOTP_DIGITS) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool knock_prefix_matches(const struct knock_matcher* matcher, const uint8_t* data, size_t size) {
+    const struct config* config = matcher->config;
+    if (size > config->knock_size) {
+        return false;
+    }
+    if (!config->totp_period) {
+        return memcmp(config->knock_value, data, size) == 0;
+    }
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] < '0' || data[i] > '9') {
+            return false;
+        }
+    }
+    return true;
+}
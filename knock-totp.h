@@ -0,0 +1,33 @@
+#ifndef KNOCK_TOTP_H
+#define KNOCK_TOTP_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "knock-common.h"
+
+/*
+ * Time based knocks: instead of the static knock string, the client has to
+ * send the 8 digit TOTP (RFC 6238, HMAC-SHA1) of the knock string for the
+ * current time window. The tokens of the previous, current and next window
+ * are calculated once when the window changes, so checking a new connection
+ * never has to calculate a HMAC.
+ */
+#define TOTP_DIGITS 8
+#define TOTP_WINDOWS 3
+
+struct knock_matcher {
+    const struct config* config;
+    uint64_t window;
+    char tokens[TOTP_WINDOWS][TOTP_DIGITS];
+};
+
+void knock_matcher_init(struct knock_matcher* matcher, const struct config* config);
+bool knock_matches(struct knock_matcher* matcher, const uint8_t* data, size_t size);
+/* could the (incomplete) data still become a knock */
+bool knock_prefix_matches(const struct knock_matcher* matcher, const uint8_t* data, size_t size);
+
+/* write the TOTP_DIGITS digits (without a terminating zero) for the window */
+void totp_token(const uint8_t* secret, size_t secret_size, uint64_t window, char* result);
+
+#endif
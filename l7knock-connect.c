@@ -0,0 +1,217 @@
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <argp.h>
+
+#include "knock-common.h"
+#include "knock-totp.h"
+
+/*
+ * Client side of the hidden route: connects to l7knockknock, sends the
+ * knock and then connects stdin and stdout to the socket, so it can be
+ * used as an ssh ProxyCommand:
+ *
+ *    ssh -o ProxyCommand='l7knock-connect %h 443 PASSWORD' user@host
+ *
+ * Both directions get their own thread with blocking io. When the other
+ * side is a pipe (like it is for a ProxyCommand) the data is spliced, so
+ * it never gets copied through this process; otherwise it falls back to
+ * read and write.
+ */
+#define CHUNK (64 * 1024)
+
+#define STR(X) #X
+#define ASSTR(X) STR(X)
+
+struct options {
+    const char* host;
+    const char* port;
+    const char* knock;
+    uint32_t totp_period;
+};
+
+static struct options options;
+
+const char *argp_program_version = "l7knock-connect 0.1";
+const char *argp_program_bug_address = "<davy.landman@gmail.com>";
+static const char *doc = "l7knock-connect -- knock on l7knockknock and connect stdin and stdout to the hidden port";
+
+static const char *args_doc = "HOST PORT KNOCK_KNOCK_STRING";
+
+static struct argp_option argp_options[] =
+{
+    {"totp", 'x', "seconds", 0, "Send the " ASSTR(TOTP_DIGITS) " digit TOTP of KNOCK_KNOCK_STRING as knock, for the --totp of the proxy", 0},
+    {0,0,0,0,0,0}
+};
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+    switch(key) {
+        case 'x': {
+            char* end;
+            unsigned long period = strtoul(arg, &end, 10);
+            if (*end != '\0' || period < 5 || period > 3600) {
+                fprintf(stderr, "Invalid amount of seconds: %s\n", arg);
+                argp_usage(state);
+            }
+            options.totp_period = (uint32_t)period;
+            break;
+        }
+        case ARGP_KEY_ARG:
+            switch (state->arg_num) {
+                case 0: options.host = arg; break;
+                case 1: options.port = arg; break;
+                case 2: options.knock = arg; break;
+                default: argp_usage(state);
+            }
+            break;
+        case ARGP_KEY_END:
+            if (state->arg_num < 3) {
+                argp_usage(state);
+            }
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static int connect_to(const char* host, const char* port) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* addresses;
+    int error = getaddrinfo(host, port, &hints, &addresses);
+    if (error != 0) {
+        fprintf(stderr, "Cannot resolve %s: %s\n", host, gai_strerror(error));
+        return -1;
+    }
+    int result = -1;
+    for (struct addrinfo* address = addresses; address && result == -1; address = address->ai_next) {
+        result = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (result != -1) {
+            // SOCK_CLOEXEC is not there on every platform
+            fcntl(result, F_SETFD, FD_CLOEXEC);
+        }
+        if (result != -1 && connect(result, address->ai_addr, address->ai_addrlen) != 0) {
+            close(result);
+            result = -1;
+        }
+    }
+    if (result == -1) {
+        perror("Cannot connect");
+    }
+    freeaddrinfo(addresses);
+    return result;
+}
+
+static bool write_all(int target, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(target, data, size);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+static bool send_knock(int target) {
+    if (!options.totp_period) {
+        return write_all(target, (const uint8_t*)options.knock, strlen(options.knock));
+    }
+    char token[TOTP_DIGITS];
+    totp_token((const uint8_t*)options.knock, strlen(options.knock), (uint64_t)time(NULL) / options.totp_period, token);
+    return write_all(target, (const uint8_t*)token, TOTP_DIGITS);
+}
+
+/* copy until the end of the source, false on an error */
+static bool copy(int source, int target) {
+    bool use_splice = true;
+    uint8_t* buffer = NULL;
+    while (true) {
+        ssize_t size;
+#ifdef __linux__
+        if (use_splice) {
+            size = splice(source, NULL, target, NULL, CHUNK, SPLICE_F_MOVE);
+            if (size == -1 && errno == EINVAL) {
+                // neither side is a pipe, or one of them can't be spliced
+                use_splice = false;
+                continue;
+            }
+        }
+        else
+#endif
+        {
+            if (!buffer && !(buffer = malloc(CHUNK))) {
+                perror("Cannot allocate buffer");
+                return false;
+            }
+            size = read(source, buffer, CHUNK);
+            if (size > 0 && !write_all(target, buffer, (size_t)size)) {
+                size = -1;
+            }
+        }
+        if (size == -1 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            free(buffer);
+            return size == 0;
+        }
+    }
+}
+
+static void* upstream(void* arg) {
+    int connection = *(int*)arg;
+    if (!copy(STDIN_FILENO, connection)) {
+        perror("Error sending");
+    }
+    // let the other side know we are done, but keep reading its answer
+    shutdown(connection, SHUT_WR);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    struct argp argp = {argp_options, parse_opt, args_doc, doc, NULL, NULL, NULL};
+    argp_parse(&argp, argc, argv, 0, 0, NULL);
+
+    int connection = connect_to(options.host, options.port);
+    if (connection == -1) {
+        return 1;
+    }
+    int one = 1;
+    setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (!send_knock(connection)) {
+        perror("Cannot send knock");
+        return 1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, upstream, &connection) != 0) {
+        perror("Cannot start thread");
+        return 1;
+    }
+    bool ok = copy(connection, STDOUT_FILENO);
+    if (!ok) {
+        perror("Error receiving");
+    }
+    // the server is done, so whatever stdin still has doesn't matter
+    return ok ? 0 : 1;
+}
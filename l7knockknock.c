@@ -6,10 +6,13 @@
 #include <stdio.h>
 #include <errno.h>
 #include <signal.h>
+#include <sys/resource.h>
 
 #include <argp.h>
 
 #include "knock-common.h"
+#include "knock-totp.h"
+#include "knock-cache.h"
 #ifdef USE_SPLICE
 #include "proxy-splice.h"
 #else
@@ -22,6 +25,10 @@
 #define NORMAL_PORT_DEFAULT 8443
 #define DEFAULT_TIMEOUT_DEFAULT 30
 #define KNOCK_TIMEOUT_DEFAULT 2
+#define THREADS_DEFAULT 1
+#define BACKLOG_DEFAULT 128
+#define TARPIT_TIMEOUT_DEFAULT 600
+#define MAX_RATE_LIMIT (UINT32_MAX / 1024)
 
 #define STR(X) #X
 #define ASSTR(X) STR(X)
@@ -45,6 +52,21 @@ static struct argp_option options[] =
     {"hiddenPort", 's', "port", 0, "Port to forward hidden traffic to, default: " ASSTR(HIDDEN_PORT_DEFAULT), 0},
     {"proxyTimeout", 'o', "seconds", 0, "Seconds before timeout is assumed and connection is closed, default: " ASSTR(DEFAULT_TIMEOUT_DEFAULT), 0},
     {"knockTimeout", 'k', "seconds", 0, "Seconds after which we assume no knock-knock will occur, default: " ASSTR(KNOCK_TIMEOUT_DEFAULT), 0},
+    {"totp", 'x', "seconds", 0, "Expect the " ASSTR(TOTP_DIGITS) " digit TOTP of KNOCK_KNOCK_STRING as knock, valid for the given amount of seconds (plus one window before and after)", 0},
+    {"rememberKnock", 'r', "seconds", 0, "Forward new connections from a source that knocked correctly in the last seconds straight to the hidden port, default: 0 (disabled)", 0},
+    {"adaptiveKnock", 'a', 0, 0, "Shorten the knock timeout to just above the time in which almost all clients that talk first send their first data", 0},
+    {"tarpit", 'f', "fingerprint", 0, "Hold connections that start with the fingerprint (\\r, \\n, \\t, \\\\ and \\xHH escapes) open without forwarding them, can be repeated", 0},
+    {"tarpitTimeout", 'T', "seconds", 0, "Seconds to hold a tarpitted connection, default: " ASSTR(TARPIT_TIMEOUT_DEFAULT), 0},
+    {"threads", 't', "count", 0, "Amount of worker threads, the minimum with --maxThreads (libevent engine only, only Linux spreads new connections over them, elsewhere one thread accepts them all), default: " ASSTR(THREADS_DEFAULT), 0},
+    {"maxThreads", 'm', "count", 0, "Start more worker threads while the others are busy, up to this amount, and stop them again when they are idle (libevent engine only), default: the --threads", 0},
+    {"hiddenThreads", 'd', "count", 0, "Move the connections of the hidden route to a pool of worker threads of their own, on CPUs of their own if there are enough (libevent engine only, only Linux pins them, elsewhere they run unpinned), default: 0 (disabled)", 0},
+    {"backlog", 'b', "connections", 0, "Length of the queue of pending connections, default: " ASSTR(BACKLOG_DEFAULT), 0},
+    {"zeroCopy", 'z', 0, 0, "Send output of at least 32 KB with MSG_ZEROCOPY instead of copying it to the kernel (libevent engine only, Linux 4.14 or newer)", 0},
+    {"control", 'c', "path", 0, "Unix socket to list and kill connections on (splice engine only)", 0},
+    {"record", 'R', "path", 0, "Record the timing and sizes (not the data) of all connections to this file, for test/replay.go (splice engine only)", 0},
+    {"httpHost", 'H', "host", 0, "Forward HTTP requests for this host (the Host header) to the hidden port", 0},
+    {"httpPath", 'P', "prefix", 0, "Forward HTTP requests for paths that start with the prefix to the hidden port", 0},
+    {"rateLimit", 'l', "route:KB/s[:KB/s]", 0, "Limit the bandwidth of all connections of a route (normal or hidden) together, and optionally of every connection, 0 is unlimited, can be repeated (splice engine only)", 0},
     {0,0,0,0,0,0}
 };
 
@@ -54,9 +76,27 @@ static void fill_defaults() {
     config.hidden_port = HIDDEN_PORT_DEFAULT;
     config.default_timeout.tv_sec = DEFAULT_TIMEOUT_DEFAULT;
     config.knock_timeout.tv_sec = KNOCK_TIMEOUT_DEFAULT;
+    config.adaptive_knock = false;
     config.verbose = false;
     config.knock_value = NULL;
     config.knock_size = 0;
+    config.knock_secret_size = 0;
+    config.totp_period = 0;
+    config.knock_cache_ttl = 0;
+    config.tarpit_count = 0;
+    config.tarpit_timeout = TARPIT_TIMEOUT_DEFAULT;
+    config.threads = THREADS_DEFAULT;
+    config.max_threads = 0;
+    config.hidden_threads = 0;
+    config.backlog = BACKLOG_DEFAULT;
+    config.zero_copy = false;
+    config.control_path = NULL;
+    config.record_path = NULL;
+    config.http_host = NULL;
+    config.http_host_size = 0;
+    config.http_path = NULL;
+    config.http_path_size = 0;
+    memset(config.rate_limits, 0, sizeof(config.rate_limits));
 }
 
 #define PARSE_NUMBER(type, result, MIN, MAX, source, error, state) {\
@@ -74,6 +114,79 @@ static void fill_defaults() {
     result = (type)___res;\
 }
 
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* replace the escapes in place, returns the new size or 0 if invalid */
+static size_t unescape(char* value) {
+    size_t result = 0;
+    for (char* c = value; *c; c++) {
+        if (*c != '\\') {
+            value[result++] = *c;
+            continue;
+        }
+        c++;
+        switch (*c) {
+            case 'r': value[result++] = '\r'; break;
+            case 'n': value[result++] = '\n'; break;
+            case 't': value[result++] = '\t'; break;
+            case '\\': value[result++] = '\\'; break;
+            case 'x':
+                if (hex_digit(c[1]) < 0 || hex_digit(c[2]) < 0) {
+                    return 0;
+                }
+                value[result++] = (char)(hex_digit(c[1]) << 4 | hex_digit(c[2]));
+                c += 2;
+                break;
+            default:
+                return 0;
+        }
+    }
+    return result;
+}
+
+/* ROUTE:KBPS[:KBPS_PER_CONNECTION], returns false if invalid */
+static bool parse_rate_limit(char* value) {
+    char* rates = strchr(value, ':');
+    if (!rates) {
+        return false;
+    }
+    *rates++ = '\0';
+    struct rate_limit* limit;
+    if (strcmp(value, "normal") == 0) {
+        limit = &config.rate_limits[0];
+    }
+    else if (strcmp(value, "hidden") == 0) {
+        limit = &config.rate_limits[1];
+    }
+    else {
+        return false;
+    }
+    char* end;
+    unsigned long long route = strtoull(rates, &end, 10);
+    unsigned long long connection = 0;
+    if (end != rates && *end == ':') {
+        rates = end + 1;
+        connection = strtoull(rates, &end, 10);
+    }
+    if (end == rates || *end != '\0' || route > MAX_RATE_LIMIT || connection > MAX_RATE_LIMIT) {
+        return false;
+    }
+    limit->route = (uint32_t)route * 1024;
+    limit->connection = (uint32_t)connection * 1024;
+    return true;
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
     switch(key) {
         case 'v':
@@ -94,6 +207,73 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         case 'k':
             PARSE_NUMBER(uint32_t, config.knock_timeout.tv_sec, 1, 5, arg, "Invalid amount of seconds", state)
             break;
+        case 't':
+            PARSE_NUMBER(uint32_t, config.threads, 1, 256, arg, "Invalid amount of threads", state)
+            break;
+        case 'm':
+            PARSE_NUMBER(uint32_t, config.max_threads, 1, 256, arg, "Invalid amount of threads", state)
+            break;
+        case 'd':
+            PARSE_NUMBER(uint32_t, config.hidden_threads, 1, 256, arg, "Invalid amount of threads", state)
+            break;
+        case 'b':
+            PARSE_NUMBER(uint32_t, config.backlog, 1, 65535, arg, "Invalid backlog size", state)
+            break;
+        case 'z':
+            config.zero_copy = true;
+            break;
+        case 'c':
+            config.control_path = arg;
+            break;
+        case 'R':
+            config.record_path = arg;
+            break;
+        case 'H':
+            config.http_host = arg;
+            config.http_host_size = strlen(arg);
+            if (config.http_host_size == 0) {
+                fprintf(stderr, "Invalid HTTP host: %s\n", arg);
+                argp_usage(state);
+            }
+            break;
+        case 'P':
+            config.http_path = arg;
+            config.http_path_size = strlen(arg);
+            if (config.http_path_size == 0 || arg[0] != '/') {
+                fprintf(stderr, "Invalid HTTP path, it should start with a /: %s\n", arg);
+                argp_usage(state);
+            }
+            break;
+        case 'l':
+            if (!parse_rate_limit(arg)) {
+                fprintf(stderr, "Invalid rate limit: %s\n", arg);
+                argp_usage(state);
+            }
+            break;
+        case 'a':
+            config.adaptive_knock = true;
+            break;
+        case 'x':
+            PARSE_NUMBER(uint32_t, config.totp_period, 5, 3600, arg, "Invalid amount of seconds", state)
+            break;
+        case 'r':
+            PARSE_NUMBER(uint32_t, config.knock_cache_ttl, 1, 24 * 3600, arg, "Invalid amount of seconds", state)
+            break;
+        case 'f':
+            if (config.tarpit_count == MAX_FINGERPRINTS) {
+                fprintf(stderr, "At most %d tarpit fingerprints are supported\n", MAX_FINGERPRINTS);
+                argp_usage(state);
+            }
+            config.tarpit[config.tarpit_count].size = unescape(arg);
+            if (config.tarpit[config.tarpit_count].size == 0) {
+                fprintf(stderr, "Invalid tarpit fingerprint: %s\n", arg);
+                argp_usage(state);
+            }
+            config.tarpit[config.tarpit_count++].value = (uint8_t*)arg;
+            break;
+        case 'T':
+            PARSE_NUMBER(uint32_t, config.tarpit_timeout, 1, 24 * 3600, arg, "Invalid amount of seconds", state)
+            break;
         case ARGP_KEY_ARG:
             if (config.knock_size > 0) {
                 argp_usage(state);
@@ -101,12 +281,29 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             }
             config.knock_value = arg;
             config.knock_size = strlen(arg);
+            config.knock_secret_size = config.knock_size;
             break;
         case ARGP_KEY_END:
             if (config.knock_size == 0) {
                 argp_usage (state);
                 return 1;
             }
+            if (config.totp_period) {
+                config.knock_size = TOTP_DIGITS;
+            }
+            if (config.max_threads == 0) {
+                config.max_threads = config.threads;
+            }
+            if (config.max_threads < config.threads) {
+                fprintf(stderr, "The --maxThreads (%u) should not be less than the --threads (%u)\n", config.max_threads, config.threads);
+                argp_usage(state);
+            }
+            config.first_data_size = config.knock_size;
+            for (uint32_t i = 0; i < config.tarpit_count; i++) {
+                if (config.tarpit[i].size > config.first_data_size) {
+                    config.first_data_size = config.tarpit[i].size;
+                }
+            }
             break;
         default:
             return ARGP_ERR_UNKNOWN;
@@ -119,13 +316,26 @@ void term_handler(int UNUSED(signum)) {
 }
 
 
+/* every connection takes a few file descriptors, so don't stop at the soft limit */
+static void raise_fd_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+            perror("setrlimit");
+        }
+    }
+}
+
 int main(int argc, char **argv) {
     signal(SIGTERM, term_handler);
+    raise_fd_limit();
 
     fill_defaults();
 
     struct argp argp = {options, parse_opt, args_doc, doc, NULL, NULL, NULL};
     argp_parse (&argp, argc, argv, 0, 0, NULL);
+    knock_cache_init(&config);
 
     return start(&config);
 }
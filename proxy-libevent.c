@@ -3,20 +3,59 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <signal.h>
+#include <stdio.h>
+#include <time.h>
 
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
 #include <fcntl.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
+#include <event2/listener.h>
+#include <event2/thread.h>
+#include <pthread.h>
 
 #include "knock-common.h"
+#include "knock-totp.h"
+#include "knock-cache.h"
+#include "knock-delays.h"
+#include "knock-tarpit.h"
+#include "knock-http.h"
 
 #define MAX_RECV_BUF_DEFAULT 2 << 16
+/* stop reading from one side when the other side has this much pending output */
+#define MAX_SEND_BUF_HIGH (2 << 18)
+/* and start reading again once it has drained to this amount */
+#define MAX_SEND_BUF_LOW (2 << 16)
+/* how often the workers compare their load */
+#define BALANCE_INTERVAL_MS 1000
+/* a connection that moves this much in one interval is a bulk flow */
+#define BALANCE_HEAVY_BYTES (1 << 20)
+/* busy fraction (in per mille) of the workers to start another one above */
+#define SCALE_UP_BUSY 650
+/* and to stop one below, if the rest would still stay under this */
+#define SCALE_DOWN_BUSY 400
+/* intervals to wait after starting or stopping a worker, before the next change */
+#define SCALE_COOLDOWN 3
+/* intervals a retiring worker keeps receiving migrations it has to pass on */
+#define RETIRE_GRACE 2
+/* with --zeroCopy, output of at least this much is sent with MSG_ZEROCOPY, smaller writes are cheaper to copy */
+#define ZEROCOPY_MIN_SEND (2 << 14)
+/* zero copy sends of one side that can wait for their completion at the same time */
+#define ZEROCOPY_MAX_SENDS 64
+/* chains of the buffer per send */
+#define ZEROCOPY_MAX_IOV 16
 
 static struct config* config;
 
@@ -29,7 +68,11 @@ static struct config* config;
  *    timeout
  *
  * initial_read: new connection send some data
- *    check the first byte and create pipe to either SSH_PORT or SSL_PORT
+ *    record how long it took (for the adaptive knock timeout),
+ *    check the first bytes and create pipe to either SSH_PORT or SSL_PORT,
+ *    or move a scanner to the tarpit
+ *    with HTTP routing, feed the new segments of the request head to the
+ *    parser, until it knows the route
  *
  * initial_error: new connection failed or timed-out
  *    in case of a timeout, create pipe to SSH_PORT
@@ -39,6 +82,7 @@ static struct config* config;
  * --- back connection "handshake" ---
  * create_pipe: 
  *     open connection to either SSH_PORT or SSL_PORT
+ *     (remembered sources skip the initial handshake, and come here directly)
  *
  * back_connection: the back connection was established or failed
  *     if everything went fine, connect the two buffer events in a 2-way pipe.
@@ -49,20 +93,232 @@ static struct config* config;
  *
  * pipe_read: new data is available
  *      if the other side is still active, copy data from source to target
- *      else if other side is closed, just drain the buffer
+ *      if that makes the output of the target grow beyond MAX_SEND_BUF_HIGH,
+ *      stop reading from the source until the target has drained.
+ *      else if other side is closed, just drain the buffer, and close once
+ *      everything for our side is written
+ *      if this worker has more bulk flows than another one, and the
+ *      connection was one of them in the last interval, migrate it.
+ *      with a pool for the hidden route, a hidden connection migrates to
+ *      that pool the first time it gets here.
+ *
+ * strip_knock: first data of a remembered source
+ *      drop the knock, if it still sends one, and continue as pipe_read
+ *
+ * pipe_drained: the output of the target dropped below MAX_SEND_BUF_LOW
+ *      start reading from the source again
+ *
+ * zerocopy_send: with --zeroCopy, output of at least ZEROCOPY_MIN_SEND
+ *      (and all output behind it) is taken from the bufferevent and sent
+ *      with MSG_ZEROCOPY instead.
+ *
+ * zerocopy_ready: the socket has room again, or completions of the zero
+ *      copy sends arrived, which release their chains.
+ *      continue sending, and close a draining connection once all is
+ *      delivered.
  *
  * pipe_error: something went wrong in one direction of the pipe
- *      if there was a timeout in reading or writing and we are the first
+ *      if there was a timeout in reading and we are the first
  *      direction of the pipe to notice this, do nothing.
  *      if there was a timeout and the other direction also had a timeout, we
  *      close our connection.
- *      if there was any other error, we also close our connection.
+ *      if the target did not accept any of our pending output before the
+ *      timeout, or there was any other error, we also close our connection.
+ *
+ * --- migration ---
+ *
+ * migrate: hand the sockets and pending buffers of both sides to a less
+ *      loaded worker, and free the bufferevents on this one.
+ *
+ * resume_pipe: on the new worker, wrap the sockets in new bufferevents
+ *      and continue as an active pipe.
+ *
+ * dedicate: move a connection of the hidden route to the pool of workers
+ *      of the hidden route.
+ *
+ * retire_step: a retiring worker migrates all its active pipes to the
+ *      running workers, until it has no connections left.
  *   
  */
+struct connection;
+
+struct zerocopy;
+
 struct otherside {
     struct bufferevent* bev;
     struct otherside* pair;
+    struct connection* connection;
     bool other_timedout;
+    /* the large writes to bev, NULL until the first one */
+    struct zerocopy* zerocopy;
+    /* the kernel numbers the zero copy sends per socket, also across workers */
+    uint32_t zerocopy_sequence;
+};
+
+struct migration;
+
+enum worker_state {
+    WORKER_STOPPED,
+    WORKER_RUNNING,
+    /* not accepting anymore, moving its connections to the others */
+    WORKER_RETIRING,
+    /* out of connections, its thread is done */
+    WORKER_RETIRED,
+};
+
+/**
+ * Every worker runs its own event loop on its own thread, with its own
+ * listener on the external port. On Linux 3.9 and newer SO_REUSEPORT lets
+ * the kernel spread the new connections over them; on macOS and the BSDs
+ * the last bound listener gets all of them, and the others only get work
+ * by migration. The kernel doesn't know which of them will become
+ * bulk flows, so every BALANCE_INTERVAL_MS a worker compares its amount of
+ * bulk flows with the others, and if it has at least two more than one of
+ * them, migrates half the difference there. A migrated connection is only
+ * owned by one worker at a time: it is pushed on the lock-free migrations
+ * stack of the new worker, which gets woken up by activating its migrate
+ * event from the other thread.
+ *
+ * With --maxThreads the first worker also decides on the amount of workers,
+ * from the busy fraction of their loops (the CPU time of their threads,
+ * which is the time they spend outside epoll_wait). When they are busy it
+ * starts another one, and when they are idle it retires the last one: that
+ * worker closes its listener, migrates all its connections away and then
+ * stops its thread, so that the first worker can join and free it.
+ *
+ * With --hiddenThreads the hidden route gets a pool of workers of its own,
+ * pinned to CPUs the other workers don't use, so a load spike on the
+ * normal route can't delay it. Those workers don't listen: once a hidden
+ * connection is piping, its worker migrates it to the pool (round robin).
+ *
+ * All bufferevents share the same few timeout durations, so they are
+ * registered as common timeouts: libevent keeps those in a queue per
+ * duration instead of in the min-heap, making a timeout reset O(1).
+ */
+struct worker {
+    /*
+     * a worker_state, changed by the first worker, except for the retiring.
+     * The others can still look at this and the load of a retired worker,
+     * so they are only changed atomically, and never reset with the rest.
+     */
+    uint32_t state;
+    /* bulk flows of the last interval, read by the other workers */
+    uint32_t load;
+
+    struct event_base *base;
+    struct evconnlistener *listener;
+    struct event *resume_event;
+    pthread_t thread;
+
+    const struct timeval *knock_timeout;
+    const struct timeval *default_timeout;
+    const struct timeval *closing_timeout;
+
+    struct knock_matcher knock_matcher;
+    struct knock_delays knock_delays;
+    /* common timeout for the current (adaptive) knock deadline */
+    uint32_t knock_deadline;
+    const struct timeval *knock_deadline_timeout;
+
+    struct tarpit tarpit;
+    struct event *tarpit_event;
+
+    uint32_t index;
+    struct event *balance_event;
+    /* bulk flows of the current interval so far */
+    uint32_t heavy;
+    uint32_t interval;
+    /* where to migrate bulk flows to, and how many */
+    struct worker *shed_to;
+    uint32_t shed_count;
+
+    struct migration *migrations;
+    /* not tied to any fd, the other workers activate it */
+    struct event *migrate_event;
+
+    uint32_t retiring_intervals;
+    /* busy fraction of the last interval in per mille, read by the first worker */
+    uint32_t busy;
+    uint64_t cpu_time;
+    uint64_t wall_time;
+    struct connection *connections;
+
+    /* in the pool of the hidden route, it only gets migrated connections */
+    bool dedicated;
+    /* the CPU of a dedicated worker, if they are pinned */
+    int cpu;
+};
+
+/**
+ * both directions of a proxied connection, allocated in one go.
+ * sides[0] is the context of the front connection (it writes to the back),
+ * sides[1] is the context of the back connection (it writes to the front).
+ */
+struct connection {
+    struct otherside sides[2];
+    struct worker* worker;
+    bool strip_knock;
+    /* going to the hidden port */
+    bool hidden;
+    uint64_t accepted;
+    struct http_route http;
+    /* bytes moved in the interval of the worker, to find the bulk flows */
+    uint64_t interval_moved;
+    uint32_t interval;
+    bool heavy;
+    /* in the list of the worker */
+    struct connection *next;
+    struct connection *previous;
+};
+
+#ifdef __linux__
+/**
+ * Writes to one socket that go out with MSG_ZEROCOPY. The kernel sends
+ * straight from the chains in the hold, so a chain is only released once
+ * every send that used it has completed. The hold starts with what the
+ * kernel took, followed by what still has to be sent, and the output that
+ * comes in meanwhile queues up behind that to stay in order.
+ *
+ * The completions arrive on the error queue of the socket, which wakes
+ * up an edge triggered event. That event is on a duplicate of the socket,
+ * as libevent doesn't mix edge and level triggered events on one fd. The
+ * duplicate also keeps the socket open when its bufferevent is freed before
+ * the completions are in.
+ */
+struct zerocopy {
+    struct evbuffer *hold;
+    /* bytes at the start of the hold the kernel took */
+    size_t sent;
+    /* size of the sends that wait for their completion, by sequence number */
+    size_t sizes[ZEROCOPY_MAX_SENDS];
+    bool completed[ZEROCOPY_MAX_SENDS];
+    uint32_t first;
+    uint32_t next;
+    /* the kernel copied after all (on loopback for example), so new output takes the normal path */
+    bool copied;
+    bool failed;
+    /* we stopped reading from the source until the hold drains */
+    bool throttled;
+    /*
+     * the output of the bufferevent is empty while the hold has data, so its
+     * write timeout can't see a peer that stopped reading, ours can
+     */
+    bool deadline;
+    evutil_socket_t notify_fd;
+    struct event *notify_event;
+    /* NULL once the bufferevent is gone, and we only wait for the completions */
+    struct otherside *writer;
+};
+#endif
+
+/* a connection on its way to another worker */
+struct migration {
+    struct migration *next;
+    struct connection *connection;
+    /* indexed like the sides: the back socket first */
+    evutil_socket_t fds[2];
+    /* what was not written to the sockets yet */
+    struct evbuffer *output[2];
 };
 
 static void set_tcp_no_delay(evutil_socket_t fd)
@@ -74,24 +330,410 @@ static void set_tcp_no_delay(evutil_socket_t fd)
 }
 
 
+static void attach_connection(struct worker* worker, struct connection* connection) {
+    connection->worker = worker;
+    connection->previous = NULL;
+    connection->next = worker->connections;
+    if (worker->connections) {
+        worker->connections->previous = connection;
+    }
+    worker->connections = connection;
+}
+
+static void detach_connection(struct connection* connection) {
+    if (connection->previous) {
+        connection->previous->next = connection->next;
+    }
+    else {
+        connection->worker->connections = connection->next;
+    }
+    if (connection->next) {
+        connection->next->previous = connection->previous;
+    }
+}
+
+static void zerocopy_release(struct otherside* writer);
+
+static void free_connection(struct connection* connection) {
+    detach_connection(connection);
+    zerocopy_release(&(connection->sides[0]));
+    zerocopy_release(&(connection->sides[1]));
+    free(connection);
+}
+
+/**
+ * zero copy sends
+ */
+static void pipe_error(struct bufferevent *bev, short error, void *ctx);
+#ifdef __linux__
+static void zerocopy_ready(evutil_socket_t fd, short event, void *arg);
+
+/* set when the kernel refuses SO_ZEROCOPY, so we stop asking */
+static bool __zerocopy_unsupported;
+
+static struct zerocopy* zerocopy_new(struct otherside* writer) {
+    evutil_socket_t fd = bufferevent_getfd(writer->bev);
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+        if (!__atomic_exchange_n(&__zerocopy_unsupported, true, __ATOMIC_RELAXED)) {
+            perror("setsockopt/zerocopy");
+        }
+        return NULL;
+    }
+    struct zerocopy* zc = calloc(1, sizeof(struct zerocopy));
+    if (!zc) {
+        return NULL;
+    }
+    zc->notify_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    zc->hold = evbuffer_new();
+    if (zc->notify_fd != -1) {
+        zc->notify_event = event_new(writer->connection->worker->base, zc->notify_fd, EV_WRITE | EV_ET | EV_PERSIST, zerocopy_ready, zc);
+    }
+    if (!zc->hold || !zc->notify_event || event_add(zc->notify_event, NULL) != 0) {
+        if (zc->notify_event) {
+            event_free(zc->notify_event);
+        }
+        if (zc->notify_fd != -1) {
+            close(zc->notify_fd);
+        }
+        if (zc->hold) {
+            evbuffer_free(zc->hold);
+        }
+        free(zc);
+        return NULL;
+    }
+    zc->writer = writer;
+    /* a migrated socket continues where the sends on the last worker stopped */
+    zc->first = writer->zerocopy_sequence;
+    zc->next = writer->zerocopy_sequence;
+    return zc;
+}
+
+static void zerocopy_free(struct zerocopy* zc) {
+    event_free(zc->notify_event);
+    close(zc->notify_fd);
+    evbuffer_free(zc->hold);
+    free(zc);
+}
+
+static bool zerocopy_idle(struct zerocopy* zc) {
+    return !zc || (zc->first == zc->next && evbuffer_get_length(zc->hold) == 0);
+}
+
+/* release the chains of the sends that completed, in order */
+static void zerocopy_reap(struct zerocopy* zc) {
+    for (;;) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(zc->notify_fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            if (!(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR) && !(cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err error;
+            memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+            if (error.ee_origin != SO_EE_ORIGIN_ZEROCOPY || error.ee_errno != 0) {
+                continue;
+            }
+            if (error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zc->copied = true;
+            }
+            /* an inclusive range of sequence numbers */
+            uint32_t count = error.ee_data - error.ee_info + 1;
+            for (uint32_t i = 0; i < count && i < ZEROCOPY_MAX_SENDS; i++) {
+                uint32_t id = error.ee_info + i;
+                if (id - zc->first < zc->next - zc->first) {
+                    zc->completed[id % ZEROCOPY_MAX_SENDS] = true;
+                }
+            }
+        }
+    }
+    while (zc->first != zc->next && zc->completed[zc->first % ZEROCOPY_MAX_SENDS]) {
+        size_t size = zc->sizes[zc->first % ZEROCOPY_MAX_SENDS];
+        evbuffer_drain(zc->hold, size);
+        zc->sent -= size;
+        zc->first++;
+    }
+}
+
+/* send what the kernel didn't take yet, until the socket or the sequence numbers are full */
+static void zerocopy_flush(struct zerocopy* zc) {
+    size_t held = evbuffer_get_length(zc->hold);
+    size_t unsent = held - zc->sent;
+    zerocopy_reap(zc);
+    while (!zc->failed && zc->sent < evbuffer_get_length(zc->hold) && zc->next - zc->first < ZEROCOPY_MAX_SENDS) {
+        struct evbuffer_ptr start;
+        evbuffer_ptr_set(zc->hold, &start, zc->sent, EVBUFFER_PTR_SET);
+        struct evbuffer_iovec chains[ZEROCOPY_MAX_IOV];
+        int count = evbuffer_peek(zc->hold, -1, &start, chains, ZEROCOPY_MAX_IOV);
+        if (count > ZEROCOPY_MAX_IOV) {
+            count = ZEROCOPY_MAX_IOV;
+        }
+        struct iovec iov[ZEROCOPY_MAX_IOV];
+        for (int i = 0; i < count; i++) {
+            iov[i].iov_base = chains[i].iov_base;
+            iov[i].iov_len = chains[i].iov_len;
+        }
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = iov;
+        message.msg_iovlen = (size_t)count;
+        ssize_t written = sendmsg(zc->notify_fd, &message, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (written < 0) {
+            /* ENOBUFS: too many completions are pending, wait for them like for room */
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS && errno != EINTR) {
+                zc->failed = true;
+            }
+            break;
+        }
+        zc->sizes[zc->next % ZEROCOPY_MAX_SENDS] = (size_t)written;
+        zc->completed[zc->next % ZEROCOPY_MAX_SENDS] = false;
+        zc->next++;
+        zc->sent += (size_t)written;
+    }
+    /* the same backpressure as for the output of the bufferevent */
+    struct bufferevent* source = zc->writer->pair->bev;
+    size_t pending = evbuffer_get_length(zc->hold);
+    if (!zc->throttled && pending >= MAX_SEND_BUF_HIGH) {
+        if (source) {
+            bufferevent_disable(source, EV_READ);
+        }
+        zc->throttled = true;
+    }
+    else if (zc->throttled && pending <= MAX_SEND_BUF_LOW) {
+        if (source) {
+            bufferevent_enable(source, EV_READ);
+        }
+        zc->throttled = false;
+    }
+    /* like the write timeout of a bufferevent, it restarts whenever the kernel took or finished something */
+    if (pending == 0) {
+        if (zc->deadline) {
+            event_add(zc->notify_event, NULL);
+            zc->deadline = false;
+        }
+    }
+    else if (!zc->deadline || pending < held || pending - zc->sent < unsent) {
+        event_add(zc->notify_event, zc->writer->connection->worker->default_timeout);
+        zc->deadline = true;
+    }
+}
+
+/* take the output over if it is large, or if earlier output of ours is still unsent */
+static void zerocopy_send(struct otherside* writer) {
+    struct zerocopy* zc = writer->zerocopy;
+    struct evbuffer* output = bufferevent_get_output(writer->bev);
+    size_t length = evbuffer_get_length(output);
+    if (length == 0) {
+        return;
+    }
+    if (!zc || zc->sent == evbuffer_get_length(zc->hold)) {
+        if (length < ZEROCOPY_MIN_SEND || (zc && (zc->copied || zc->failed))) {
+            return;
+        }
+        if (!zc) {
+            if (__atomic_load_n(&__zerocopy_unsupported, __ATOMIC_RELAXED) || !(zc = zerocopy_new(writer))) {
+                return;
+            }
+            writer->zerocopy = zc;
+        }
+    }
+    /* only the socket may drain the output of a bufferevent, unless we unfreeze it */
+    evbuffer_unfreeze(output, 1);
+    evbuffer_add_buffer(zc->hold, output);
+    evbuffer_freeze(output, 1);
+    zerocopy_flush(zc);
+    if (zc->failed) {
+        /* close it from the event, the caller still uses the connection */
+        event_active(zc->notify_event, EV_WRITE, 0);
+    }
+}
+
+static void zerocopy_ready(evutil_socket_t UNUSED(fd), short event, void *arg) {
+    struct zerocopy* zc = arg;
+    struct otherside* writer = zc->writer;
+    if (!writer) {
+        if (event & EV_TIMEOUT) {
+            /* the peer doesn't take the rest, reset the connection so the kernel lets go of the hold */
+            struct sockaddr unspecified;
+            memset(&unspecified, 0, sizeof(unspecified));
+            unspecified.sa_family = AF_UNSPEC;
+            if (connect(zc->notify_fd, &unspecified, sizeof(unspecified)) != 0) {
+                perror("connect/reset");
+            }
+        }
+        zerocopy_reap(zc);
+        if (zc->first == zc->next) {
+            zerocopy_free(zc);
+        }
+        return;
+    }
+    if (event & EV_TIMEOUT) {
+        /* the peer stopped taking the hold, close it like a write timeout */
+        pipe_error(writer->bev, BEV_EVENT_WRITING | BEV_EVENT_TIMEOUT, writer->pair);
+        return;
+    }
+    zerocopy_flush(zc);
+    if (zc->failed) {
+        pipe_error(writer->bev, BEV_EVENT_WRITING | BEV_EVENT_ERROR, writer->pair);
+    }
+    else if (!writer->pair->bev && zerocopy_idle(zc) && evbuffer_get_length(bufferevent_get_output(writer->bev)) == 0) {
+        /* the source was gone already, and now all it sent is delivered */
+        bufferevent_free(writer->bev);
+        free_connection(writer->connection);
+    }
+}
+
+/*
+ * the bufferevent of the writer is freed (or handed to another worker), so
+ * what is still unsent is dropped. The chains the kernel may still send
+ * from are kept until their completions arrive, while the duplicate
+ * finishes the connection like the close would have.
+ */
+static void zerocopy_release(struct otherside* writer) {
+    struct zerocopy* zc = writer->zerocopy;
+    if (!zc) {
+        return;
+    }
+    writer->zerocopy = NULL;
+    writer->zerocopy_sequence = zc->next;
+    zc->writer = NULL;
+    if (zc->first == zc->next) {
+        zerocopy_free(zc);
+        return;
+    }
+    shutdown(zc->notify_fd, SHUT_WR);
+    event_add(zc->notify_event, writer->connection->worker->closing_timeout);
+}
+#else
+/* MSG_ZEROCOPY is Linux only, start refuses --zeroCopy elsewhere */
+static bool zerocopy_idle(struct zerocopy* UNUSED(zc)) {
+    return true;
+}
+
+static void zerocopy_send(struct otherside* UNUSED(writer)) {
+}
+
+static void zerocopy_release(struct otherside* UNUSED(writer)) {
+}
+#endif
+
 /**
  * active pipe
  */
+static void pipe_read(struct bufferevent *bev, void *ctx);
+
+static void pipe_drained(struct bufferevent *bev, void *ctx) {
+    struct otherside* con = ctx;
+    bufferevent_setcb(bev, pipe_read, NULL, pipe_error, con);
+    bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+    if (con->bev) {
+        bufferevent_enable(con->bev, EV_READ);
+    }
+}
+
+static bool migrate(struct connection* connection, struct worker* target);
+static void dedicate(struct connection* connection);
+
+/* count the bytes of the connection, and report if it should move */
+static bool account(struct connection* connection, size_t moved) {
+    struct worker* worker = connection->worker;
+    if (connection->interval != worker->interval) {
+        connection->heavy = connection->interval + 1 == worker->interval && connection->interval_moved >= BALANCE_HEAVY_BYTES;
+        connection->interval = worker->interval;
+        connection->interval_moved = 0;
+    }
+    if (connection->interval_moved < BALANCE_HEAVY_BYTES && connection->interval_moved + moved >= BALANCE_HEAVY_BYTES) {
+        worker->heavy++;
+    }
+    connection->interval_moved += moved;
+    return worker->shed_to && connection->heavy;
+}
+
+/* move the input of bev to the other side, every forward has to pass the high watermark check */
+static size_t forward(struct bufferevent *bev, struct otherside* con) {
+    struct evbuffer* output = bufferevent_get_output(con->bev);
+    size_t moved = evbuffer_get_length(bufferevent_get_input(bev));
+    bufferevent_read_buffer(bev, output);
+    if (config->zero_copy) {
+        zerocopy_send(con);
+    }
+    if (evbuffer_get_length(output) >= MAX_SEND_BUF_HIGH) {
+        /* the other side is slower than us, wait for it to catch up */
+        bufferevent_disable(bev, EV_READ);
+        bufferevent_setwatermark(con->bev, EV_WRITE, MAX_SEND_BUF_LOW, 0);
+        bufferevent_setcb(con->bev, pipe_read, pipe_drained, pipe_error, con->pair);
+    }
+    return moved;
+}
+
 static void pipe_read(struct bufferevent *bev, void *ctx) {
     struct otherside* con = ctx;
     if (con->bev) {
         con->pair->other_timedout = false;
-        bufferevent_read_buffer(bev, bufferevent_get_output(con->bev));
+        size_t moved = forward(bev, con);
+        struct connection* connection = con->connection;
+        if (connection->hidden && config->hidden_threads > 0 && !connection->worker->dedicated) {
+            /* before it gets heavy, a bulk flow of the hidden route doesn't belong here either */
+            dedicate(connection);
+        }
+        else if (account(connection, moved)) {
+            struct worker* worker = connection->worker;
+            struct worker* target = worker->shed_to;
+            if (__atomic_load_n(&(target->state), __ATOMIC_ACQUIRE) != WORKER_RUNNING) {
+                worker->shed_to = NULL;
+            }
+            else if (migrate(connection, target)) {
+                if (config->verbose) {
+                    printf("Migrated a bulk flow from worker %u to %u\n", worker->index, target->index);
+                }
+                if (--worker->shed_count == 0) {
+                    worker->shed_to = NULL;
+                }
+            }
+        }
     }
     else {
         evbuffer_drain(bufferevent_get_input(bev), SIZE_MAX);
+        if (evbuffer_get_length(bufferevent_get_output(bev)) == 0 && zerocopy_idle(con->pair->zerocopy)) {
+            /* nothing left to deliver, and a backend that keeps sending would never time out */
+            bufferevent_free(bev);
+            free_connection(con->connection);
+        }
     }
 }
 
+static void strip_knock(struct bufferevent *bev, void *ctx) {
+    struct otherside* con = ctx;
+    struct knock_matcher* matcher = &(con->connection->worker->knock_matcher);
+    struct evbuffer *input = bufferevent_get_input(bev);
+    size_t size = evbuffer_get_length(input);
+    if (size > config->knock_size) {
+        size = config->knock_size;
+    }
+    uint8_t* data = evbuffer_pullup(input, size);
+    if (size < config->knock_size && knock_prefix_matches(matcher, data, size)) {
+        /* wait for the rest of the knock */
+        return;
+    }
+    if (knock_matches(matcher, data, size)) {
+        evbuffer_drain(input, size);
+    }
+    bufferevent_data_cb write_cb;
+    bufferevent_getcb(bev, NULL, &write_cb, NULL, NULL);
+    bufferevent_setcb(bev, pipe_read, write_cb, pipe_error, ctx);
+    pipe_read(bev, ctx);
+}
+
 static void pipe_error(struct bufferevent *bev, short error, void *ctx)
 {
     struct otherside* con = ctx;
-    if (error & BEV_EVENT_TIMEOUT) {
+    if ((error & BEV_EVENT_TIMEOUT) && !(error & BEV_EVENT_WRITING)) {
         /* re-enable reading and writing to detect future timeouts */
         bufferevent_enable(bev, EV_READ);
         if (con->bev) {
@@ -105,69 +747,85 @@ static void pipe_error(struct bufferevent *bev, short error, void *ctx)
         }
     }
     bufferevent_free(bev);
+    zerocopy_release(con->pair);
     if (con->bev) {
         /*
          let the back connection (whichever direction) finish writing it's buffers.
          But then timeout, but make sure the ctx is changed to avoid writing stuff to a
          freed buffer.
          */
-        struct timeval ones = { 1, 0};
-        bufferevent_set_timeouts(con->bev, &ones, &ones);
+        const struct timeval *closing = con->connection->worker->closing_timeout;
+        bufferevent_set_timeouts(con->bev, closing, closing);
         bufferevent_enable(con->bev, EV_READ);
-        con->pair->pair = NULL;
         con->pair->bev = NULL;
     }
-    free(con);
+    else {
+        /* the other side was already gone, we were the last user of the connection */
+        free_connection(con->connection);
+    }
 }
 
 /**
  * back connection handshake
  */
 
-static struct otherside** create_contexts(struct bufferevent *forward, struct bufferevent *backward) {
-    struct otherside **result = calloc(2, sizeof(struct otherside*));
-    result[0] = malloc(sizeof(struct otherside));
-    result[1] = malloc(sizeof(struct otherside));
-    result[0]->bev = backward;
-    result[0]->pair = result[1];
-    result[0]->other_timedout = false;
-    result[1]->bev = forward;
-    result[1]->pair = result[0];
-    result[1]->other_timedout = false;
+static struct connection* create_connection(struct worker* worker, struct bufferevent *front) {
+    struct connection* result = malloc(sizeof(struct connection));
+    if (!result) {
+        return NULL;
+    }
+    attach_connection(worker, result);
+    result->sides[0].bev = NULL; /* back side is filled in when it is created */
+    result->sides[0].pair = &(result->sides[1]);
+    result->sides[0].connection = result;
+    result->sides[0].other_timedout = false;
+    result->sides[0].zerocopy = NULL;
+    result->sides[0].zerocopy_sequence = 0;
+    result->sides[1].bev = front;
+    result->sides[1].pair = &(result->sides[0]);
+    result->sides[1].connection = result;
+    result->sides[1].other_timedout = false;
+    result->sides[1].zerocopy = NULL;
+    result->sides[1].zerocopy_sequence = 0;
+    http_route_init(&(result->http));
+    result->interval_moved = 0;
+    result->interval = worker->interval;
+    result->heavy = false;
     return result;
 }
 
 static void back_connection(struct bufferevent *bev, short events, void *ctx)
 {
-    struct bufferevent* other_side = ctx;
+    struct connection* connection = ctx;
+    struct bufferevent* other_side = connection->sides[1].bev;
     if (events & BEV_EVENT_CONNECTED) {
-        struct otherside **ctxs = create_contexts(other_side, bev);
         evutil_socket_t fd = bufferevent_getfd(bev);
         set_tcp_no_delay(fd);
 
 
-        bufferevent_enable(other_side, EV_READ);
-        /* pipe already available data to backend */
-        bufferevent_read_buffer(other_side, bufferevent_get_output(bev));
-        bufferevent_setcb(other_side, pipe_read, NULL, pipe_error, ctxs[0]);
-
-        bufferevent_setcb(bev, pipe_read, NULL, pipe_error, ctxs[1]);
+        bufferevent_setcb(bev, pipe_read, NULL, pipe_error, &(connection->sides[1]));
         bufferevent_setwatermark(bev, EV_READ, 0, MAX_RECV_BUF_DEFAULT);
         bufferevent_enable(bev, EV_READ);
 
-        bufferevent_set_timeouts(bev, &(config->default_timeout), NULL);
-        bufferevent_set_timeouts(other_side, &(config->default_timeout), NULL);
-        free(ctxs);
+        const struct timeval *timeout = connection->worker->default_timeout;
+        bufferevent_set_timeouts(bev, timeout, timeout);
+        bufferevent_set_timeouts(other_side, timeout, timeout);
+
+        bufferevent_enable(other_side, EV_READ);
+        bufferevent_data_cb front_read = connection->strip_knock ? strip_knock : pipe_read;
+        bufferevent_setcb(other_side, front_read, NULL, pipe_error, &(connection->sides[0]));
+        /* pipe already available data to backend, through forward and its watermark like every later read, this might also migrate the connection */
+        front_read(other_side, &(connection->sides[0]));
     } else if (events & BEV_EVENT_ERROR) {
         bufferevent_free(bev);
-        if (other_side) {
-            bufferevent_free(other_side);
-        }
+        bufferevent_free(other_side);
+        free_connection(connection);
     }
 }
 
-static void create_pipe(struct event_base *base, struct bufferevent *other_side, uint32_t port) {
+static void create_pipe(struct connection* connection, uint32_t port, bool strip_knock) {
     struct bufferevent *bev;
+    struct bufferevent *other_side = connection->sides[1].bev;
     struct sockaddr_in sin;
 
     memset(&sin, 0, sizeof(sin));
@@ -175,136 +833,804 @@ static void create_pipe(struct event_base *base, struct bufferevent *other_side,
     sin.sin_addr.s_addr = htonl(0x7f000001); /* 127.0.0.1 */
     sin.sin_port = htons(port); 
 
-    bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+    connection->strip_knock = strip_knock;
+    connection->hidden = port == config->hidden_port;
+
+    bev = bufferevent_socket_new(connection->worker->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    connection->sides[0].bev = bev;
 
-    bufferevent_setcb(bev, NULL, NULL, back_connection, other_side);
+    bufferevent_setcb(bev, NULL, NULL, back_connection, connection);
 
     if (bufferevent_socket_connect(bev, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
         /* Error starting connection */
         bufferevent_free(bev);
-        if (other_side) {
-            bufferevent_free(other_side);
+        bufferevent_free(other_side);
+        free_connection(connection);
+    }
+}
+
+/**
+ * migration
+ */
+
+static void start_pipe(struct connection* connection) {
+    const struct timeval *timeout = connection->worker->default_timeout;
+    for (int i = 0; i < 2; i++) {
+        struct bufferevent *bev = connection->sides[i].bev;
+        bufferevent_setcb(bev, pipe_read, NULL, pipe_error, connection->sides[i].pair);
+        bufferevent_setwatermark(bev, EV_READ, 0, MAX_RECV_BUF_DEFAULT);
+        bufferevent_set_timeouts(bev, timeout, timeout);
+        bufferevent_enable(bev, EV_READ);
+    }
+    /* stop reading again where the other side still has too much pending */
+    for (int i = 0; i < 2; i++) {
+        if (connection->sides[i].bev) {
+            pipe_read(connection->sides[i].bev, connection->sides[i].pair);
+        }
+    }
+}
+
+static void free_migration(struct migration* migration) {
+    for (int i = 0; i < 2; i++) {
+        if (migration->output[i]) {
+            evbuffer_free(migration->output[i]);
+        }
+    }
+    free(migration);
+}
+
+/* only a connection that is piping in both directions can move */
+static bool can_migrate(struct connection* connection) {
+    for (int i = 0; i < 2; i++) {
+        bufferevent_data_cb read_cb;
+        if (!connection->sides[i].bev) {
+            return false;
+        }
+        bufferevent_getcb(connection->sides[i].bev, &read_cb, NULL, NULL, NULL);
+        if (read_cb != pipe_read || !zerocopy_idle(connection->sides[i].zerocopy)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool migrate(struct connection* connection, struct worker* target) {
+    if (!can_migrate(connection)) {
+        return false;
+    }
+    struct migration* migration = calloc(1, sizeof(struct migration));
+    if (!migration) {
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        migration->output[i] = evbuffer_new();
+        if (!migration->output[i]) {
+            free_migration(migration);
+            return false;
+        }
+    }
+    migration->connection = connection;
+    for (int i = 0; i < 2; i++) {
+        /* the new bufferevents start with empty input, so forward it now */
+        struct bufferevent *bev = connection->sides[i].bev;
+        bufferevent_read_buffer(connection->sides[i].pair->bev, bufferevent_get_output(bev));
+    }
+    for (int i = 0; i < 2; i++) {
+        struct bufferevent *bev = connection->sides[i].bev;
+        struct evbuffer *output = bufferevent_get_output(bev);
+        /* only the socket may drain the output of a bufferevent, unless we unfreeze it */
+        evbuffer_unfreeze(output, 1);
+        evbuffer_add_buffer(migration->output[i], output);
+        migration->fds[i] = bufferevent_getfd(bev);
+        /* keep the socket open */
+        bufferevent_setfd(bev, -1);
+        bufferevent_free(bev);
+        zerocopy_release(&(connection->sides[i]));
+        connection->sides[i].bev = NULL;
+    }
+    detach_connection(connection);
+    connection->worker = target;
+
+    migration->next = __atomic_load_n(&(target->migrations), __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&(target->migrations), &(migration->next), migration, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    /* if it is already active, it will still find this one on the stack */
+    event_active(target->migrate_event, EV_READ, 0);
+    return true;
+}
+
+static void resume_pipe(struct worker* worker, struct migration* migration) {
+    struct connection* connection = migration->connection;
+    attach_connection(worker, connection);
+    connection->interval = worker->interval;
+    connection->interval_moved = 0;
+    connection->heavy = false;
+    bool failed = false;
+    for (int i = 0; i < 2; i++) {
+        struct bufferevent *bev = bufferevent_socket_new(worker->base, migration->fds[i], BEV_OPT_CLOSE_ON_FREE);
+        if (!bev) {
+            close(migration->fds[i]);
+            failed = true;
+            continue;
+        }
+        evbuffer_add_buffer(bufferevent_get_output(bev), migration->output[i]);
+        connection->sides[i].bev = bev;
+    }
+    free_migration(migration);
+    if (failed) {
+        for (int i = 0; i < 2; i++) {
+            if (connection->sides[i].bev) {
+                bufferevent_free(connection->sides[i].bev);
+            }
+        }
+        free_connection(connection);
+        return;
+    }
+    start_pipe(connection);
+}
+
+/* take the whole stack, and resume the connections in the order they arrived */
+static struct migration* take_migrations(struct worker* worker) {
+    struct migration* stack = __atomic_exchange_n(&(worker->migrations), NULL, __ATOMIC_ACQUIRE);
+    struct migration* result = NULL;
+    while (stack) {
+        struct migration* next = stack->next;
+        stack->next = result;
+        result = stack;
+        stack = next;
+    }
+    return result;
+}
+
+static void receive_migrations(evutil_socket_t UNUSED(fd), short UNUSED(event), void *arg) {
+    struct worker *worker = arg;
+    struct migration* migration = take_migrations(worker);
+    while (migration) {
+        struct migration* next = migration->next;
+        resume_pipe(worker, migration);
+        migration = next;
+    }
+}
+
+static struct worker* __workers;
+/* workers in use (running, retiring or retired), only changed by the first worker */
+static uint32_t __started;
+
+static struct worker* least_loaded(struct worker* worker) {
+    struct worker *least = NULL;
+    uint32_t least_load = UINT32_MAX;
+    uint32_t started = __atomic_load_n(&__started, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < started; i++) {
+        uint32_t other_load = __atomic_load_n(&(__workers[i].load), __ATOMIC_RELAXED);
+        if (&(__workers[i]) != worker && other_load < least_load && __atomic_load_n(&(__workers[i].state), __ATOMIC_ACQUIRE) == WORKER_RUNNING) {
+            least = &(__workers[i]);
+            least_load = other_load;
         }
     }
+    return least;
+}
+
+static struct worker* __hidden_workers;
+static uint32_t __hidden_next;
+
+static void dedicate(struct connection* connection) {
+    struct worker* worker = connection->worker;
+    struct worker* target = &(__hidden_workers[__atomic_fetch_add(&__hidden_next, 1, __ATOMIC_RELAXED) % config->hidden_threads]);
+    if (migrate(connection, target) && config->verbose) {
+        printf("Moved a hidden connection from worker %u to hidden worker %u\n", worker->index, target->index);
+    }
+}
+
+static void initial_accept(struct evconnlistener *listener, evutil_socket_t fd, struct sockaddr *address, int socklen, void *arg);
+
+/* close the listener, but first take the connections that are already waiting in its queue */
+static void stop_accepting(struct worker* worker) {
+    evconnlistener_disable(worker->listener);
+    event_del(worker->resume_event);
+    evutil_socket_t listen_fd = evconnlistener_get_fd(worker->listener);
+    while (true) {
+        struct sockaddr_storage address;
+        socklen_t size = sizeof(address);
+        evutil_socket_t fd = accept(listen_fd, (struct sockaddr*)&address, &size);
+        if (fd == -1) {
+            break;
+        }
+        evutil_make_socket_nonblocking(fd);
+        evutil_make_socket_closeonexec(fd);
+        initial_accept(worker->listener, fd, (struct sockaddr*)&address, (int)size, worker);
+    }
+    evconnlistener_free(worker->listener);
+    worker->listener = NULL;
+}
+
+static void retire_step(struct worker* worker) {
+    if (worker->listener) {
+        stop_accepting(worker);
+    }
+    worker->retiring_intervals++;
+    struct connection* connection = worker->connections;
+    while (connection) {
+        struct connection* next = connection->next;
+        struct worker* target = least_loaded(worker);
+        if (target && migrate(connection, target)) {
+            /* count it, so the next one goes to another worker */
+            __atomic_add_fetch(&(target->load), 1, __ATOMIC_RELAXED);
+        }
+        connection = next;
+    }
+    if (!worker->connections && worker->retiring_intervals > RETIRE_GRACE) {
+        __atomic_store_n(&(worker->state), WORKER_RETIRED, __ATOMIC_RELEASE);
+        event_base_loopbreak(worker->base);
+    }
+}
+
+static void scale(void);
+
+static void balance(evutil_socket_t UNUSED(fd), short UNUSED(event), void *arg) {
+    struct worker *worker = arg;
+    uint32_t load = worker->heavy;
+    __atomic_store_n(&(worker->load), load, __ATOMIC_RELAXED);
+    worker->heavy = 0;
+    worker->interval++;
+
+    struct timespec cpu, wall;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    uint64_t cpu_time = (uint64_t)cpu.tv_sec * 1000000000 + (uint64_t)cpu.tv_nsec;
+    uint64_t wall_time = (uint64_t)wall.tv_sec * 1000000000 + (uint64_t)wall.tv_nsec;
+    if (worker->wall_time && wall_time > worker->wall_time) {
+        uint64_t busy = (cpu_time - worker->cpu_time) * 1000 / (wall_time - worker->wall_time);
+        __atomic_store_n(&(worker->busy), (uint32_t)(busy > 1000 ? 1000 : busy), __ATOMIC_RELAXED);
+    }
+    worker->cpu_time = cpu_time;
+    worker->wall_time = wall_time;
+
+    if (__atomic_load_n(&(worker->state), __ATOMIC_ACQUIRE) == WORKER_RETIRING) {
+        worker->shed_to = NULL;
+        retire_step(worker);
+        return;
+    }
+    if (worker->index == 0 && config->max_threads > config->threads) {
+        scale();
+    }
+
+    struct worker *least = least_loaded(worker);
+    uint32_t least_load = least ? __atomic_load_n(&(least->load), __ATOMIC_RELAXED) : 0;
+    /* moving one flow narrows the difference by two, so less is just ping-pong */
+    if (least && load >= least_load + 2) {
+        worker->shed_to = least;
+        worker->shed_count = (load - least_load) / 2;
+    }
+    else {
+        worker->shed_to = NULL;
+    }
 }
 
 /**
  * Initial hand shake callbacks
  */
 
-static void initial_read(struct bufferevent *bev, void *ctx) {
-     struct event_base *base = ctx;
-    struct evbuffer *input = bufferevent_get_input(bev);
-    uint32_t port = config->normal_port;
+/* ms on a monotonic clock, like the splice engine, so the wall clock jumping can't release or hold a tarpit */
+static uint64_t now(void) {
+    struct timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return (uint64_t)tm.tv_sec * 1000 + (uint64_t)tm.tv_nsec / 1000000;
+}
 
-    /* lets peek at the first byte */
-    struct evbuffer_iovec v[1];
-    if (evbuffer_peek(input, config->knock_size, NULL, v, 1) == 1 && v[0].iov_len >= config->knock_size) {
-        if (memcmp(config->knock_value, v[0].iov_base, config->knock_size) == 0) {
-            port = config->hidden_port;
-            evbuffer_drain(input, config->knock_size);
-        }
+static const struct timeval* knock_timeout(struct worker* worker) {
+    uint32_t deadline = knock_delays_deadline(&(worker->knock_delays));
+    if (deadline != worker->knock_deadline) {
+        struct timeval timeout = { deadline / 1000, (deadline % 1000) * 1000 };
+        const struct timeval *common = event_base_init_common_timeout(worker->base, &timeout);
+        worker->knock_deadline_timeout = common ? common : worker->knock_timeout;
+        worker->knock_deadline = deadline;
     }
+    return worker->knock_deadline_timeout;
+}
+
+static void stop_waiting_for_knock(struct bufferevent *bev) {
     bufferevent_setwatermark(bev, EV_READ, 0, MAX_RECV_BUF_DEFAULT);
     bufferevent_disable(bev, EV_READ);
     bufferevent_set_timeouts(bev, NULL, NULL);
     bufferevent_setcb(bev, NULL, NULL, pipe_error, NULL);
-    create_pipe(base, bev, port);
+}
+
+#define HTTP_SEGMENTS 16
+
+/* parse the segments of the input the parser hasn't seen yet, without draining it */
+static void http_read(struct bufferevent *bev, struct connection *connection) {
+    struct evbuffer *input = bufferevent_get_input(bev);
+    enum http_route_result result = HTTP_ROUTE_MORE;
+    while (result == HTTP_ROUTE_MORE && connection->http.parsed < evbuffer_get_length(input)) {
+        struct evbuffer_ptr start;
+        struct evbuffer_iovec segments[HTTP_SEGMENTS];
+        evbuffer_ptr_set(input, &start, connection->http.parsed, EVBUFFER_PTR_SET);
+        int count = evbuffer_peek(input, -1, &start, segments, HTTP_SEGMENTS);
+        if (count <= 0) {
+            break;
+        }
+        if (count > HTTP_SEGMENTS) {
+            count = HTTP_SEGMENTS;
+        }
+        for (int i = 0; i < count && result == HTTP_ROUTE_MORE; i++) {
+            result = http_route_parse(&(connection->http), config, segments[i].iov_base, segments[i].iov_len);
+        }
+    }
+    if (result == HTTP_ROUTE_MORE) {
+        return;
+    }
+    stop_waiting_for_knock(bev);
+    create_pipe(connection, result == HTTP_ROUTE_HIDDEN ? config->hidden_port : config->normal_port, false);
+}
+
+static void initial_read(struct bufferevent *bev, void *ctx) {
+    struct connection *connection = ctx;
+    struct worker *worker = connection->worker;
+    struct evbuffer *input = bufferevent_get_input(bev);
+    uint32_t port = config->normal_port;
+
+    if (connection->http.parsed > 0) {
+        /* the next segments of an HTTP request head */
+        http_read(bev, connection);
+        return;
+    }
+    knock_delays_record(&(worker->knock_delays), (uint32_t)(now() - connection->accepted));
+
+    /* lets peek at the first bytes */
+    size_t size = evbuffer_get_length(input);
+    if (size > config->first_data_size) {
+        size = config->first_data_size;
+    }
+    uint8_t* data = evbuffer_pullup(input, size);
+    if (size >= config->knock_size && knock_matches(&(worker->knock_matcher), data, config->knock_size)) {
+        port = config->hidden_port;
+        evbuffer_drain(input, config->knock_size);
+        knock_cache_remember_peer(bufferevent_getfd(bev));
+    }
+    else if (tarpit_matches(config, data, size)) {
+        /* keep the socket, but drop everything else */
+        evutil_socket_t fd = bufferevent_getfd(bev);
+        bufferevent_setfd(bev, -1);
+        bufferevent_free(bev);
+        free_connection(connection);
+        tarpit_add(&(worker->tarpit), fd, (uint32_t)(now() / 1000));
+        return;
+    }
+    else if (http_routing(config)) {
+        http_read(bev, connection);
+        return;
+    }
+    stop_waiting_for_knock(bev);
+    create_pipe(connection, port, false);
 }
 
 static void initial_error(struct bufferevent *bev, short error, void *ctx) {
     if (error & BEV_EVENT_TIMEOUT) {
         /* nothing received so must be a ssh client */
+        struct connection *connection = ctx;
+        struct worker *worker = connection->worker;
         if (config->verbose) {
             printf("Nothing received, timeout, assuming https\n");
         }
-        initial_read(bev, ctx);
+        if (connection->http.parsed == 0) {
+            /* a partial HTTP head was already recorded when it arrived */
+            knock_delays_expired(&(worker->knock_delays), (uint32_t)(now() - connection->accepted));
+        }
+        stop_waiting_for_knock(bev);
+        create_pipe(ctx, config->normal_port, false);
         return;
     }
     bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
     bufferevent_free(bev);
+    free_connection(ctx);
 }
 
 /* a new connection arrives */
-static void initial_accept(evutil_socket_t listener, short UNUSED(event), void *arg) {
-    struct event_base *base = arg;
-    struct sockaddr_storage ss;
-    socklen_t slen = sizeof(ss);
-    int fd = accept(listener, (struct sockaddr*)&ss, &slen);
-    if (fd < 0) {
-        perror("accept");
-    } else if (fd > FD_SETSIZE) {
+static void initial_accept(struct evconnlistener *UNUSED(listener), evutil_socket_t fd, struct sockaddr *address, int UNUSED(socklen), void *arg) {
+    struct worker *worker = arg;
+    struct bufferevent *bev = bufferevent_socket_new(worker->base, fd, BEV_OPT_CLOSE_ON_FREE);
+    if (!bev) {
         close(fd);
-    } else {
-        struct bufferevent *bev;
-        evutil_make_socket_nonblocking(fd);
-        bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
-        bufferevent_setcb(bev, initial_read, NULL, initial_error, base);
+        return;
+    }
+    struct connection* connection = create_connection(worker, bev);
+    if (!connection) {
+        bufferevent_free(bev);
+        return;
+    }
+    connection->accepted = now();
+    if (config->verbose && address->sa_family == AF_INET) {
+        printf("Worker %u accepted a connection from port %u\n", worker->index, ntohs(((struct sockaddr_in*)address)->sin_port));
+    }
+    if (address->sa_family == AF_INET && knock_cache_contains(ntohl(((struct sockaddr_in*)address)->sin_addr.s_addr))) {
+        /* a remembered source, skip the knock handshake */
         bufferevent_setwatermark(bev, EV_READ, 0, MAX_RECV_BUF_DEFAULT);
-        bufferevent_enable(bev, EV_READ);
-        bufferevent_set_timeouts(bev, &(config->knock_timeout), NULL);
+        create_pipe(connection, config->hidden_port, true);
+        return;
     }
+    bufferevent_setcb(bev, initial_read, NULL, initial_error, connection);
+    bufferevent_setwatermark(bev, EV_READ, 0, MAX_RECV_BUF_DEFAULT);
+    bufferevent_enable(bev, EV_READ);
+    bufferevent_set_timeouts(bev, knock_timeout(worker), NULL);
 }
 
-static struct event_base *__base;
-static struct event *__listener_event;
+static void expire_tarpit(evutil_socket_t UNUSED(fd), short UNUSED(event), void *arg) {
+    struct worker *worker = arg;
+    tarpit_expire(&(worker->tarpit), (uint32_t)(now() / 1000));
+}
 
-void cleanup_buffers(int UNUSED(signum)) {
-    event_del(__listener_event);
-    event_free(__listener_event);
-    event_base_free(__base);
-    exit(0);
+static void resume_accept(evutil_socket_t UNUSED(fd), short UNUSED(event), void *arg) {
+    evconnlistener_enable(arg);
 }
 
-int start(struct config* _config) {
-    signal(SIGTERM, cleanup_buffers);
-    config = _config;
-    setvbuf(stdout, NULL, _IONBF, 0);
+/* accept failed, most likely out of file descriptors, so back off for a bit */
+static void accept_error(struct evconnlistener *listener, void *arg) {
+    struct worker *worker = arg;
+    perror("accept");
+    struct timeval backoff = { 0, 100 * 1000 };
+    evconnlistener_disable(listener);
+    event_add(worker->resume_event, &backoff);
+}
 
-    evutil_socket_t listener;
-    struct sockaddr_in sin;
+static struct event *__term_event;
 
-    __base = event_base_new();
-    if (!__base)
-        return 1; 
+static void stop_workers(evutil_socket_t UNUSED(signum), short UNUSED(event), void *UNUSED(arg)) {
+    for (uint32_t i = 0; i < __started; i++) {
+        event_base_loopbreak(__workers[i].base);
+    }
+    for (uint32_t i = 0; i < config->hidden_threads; i++) {
+        if (__hidden_workers[i].base) {
+            event_base_loopbreak(__hidden_workers[i].base);
+        }
+    }
+}
 
+static bool init_listener(struct worker* worker) {
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
     sin.sin_family = AF_INET;
     sin.sin_addr.s_addr = 0;
     sin.sin_port = htons(config->external_port);
 
-    listener = socket(AF_INET, SOCK_STREAM, 0);
-    if (listener == -1) {
-        event_base_free(__base);
-        return 1;
+    unsigned flags = LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC | LEV_OPT_REUSEABLE;
+    if (config->max_threads > 1) {
+        flags |= LEV_OPT_REUSEABLE_PORT;
+    }
+    worker->listener = evconnlistener_new_bind(worker->base, initial_accept, NULL, flags, (int)config->backlog, (struct sockaddr*)&sin, sizeof(sin));
+    if (!worker->listener) {
+        perror("bind");
+        return false;
+    }
+    worker->resume_event = evtimer_new(worker->base, resume_accept, worker->listener);
+    evconnlistener_set_error_cb(worker->listener, accept_error);
+    evconnlistener_set_cb(worker->listener, initial_accept, worker);
+    return true;
+}
+
+static bool init_worker(struct worker* worker) {
+    worker->base = event_base_new();
+    if (!worker->base) {
+        return false;
+    }
+    if (!worker->dedicated && !init_listener(worker)) {
+        event_base_free(worker->base);
+        worker->base = NULL;
+        return false;
+    }
+
+    struct timeval closing = { 1, 0 };
+    worker->knock_timeout = event_base_init_common_timeout(worker->base, &(config->knock_timeout));
+    worker->default_timeout = event_base_init_common_timeout(worker->base, &(config->default_timeout));
+    worker->closing_timeout = event_base_init_common_timeout(worker->base, &closing);
+    knock_matcher_init(&(worker->knock_matcher), config);
+    knock_delays_init(&(worker->knock_delays), config);
+    worker->knock_deadline = knock_delays_deadline(&(worker->knock_delays));
+    worker->knock_deadline_timeout = worker->knock_timeout;
+
+    if (!tarpit_init(&(worker->tarpit), config)) {
+        return false;
+    }
+    if (config->tarpit_count > 0) {
+        struct timeval every_second = { 1, 0 };
+        worker->tarpit_event = event_new(worker->base, -1, EV_PERSIST, expire_tarpit, worker);
+        event_add(worker->tarpit_event, &every_second);
     }
-    evutil_make_socket_nonblocking(listener);
 
-#ifndef WIN32
-    {
-        int one = 1;
+    if (config->max_threads > 1 || worker->dedicated) {
+        worker->migrate_event = event_new(worker->base, -1, 0, receive_migrations, worker);
+        if (!worker->migrate_event) {
+            return false;
+        }
+    }
+    if (config->max_threads > 1 && !worker->dedicated) {
+        struct timeval interval = { BALANCE_INTERVAL_MS / 1000, (BALANCE_INTERVAL_MS % 1000) * 1000 };
+        worker->balance_event = event_new(worker->base, -1, EV_PERSIST, balance, worker);
+        event_add(worker->balance_event, &interval);
+    }
+    return true;
+}
 
-        if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0) {
-            perror("setsockopt/reuse_addr");
+static void free_worker(struct worker* worker) {
+    if (worker->base) {
+        if (worker->tarpit_event) {
+            event_free(worker->tarpit_event);
+        }
+        tarpit_free(&(worker->tarpit));
+        if (worker->balance_event) {
+            event_free(worker->balance_event);
+        }
+        if (worker->migrate_event) {
+            event_free(worker->migrate_event);
         }
+        /* connections that were still on their way here */
+        struct migration* migration = take_migrations(worker);
+        while (migration) {
+            struct migration* next = migration->next;
+            close(migration->fds[0]);
+            close(migration->fds[1]);
+            free(migration->connection);
+            free_migration(migration);
+            migration = next;
+        }
+        if (worker->resume_event) {
+            event_free(worker->resume_event);
+        }
+        if (worker->listener) {
+            evconnlistener_free(worker->listener);
+        }
+        event_base_free(worker->base);
     }
+}
+
+static bool __pinned;
+
+#ifdef __linux__
+/* the CPUs of the workers that aren't dedicated, if they are pinned */
+static cpu_set_t __shared_cpus;
+
+/* give every dedicated worker a CPU of its own, if there are enough to leave some for the others */
+static void assign_cpus(void) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        perror("sched_getaffinity");
+        return;
+    }
+    uint32_t count = (uint32_t)CPU_COUNT(&allowed);
+    if (count < 2) {
+        if (config->verbose) {
+            printf("Only one CPU, the hidden workers are not pinned\n");
+        }
+        return;
+    }
+    uint32_t reserved = config->hidden_threads < count - 1 ? config->hidden_threads : count - 1;
+    __shared_cpus = allowed;
+    uint32_t assigned = 0;
+    /* the last CPUs, the first ones are the most likely to handle interrupts */
+    for (int cpu = CPU_SETSIZE - 1; cpu >= 0 && assigned < reserved; cpu--) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            CPU_CLR(cpu, &__shared_cpus);
+            __hidden_workers[assigned++].cpu = cpu;
+        }
+    }
+    /* more dedicated workers than reserved CPUs share them */
+    for (uint32_t i = reserved; i < config->hidden_threads; i++) {
+        __hidden_workers[i].cpu = __hidden_workers[i % reserved].cpu;
+    }
+    __pinned = true;
+}
+
+static void pin_worker(struct worker* worker) {
+    cpu_set_t own;
+    const cpu_set_t* cpus = &__shared_cpus;
+    if (worker->dedicated) {
+        CPU_ZERO(&own);
+        CPU_SET(worker->cpu, &own);
+        cpus = &own;
+    }
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), cpus);
+    if (error != 0) {
+        fprintf(stderr, "Cannot pin worker %u: %s\n", worker->index, strerror(error));
+    }
+}
+#else
+/* only Linux can pin threads, elsewhere the hidden workers run on any CPU */
+static void assign_cpus(void) {
+    if (config->verbose) {
+        printf("Not on Linux, the hidden workers are not pinned\n");
+    }
+}
+
+static void pin_worker(struct worker* UNUSED(worker)) {
+}
 #endif
 
-    if (bind(listener, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
-        perror("bind");
-        close(listener);
-        event_base_free(__base);
+static void* run_worker(void* arg) {
+    struct worker* worker = arg;
+    if (__pinned) {
+        pin_worker(worker);
+    }
+    /* a worker of the hidden pool has no events until the first migration */
+    event_base_loop(worker->base, EVLOOP_NO_EXIT_ON_EMPTY);
+    return NULL;
+}
+
+static uint32_t __scale_cooldown = SCALE_COOLDOWN;
+
+static void start_worker(void) {
+    struct worker* worker = &(__workers[__started]);
+    /* it stays stopped or retired for the others until it is ready */
+    memset(&(worker->base), 0, sizeof(struct worker) - offsetof(struct worker, base));
+    worker->index = __started;
+    if (!init_worker(worker)) {
+        free_worker(worker);
+        worker->base = NULL;
+        return;
+    }
+    __atomic_store_n(&(worker->load), 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&(worker->state), WORKER_RUNNING, __ATOMIC_RELEASE);
+    __atomic_store_n(&__started, __started + 1, __ATOMIC_RELEASE);
+    if (pthread_create(&(worker->thread), NULL, run_worker, worker) != 0) {
+        perror("pthread_create");
+        /* it never accepted anything, so it only has to leave the others */
+        worker->thread = 0;
+        __atomic_store_n(&(worker->state), WORKER_RETIRED, __ATOMIC_RELEASE);
+        return;
+    }
+    if (config->verbose) {
+        printf("Started worker %u\n", worker->index);
+    }
+}
+
+static void join_retired(struct worker* worker) {
+    if (worker->thread) {
+        pthread_join(worker->thread, NULL);
+    }
+    /* migrations that were already on their way when it retired */
+    struct migration* migration = take_migrations(worker);
+    while (migration) {
+        struct migration* next = migration->next;
+        resume_pipe(&(__workers[0]), migration);
+        migration = next;
+    }
+    free_worker(worker);
+    /* the rest is only reset when the slot is started again, the others might still look at it */
+    worker->base = NULL;
+    __atomic_store_n(&(worker->load), 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&__started, __started - 1, __ATOMIC_RELEASE);
+    if (config->verbose) {
+        printf("Stopped worker %u\n", __started);
+    }
+}
+
+/* runs on the first worker: start a worker when they are busy, retire the last one when idle */
+static void scale(void) {
+    struct worker* last = &(__workers[__started - 1]);
+    uint32_t state = __atomic_load_n(&(last->state), __ATOMIC_ACQUIRE);
+    if (state == WORKER_RETIRED) {
+        join_retired(last);
+        __scale_cooldown = SCALE_COOLDOWN;
+        return;
+    }
+    if (state == WORKER_RETIRING) {
+        return;
+    }
+    if (__scale_cooldown > 0) {
+        __scale_cooldown--;
+        return;
+    }
+    uint32_t busy = 0;
+    for (uint32_t i = 0; i < __started; i++) {
+        busy += __atomic_load_n(&(__workers[i].busy), __ATOMIC_RELAXED);
+    }
+    if (__started < config->max_threads && busy / __started > SCALE_UP_BUSY) {
+        start_worker();
+        __scale_cooldown = SCALE_COOLDOWN;
+    }
+    else if (__started > config->threads && busy / (__started - 1) < SCALE_DOWN_BUSY) {
+        if (config->verbose) {
+            printf("Retiring worker %u\n", last->index);
+        }
+        __atomic_store_n(&(last->state), WORKER_RETIRING, __ATOMIC_RELEASE);
+        __scale_cooldown = SCALE_COOLDOWN;
+    }
+}
+
+int start(struct config* _config) {
+    config = _config;
+    setvbuf(stdout, NULL, _IONBF, 0);
+    // a client that is gone shows up as EPIPE on the write instead
+    signal(SIGPIPE, SIG_IGN);
+
+#ifndef __linux__
+    if (config->zero_copy) {
+        fprintf(stderr, "--zeroCopy needs MSG_ZEROCOPY, which only Linux has\n");
+        return 1;
+    }
+#endif
+    if ((config->max_threads > 1 || config->hidden_threads > 0) && evthread_use_pthreads() != 0) {
+        /* needed to break the loops of the other workers, and to wake them up for migrations */
+        fprintf(stderr, "Cannot enable thread support in libevent\n");
         return 1;
     }
 
-    if (listen(listener, 16)<0) {
-        perror("listen");
+    __workers = calloc(config->max_threads, sizeof(struct worker));
+    __hidden_workers = calloc(config->hidden_threads, sizeof(struct worker));
+    if (!__workers || (config->hidden_threads > 0 && !__hidden_workers)) {
+        free(__workers);
+        free(__hidden_workers);
         return 1;
     }
+    int result = 0;
+    uint32_t started = 0;
+    for (; started < config->threads; started++) {
+        __workers[started].index = started;
+        __workers[started].state = WORKER_RUNNING;
+        if (!init_worker(&(__workers[started]))) {
+            result = 1;
+            break;
+        }
+    }
+    __started = started;
+    uint32_t hidden_started = 0;
+    /* after the others, which can still fail to bind */
+    for (uint32_t i = 0; result == 0 && i < config->hidden_threads; i++) {
+        __hidden_workers[i].index = i;
+        __hidden_workers[i].dedicated = true;
+        __hidden_workers[i].state = WORKER_RUNNING;
+        if (!init_worker(&(__hidden_workers[i]))) {
+            result = 1;
+            break;
+        }
+    }
+    if (result == 0 && config->hidden_threads > 0) {
+        assign_cpus();
+        for (; hidden_started < config->hidden_threads; hidden_started++) {
+            if (pthread_create(&(__hidden_workers[hidden_started].thread), NULL, run_worker, &(__hidden_workers[hidden_started])) != 0) {
+                perror("pthread_create");
+                result = 1;
+                break;
+            }
+        }
+    }
 
-    __listener_event = event_new(__base, listener, EV_READ|EV_PERSIST, initial_accept, (void*)__base);
+    if (result == 0) {
+        __term_event = evsignal_new(__workers[0].base, SIGTERM, stop_workers, NULL);
+        event_add(__term_event, NULL);
 
-    event_add(__listener_event, NULL);
+        for (uint32_t i = 1; i < started; i++) {
+            if (pthread_create(&(__workers[i].thread), NULL, run_worker, &(__workers[i])) != 0) {
+                perror("pthread_create");
+                stop_workers(SIGTERM, 0, NULL);
+                __started = i;
+                result = 1;
+                break;
+            }
+        }
+        if (result == 0) {
+            run_worker(&(__workers[0]));
+        }
+        /* the first worker might have started or stopped some in the meantime */
+        for (uint32_t i = 1; i < __started; i++) {
+            if (__workers[i].thread) {
+                pthread_join(__workers[i].thread, NULL);
+            }
+        }
+        event_free(__term_event);
+    }
+    else {
+        stop_workers(SIGTERM, 0, NULL);
+    }
+    for (uint32_t i = 0; i < hidden_started; i++) {
+        pthread_join(__hidden_workers[i].thread, NULL);
+    }
 
-    event_base_dispatch(__base);
-    return 0;
+    for (uint32_t i = 0; i < config->max_threads; i++) {
+        free_worker(&(__workers[i]));
+    }
+    for (uint32_t i = 0; i < config->hidden_threads; i++) {
+        free_worker(&(__hidden_workers[i]));
+    }
+    free(__workers);
+    free(__hidden_workers);
+    return result;
 }
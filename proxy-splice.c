@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <ctype.h>
 #include <time.h>
@@ -19,8 +20,21 @@
 #include <sys/socket.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <linux/sockios.h>
 
 #include "knock-common.h"
+#include "knock-totp.h"
+#include "knock-cache.h"
+#include "knock-delays.h"
+#include "knock-tarpit.h"
+#include "knock-shaper.h"
+#include "knock-http.h"
+#include "knock-topk.h"
+#include "knock-record.h"
+#include "splice-io.h"
 #include "debug.h"
 #include "common.h"
 
@@ -28,15 +42,80 @@
 
 
 static struct config* config;
-
-static void* to_free[MAX_EVENTS * 4]; // proxy 2 way plus buffers
-static size_t free_index = 0;
-#define SCHEDULE_FREE(__p) to_free[free_index++] = __p
+static struct knock_matcher knock_matcher;
 
 struct proxy;
+struct timeout_queue;
+
+/*
+ * Flight recorder: every connection keeps its last TRACE_SIZE state changes
+ * (on both sides) in a ring on the front proxy, and the rings of the last
+ * TRACE_CLOSED closed connections are kept as well. They are dumped to
+ * stderr on SIGUSR1, or by the trace command of the control socket.
+ * An entry is the ms since the connection was accepted, the side and the
+ * event, so recording is a few stores.
+ */
+#define TRACE_SIZE 16
+#define TRACE_CLOSED 1024
+
+enum trace_event {
+    TRACE_ACCEPT,
+    TRACE_REMEMBERED,
+    TRACE_FIRST_DATA_HIDDEN,
+    TRACE_FIRST_DATA_NORMAL,
+    TRACE_FIRST_DATA_EOS,
+    TRACE_FIRST_DATA_ERROR,
+    TRACE_TARPIT,
+    TRACE_KNOCK_TIMEOUT,
+    TRACE_CONNECT,
+    TRACE_CONNECT_FAILED,
+    TRACE_CONNECTED,
+    TRACE_KNOCK_STRIPPED,
+    TRACE_READ_AGAIN,
+    TRACE_READ_EOS,
+    TRACE_READ_ERROR,
+    TRACE_WRITE_AGAIN,
+    TRACE_WRITE_EOS,
+    TRACE_WRITE_ERROR,
+    TRACE_THROTTLED,
+    TRACE_TIMED_OUT,
+    TRACE_KILLED,
+    TRACE_CLOSE,
+};
+
+#define TRACE_BACK 0x80
+#define TRACE_EVENT(entry) ((entry) & 0x7f)
+#define TRACE_TIME(entry) ((entry) >> 8)
+#define TRACE_MAX_TIME 0xffffff
+#define TRACE_LINE 640
+
+static const char* trace_names[] = {
+    "accept", "remembered", "first-data-hidden", "first-data-normal", "first-data-eos", "first-data-error",
+    "tarpit", "knock-timeout", "connect", "connect-failed", "connected", "knock-stripped",
+    "read-again", "read-eos", "read-error", "write-again", "write-eos", "write-error",
+    "throttled", "timed-out", "killed", "close",
+};
 
 typedef void (*ProxyCall)(struct proxy* this);
 
+/*
+ * What only the front side of a connection needs lives in its own
+ * allocation, so the back side of every connection stays small.
+ */
+struct front_state {
+    uint64_t id;
+    uint32_t source;
+    uint16_t source_port;
+    bool hidden;
+    bool strip_knock;
+    uint32_t knock_deadline;
+    uint32_t trace_events;
+    uint32_t trace[TRACE_SIZE];
+    struct token_bucket bucket;
+    struct http_route http;
+    struct record_flow record;
+};
+
 struct proxy {
     int socket;
     struct proxy* other;
@@ -49,33 +128,78 @@ struct proxy {
     ProxyCall out_op;
     ProxyCall in_op;
 
+    time_t created;
+
+    bool back;
+    bool shaped;
+    bool throttled;
+    time_t throttled_until;
+    struct proxy* throttle_next;
+    struct proxy* throttle_previous;
+
+    // NULL on the back side
+    struct front_state* state;
+
     time_t last_recieved;
+    struct timeout_queue* queue;
     struct proxy* next;
     struct proxy* previous;
 };
 
 static int _epoll_queue = -1;
 
+/*
+ * Closed proxies are only freed at the end of the event loop, since other
+ * events (or the timeout scan) might still point to them. Once out of their
+ * timeout queue, they are linked through their next pointer, as a single
+ * loop can close any amount of them.
+ */
+static struct proxy* to_free = NULL;
+#define SCHEDULE_FREE(__p) do { (__p)->next = to_free; to_free = (__p); } while (0)
+
 enum { READ = 0, WRITE = 1 };
 
-static struct proxy* timeout_queue_head = NULL;
-static struct proxy* timeout_queue_tail = NULL;
+/*
+ * Connections are kept in two queues, ordered by the last time they
+ * received something (newest at the head), so that timeouts only have to
+ * look at the tail:
+ *  - knock_queues: new connections still waiting for their first data, one
+ *    queue per class of knock deadline (see knock-delays.h). Everyone in a
+ *    queue has the same deadline, so the tail is always the first to expire.
+ *  - timeout_queue: all other connections.
+ */
+struct timeout_queue {
+    struct proxy* head;
+    struct proxy* tail;
+};
 
-static time_t current_time;
+static struct timeout_queue knock_queues[KNOCK_DELAYS_CLASSES];
+// the knock queues that might have connections, cleared when found empty
+static uint64_t knock_classes = 0;
+static struct timeout_queue timeout_queue = { NULL, NULL };
+
+static struct knock_delays knock_delays;
+static struct tarpit tarpit;
+
+static time_t current_time; // in milliseconds
+
+// with --record, the shape of every connection goes to this file
+static struct recorder recorder;
 
 static void touch(struct proxy* this) {
-    //LOG_D("B-Touch: %p (prev: %p, next: %p) (head: %p, tail: %p)\n", (void*)this, (void*)this->previous, (void*)this->next, (void*)timeout_queue_head, (void*)timeout_queue_tail);
+    //LOG_D("B-Touch: %p (prev: %p, next: %p) (head: %p, tail: %p)\n", (void*)this, (void*)this->previous, (void*)this->next, (void*)this->queue->head, (void*)this->queue->tail);
+    struct timeout_queue* queue = this->queue;
     this->last_recieved = current_time;
     this->timed_out = false;
-    if (timeout_queue_head == this) {
+    if (queue->head == this) {
         return;
     }
 
-    struct proxy* old_head = timeout_queue_head;
+    struct proxy* old_head = queue->head;
     struct proxy* old_prev = this->previous;
     struct proxy* old_next = this->next;
 
-    timeout_queue_head = this;
+    queue->head = this;
     this->previous = NULL;
     this->next = old_head;
     if (old_head) {
@@ -91,33 +215,335 @@ static void touch(struct proxy* this) {
     }
     else {
         // we were at the tail of the list
-        timeout_queue_tail = old_prev;
+        queue->tail = old_prev;
     }
 }
 
-static void add_new_timeout_queue(struct proxy* this) {
+static void add_new_timeout_queue(struct timeout_queue* queue, struct proxy* this) {
+    this->queue = queue;
     this->last_recieved = current_time;
     this->previous = NULL;
-    this->next = timeout_queue_head;
-    if (timeout_queue_head) {
-        timeout_queue_head->previous = this;
+    this->next = queue->head;
+    if (queue->head) {
+        queue->head->previous = this;
+    }
+    queue->head = this;
+    if (!queue->tail) {
+        queue->tail = this;
     }
-    timeout_queue_head = this;
 }
 
 static void remove_from_timeout_queue(struct proxy* this) {
+    struct timeout_queue* queue = this->queue;
     if (this->previous) {
         this->previous->next = this->next;
     }
     if (this->next) {
         this->next->previous = this->previous;
     }
-    if (timeout_queue_tail == this) {
-        timeout_queue_tail = this->previous;
+    if (queue->tail == this) {
+        queue->tail = this->previous;
+    }
+    if (queue->head == this) {
+        queue->head = this->next;
+    }
+}
+
+/*
+ * Every front proxy has a slot in the registry, so that the control socket
+ * can walk and find connections without following queue pointers that
+ * change while a listing is in progress. Ids combine the slot with a
+ * generation, so an old id never matches a newer connection in its slot.
+ */
+struct registry_slot {
+    struct proxy* proxy;
+    uint32_t generation;
+    uint32_t next_free;
+};
+
+#define NO_SLOT UINT32_MAX
+#define ID_SLOT(id) ((uint32_t)(id))
+#define ID_GENERATION(id) ((uint32_t)((id) >> 32))
+
+static struct registry_slot* registry = NULL;
+static uint32_t registry_size = 0;
+static uint32_t registry_free = NO_SLOT;
+static uint32_t registry_high = 0; // above every slot in use so far, the free list hands out low slots first
+
+static bool register_connection(struct proxy* front) {
+    if (registry_free == NO_SLOT) {
+        uint32_t new_size = registry_size ? registry_size * 2 : 1024;
+        struct registry_slot* new_registry = realloc(registry, new_size * sizeof(struct registry_slot));
+        if (!new_registry) {
+            return false;
+        }
+        registry = new_registry;
+        for (uint32_t i = new_size; i > registry_size; i--) {
+            registry[i - 1].proxy = NULL;
+            registry[i - 1].generation = 0;
+            registry[i - 1].next_free = registry_free;
+            registry_free = i - 1;
+        }
+        registry_size = new_size;
+    }
+    uint32_t slot = registry_free;
+    registry_free = registry[slot].next_free;
+    if (slot >= registry_high) {
+        registry_high = slot + 1;
+    }
+    registry[slot].proxy = front;
+    front->state->id = (uint64_t)(++registry[slot].generation) << 32 | slot;
+    return true;
+}
+
+static void unregister_connection(struct proxy* front) {
+    uint32_t slot = ID_SLOT(front->state->id);
+    registry[slot].proxy = NULL;
+    registry[slot].next_free = registry_free;
+    registry_free = slot;
+    front->state->id = 0;
+}
+
+static struct proxy* find_connection(uint64_t id) {
+    uint32_t slot = ID_SLOT(id);
+    if (slot >= registry_size || registry[slot].generation != ID_GENERATION(id)) {
+        return NULL;
+    }
+    return registry[slot].proxy;
+}
+
+static void trace(struct proxy* proxy, enum trace_event event) {
+    struct proxy* front = proxy->back ? proxy->other : proxy;
+    time_t since = current_time - front->created;
+    uint32_t entry = (uint32_t)(since < TRACE_MAX_TIME ? since : TRACE_MAX_TIME) << 8 | (proxy->back ? TRACE_BACK : 0) | event;
+    uint32_t* last = &front->state->trace[(front->state->trace_events - 1) % TRACE_SIZE];
+    if (front->state->trace_events && (*last & 0xff) == (entry & 0xff)) {
+        // a busy connection would fill the ring with EAGAINs, so a repeat only moves the time
+        *last = entry;
+        return;
+    }
+    front->state->trace[front->state->trace_events++ % TRACE_SIZE] = entry;
+}
+
+struct trace_record {
+    uint64_t id;
+    const char* route;
+    uint32_t source;
+    uint16_t source_port;
+    time_t created;
+    uint32_t events;
+    uint32_t entries[TRACE_SIZE];
+};
+
+static struct trace_record closed_traces[TRACE_CLOSED];
+static uint64_t closed_count = 0;
+
+static const char* route(struct proxy* front) {
+    if (!front->other) {
+        return "-";
+    }
+    return front->state->hidden ? "hidden" : "normal";
+}
+
+static void trace_snapshot(struct proxy* front, const char* route, struct trace_record* record) {
+    record->id = front->state->id;
+    record->route = route;
+    record->source = front->state->source;
+    record->source_port = front->state->source_port;
+    record->created = front->created;
+    record->events = front->state->trace_events;
+    memcpy(record->entries, front->state->trace, sizeof(record->entries));
+}
+
+/* one line of at most TRACE_LINE characters, the entries are ms since the accept, the side and the event */
+static size_t format_trace(char* output, const char* state, const struct trace_record* record) {
+    size_t length = (size_t)snprintf(output, TRACE_LINE, "%s %llu %s %u.%u.%u.%u:%u %lld",
+            state, (unsigned long long)record->id, record->route,
+            record->source >> 24, (record->source >> 16) & 0xff, (record->source >> 8) & 0xff, record->source & 0xff, record->source_port,
+            (long long)(current_time - record->created));
+    for (uint32_t e = record->events > TRACE_SIZE ? record->events - TRACE_SIZE : 0; e < record->events; e++) {
+        uint32_t entry = record->entries[e % TRACE_SIZE];
+        length += (size_t)snprintf(output + length, TRACE_LINE - length, " %u:%s:%s",
+                TRACE_TIME(entry), entry & TRACE_BACK ? "back" : "front", trace_names[TRACE_EVENT(entry)]);
+    }
+    length += (size_t)snprintf(output + length, TRACE_LINE - length, "\n");
+    return length;
+}
+
+static void remember_closed(struct proxy* front, const char* route) {
+    trace(front, TRACE_CLOSE);
+    trace_snapshot(front, route, &closed_traces[closed_count++ % TRACE_CLOSED]);
+}
+
+static volatile sig_atomic_t dump_requested = 0;
+
+static void request_dump(int UNUSED(signum)) {
+    dump_requested = 1;
+}
+
+static void dump_traces() {
+    char line[TRACE_LINE];
+    struct trace_record record;
+    fprintf(stderr, "state id route source age_ms events\n");
+    for (uint32_t i = 0; i < registry_size; i++) {
+        struct proxy* front = registry[i].proxy;
+        if (front && !front->closed) {
+            trace_snapshot(front, route(front), &record);
+            format_trace(line, "open", &record);
+            fputs(line, stderr);
+        }
+    }
+    for (uint64_t c = closed_count > TRACE_CLOSED ? closed_count - TRACE_CLOSED : 0; c < closed_count; c++) {
+        format_trace(line, "closed", &closed_traces[c % TRACE_CLOSED]);
+        fputs(line, stderr);
+    }
+    fprintf(stderr, "end\n");
+}
+
+/*
+ * Heavy hitters: the source prefixes that moved the most bytes, and that
+ * opened the most connections, in two fixed size top-K sketches, so that
+ * abusers can be found without keeping counters per source.
+ */
+#define TOP_PREFIX_BITS 24
+#define TOP_PREFIX(source) ((source) & ~(UINT32_MAX >> TOP_PREFIX_BITS))
+
+static struct topk top_bytes;
+static struct topk top_connections;
+
+/*
+ * Shaping: with rate limits, the bytes a side reads into its pipe take
+ * tokens from the bucket of its connection and of its route. A side that
+ * runs out stops reading, like it does when the pipe is full, but since
+ * the socket won't signal the data that is already waiting, it is parked
+ * in the throttle queue (ordered by when there are tokens again) instead.
+ */
+#define SHAPE_MIN_READ 4096
+
+static struct token_bucket route_buckets[2]; // indexed by hidden
+static struct proxy* throttled_head = NULL;
+static struct proxy* throttled_tail = NULL;
+
+static void throttle(struct proxy* proxy, time_t until) {
+    proxy->throttled = true;
+    proxy->throttled_until = until;
+    // almost always the latest, so search from the tail
+    struct proxy* before = throttled_tail;
+    while (before && before->throttled_until > until) {
+        before = before->throttle_previous;
+    }
+    proxy->throttle_previous = before;
+    proxy->throttle_next = before ? before->throttle_next : throttled_head;
+    if (proxy->throttle_next) {
+        proxy->throttle_next->throttle_previous = proxy;
+    }
+    else {
+        throttled_tail = proxy;
+    }
+    if (before) {
+        before->throttle_next = proxy;
+    }
+    else {
+        throttled_head = proxy;
+    }
+}
+
+static void unthrottle(struct proxy* proxy) {
+    if (proxy->throttle_previous) {
+        proxy->throttle_previous->throttle_next = proxy->throttle_next;
+    }
+    else {
+        throttled_head = proxy->throttle_next;
+    }
+    if (proxy->throttle_next) {
+        proxy->throttle_next->throttle_previous = proxy->throttle_previous;
+    }
+    else {
+        throttled_tail = proxy->throttle_previous;
+    }
+    proxy->throttled = false;
+}
+
+/* bytes (at most wanted) this side may read now, when that is nothing it is throttled */
+static size_t shape(struct proxy* proxy, size_t wanted) {
+    if (proxy->throttled) {
+        return 0;
+    }
+    struct proxy* front = proxy->back ? proxy->other : proxy;
+    struct token_bucket* route_bucket = &route_buckets[front->state->hidden];
+    size_t available = token_bucket_available(&front->state->bucket, (uint64_t)current_time);
+    size_t route_available = token_bucket_available(route_bucket, (uint64_t)current_time);
+    uint64_t wait = token_bucket_wait(&front->state->bucket, SHAPE_MIN_READ);
+    uint64_t route_wait = token_bucket_wait(route_bucket, SHAPE_MIN_READ);
+    if (wait == 0 && route_wait == 0) {
+        if (route_available < available) {
+            available = route_available;
+        }
+        return available < wanted ? available : wanted;
+    }
+    trace(proxy, TRACE_THROTTLED);
+    throttle(proxy, current_time + (time_t)(wait > route_wait ? wait : route_wait));
+    return 0;
+}
+
+static void take_tokens(struct proxy* proxy, size_t bytes) {
+    struct proxy* front = proxy->back ? proxy->other : proxy;
+    token_bucket_take(&front->state->bucket, bytes);
+    token_bucket_take(&route_buckets[front->state->hidden], bytes);
+}
+
+static void start_shaping(struct proxy* front, struct proxy* back) {
+    const struct rate_limit* limit = &config->rate_limits[front->state->hidden];
+    front->shaped = back->shaped = limit->route || limit->connection;
+    if (front->shaped) {
+        token_bucket_init(&front->state->bucket, limit->connection, (uint64_t)current_time);
+    }
+}
+
+static void wake_throttled() {
+    while (throttled_head && throttled_head->throttled_until <= current_time) {
+        struct proxy* proxy = throttled_head;
+        unthrottle(proxy);
+        // the data has been waiting, so it is not idle
+        touch(proxy);
+        proxy->in_op(proxy);
     }
-    if (timeout_queue_head == this) {
-        timeout_queue_head = this->next;
+}
+
+static bool control_pending();
+
+/* milliseconds until the next connection could time out, or -1 if there are none */
+static int next_timeout() {
+    if (control_pending()) {
+        return 0;
     }
+    time_t next = -1;
+    if (timeout_queue.tail) {
+        next = timeout_queue.tail->last_recieved + config->default_timeout.tv_sec * 1000;
+    }
+    for (uint64_t classes = knock_classes; classes; classes &= classes - 1) {
+        struct proxy* oldest = knock_queues[__builtin_ctzll(classes)].tail;
+        if (oldest) {
+            time_t knock = oldest->last_recieved + oldest->state->knock_deadline;
+            if (next == -1 || knock < next) {
+                next = knock;
+            }
+        }
+    }
+    if (throttled_head && (next == -1 || throttled_head->throttled_until < next)) {
+        next = throttled_head->throttled_until;
+    }
+    int64_t tarpit_release = tarpit_next(&tarpit, (uint32_t)(current_time / 1000));
+    if (tarpit_release != -1) {
+        time_t release = (current_time / 1000 + tarpit_release) * 1000;
+        if (next == -1 || release < next) {
+            next = release;
+        }
+    }
+    if (next == -1) {
+        return -1;
+    }
+    return next < current_time ? 0 : (int)(next - current_time) + 1;
 }
 
 static bool add_to_queue(int socket, void* data) {
@@ -127,7 +553,7 @@ static bool add_to_queue(int socket, void* data) {
 #endif
     ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
     ev.data.ptr = data;
-    if (epoll_ctl(_epoll_queue, EPOLL_CTL_ADD, socket, &ev) < 0) {
+    if (io_epoll_ctl(_epoll_queue, EPOLL_CTL_ADD, socket, &ev) < 0) {
         perror("cannot connect epoll to just created socket");
         return false;
     }
@@ -138,19 +564,27 @@ static void close_and_free_proxy(struct proxy* proxy) {
     if (!proxy->closed) {
         LOG_D("closing: %p %d\n", (void*)proxy, proxy->socket);
 
-        epoll_ctl(_epoll_queue, EPOLL_CTL_DEL, proxy->socket, NULL);
-        close(proxy->socket);
+        io_epoll_ctl(_epoll_queue, EPOLL_CTL_DEL, proxy->socket, NULL);
+        io_close(proxy->socket);
         proxy->closed = true;
 
         if (proxy->other) {
             close_and_free_proxy(proxy->other);
         }
 
-        close(proxy->buffer[READ]);
-        close(proxy->buffer[WRITE]);
+        io_close(proxy->buffer[READ]);
+        io_close(proxy->buffer[WRITE]);
 
-        SCHEDULE_FREE(proxy);
+        if (proxy->throttled) {
+            unthrottle(proxy);
+        }
+        if (!proxy->back && proxy->state->id) {
+            remember_closed(proxy, route(proxy));
+            unregister_connection(proxy);
+            record_close(&recorder, &proxy->state->record, (uint64_t)current_time);
+        }
         remove_from_timeout_queue(proxy);
+        SCHEDULE_FREE(proxy);
     }
 }
 
@@ -158,6 +592,7 @@ static void handle_normal_timeout(struct proxy* this) {
     if (!this->timed_out) {
         // only handle new time out events
         this->timed_out = true;
+        trace(this, TRACE_TIMED_OUT);
         if (this->other) {
             // we are a fully running connection
             if (this->other->timed_out) {
@@ -179,6 +614,7 @@ static void handle_normal_timeout(struct proxy* this) {
 
 static void do_proxy(struct proxy* proxy) {
     bool should_close_proxy = false;
+    size_t moved = 0;
     LOG_V("Started normal proxy: %p\n", (void*)proxy);
     while (true) {
         /*** reasons the loop stops:
@@ -187,14 +623,20 @@ static void do_proxy(struct proxy* proxy) {
          */
 
 
-        // read everything we can fit into the pipe buffer
-        ssize_t bytes_read = splice(proxy->socket, NULL, proxy->buffer[WRITE], NULL, MAX_SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
-        if (bytes_read == -1) {
+        // read everything we can fit into the pipe buffer, as far as the rate limits allow
+        size_t allowed = proxy->shaped ? shape(proxy, MAX_SPLICE_CHUNK) : MAX_SPLICE_CHUNK;
+        ssize_t bytes_read = allowed ? io_splice(proxy->socket, NULL, proxy->buffer[WRITE], NULL, allowed, SPLICE_F_MOVE | SPLICE_F_NONBLOCK) : 0;
+        if (allowed == 0) {
+            // throttled, wake_throttled() continues once there are tokens again
+        }
+        else if (bytes_read == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 bytes_read = 0; // expected end of non_blocking splice
+                trace(proxy, TRACE_READ_AGAIN);
             }
             else {
                 LOG_D("ASYNC got connection error: %p %d\n", (void*)proxy, proxy->socket);
+                trace(proxy, TRACE_READ_ERROR);
 #ifdef DEBUG
                 perror("Connection error (splicing from socket to pipe)");
 #endif
@@ -203,8 +645,12 @@ static void do_proxy(struct proxy* proxy) {
         }
         else if (bytes_read == 0) {
             LOG_D("ASYNC got EOS: %p %d\n", (void*)proxy, proxy->socket);
+            trace(proxy, TRACE_READ_EOS);
             should_close_proxy = true;
         }
+        else if (proxy->shaped) {
+            take_tokens(proxy, (size_t)bytes_read);
+        }
         proxy->buffer_filled += bytes_read;
 
         if (proxy->buffer_filled == 0) {
@@ -212,13 +658,15 @@ static void do_proxy(struct proxy* proxy) {
         }
 
         // splice stuff from pipe to target socket
-        ssize_t bytes_written = splice(proxy->buffer[READ], NULL, proxy->other->socket, NULL, MIN(proxy->buffer_filled, MAX_SPLICE_CHUNK), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        ssize_t bytes_written = io_splice(proxy->buffer[READ], NULL, proxy->other->socket, NULL, MIN(proxy->buffer_filled, MAX_SPLICE_CHUNK), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
         if (bytes_written == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                trace(proxy, TRACE_WRITE_AGAIN);
                 break; // target not ready to receive more bytes
             }
             else {
                 LOG_D("ASYNC got connection error: %p %d\n", (void*)proxy, proxy->socket);
+                trace(proxy, TRACE_WRITE_ERROR);
 #ifdef DEBUG
                 perror("Connection error (splicing from pipe to socket)");
 #endif
@@ -229,13 +677,20 @@ static void do_proxy(struct proxy* proxy) {
         }
         else if (bytes_written == 0) {
             LOG_D("ASYNC got EOS: %p %d\n", (void*)proxy, proxy->socket);
+            trace(proxy, TRACE_WRITE_EOS);
             should_close_proxy = true;
             proxy->buffer_filled = 0; // signal that the data should be dropped
             break;
         }
         proxy->buffer_filled -= bytes_written;
+        moved += (size_t)bytes_written;
     }
 
+    if (moved > 0) {
+        struct proxy* front = proxy->back ? proxy->other : proxy;
+        topk_add(&top_bytes, TOP_PREFIX(front->state->source), moved);
+        record_bytes(&recorder, &front->state->record, (uint64_t)current_time, proxy->back, moved);
+    }
     if (should_close_proxy && proxy->buffer_filled == 0) {
         LOG_D("During proxy we determined we should close it: %p %d\n", (void*)proxy, proxy->socket);
         close_and_free_proxy(proxy);
@@ -244,15 +699,43 @@ static void do_proxy(struct proxy* proxy) {
 
 static void do_proxy_reverse(struct proxy* proxy) {
     // out side is ready for writing, so flush buffers to that direction
-    do_proxy(proxy->other);
+    proxy->other->in_op(proxy->other);
+}
+
+/*
+ * A remembered source was forwarded to the hidden port before it send
+ * anything, so if it still knocks, the knock should not reach the backend.
+ */
+static void strip_knock(struct proxy* front) {
+    uint8_t* tmp_buffer = malloc(config->knock_size);
+    ssize_t bytes_read = io_recv(front->socket, tmp_buffer, config->knock_size, MSG_PEEK);
+    bool wait = bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    if (bytes_read > 0 && (size_t)bytes_read < config->knock_size) {
+        wait = knock_prefix_matches(&knock_matcher, tmp_buffer, bytes_read);
+    }
+    if (wait) {
+        // nothing yet, or only the start of the knock
+        free(tmp_buffer);
+        return;
+    }
+    if (bytes_read > 0 && knock_matches(&knock_matcher, tmp_buffer, bytes_read)) {
+        LOG_D("Dropping knock of remembered source: %p\n", (void*)front);
+        trace(front, TRACE_KNOCK_STRIPPED);
+        bytes_read = io_read(front->socket, tmp_buffer, config->knock_size);
+    }
+    free(tmp_buffer);
+    front->in_op = do_proxy;
+    do_proxy(front);
 }
 
 static void back_connection_finished(struct proxy* back) {
     struct proxy* front = back->other;
 
     LOG_D("Back connection setup: %p\n", (void*)back);
+    trace(back, TRACE_CONNECTED);
     back->out_op = front->out_op = do_proxy_reverse;
-    back->in_op = front->in_op = do_proxy;
+    back->in_op = do_proxy;
+    front->in_op = front->state->strip_knock ? strip_knock : do_proxy;
 
     do_proxy_reverse(back);
     do_proxy(back);
@@ -266,22 +749,33 @@ static int create_connection(int port) {
     sin.sin_addr.s_addr = htonl(0x7f000001); /* 127.0.0.1 */
     sin.sin_port = htons(port);
 
-    int new_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int new_socket = io_socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (new_socket < 0) {
         return -1;
     }
-    int res = connect(new_socket, (struct sockaddr *)(&sin), sizeof(struct sockaddr_in));
+    int res = io_connect(new_socket, (struct sockaddr *)(&sin), sizeof(struct sockaddr_in));
     if (res < 0 && errno != EINPROGRESS) {
         perror("Error opening connection to back-end");
-        close(new_socket);
+        io_close(new_socket);
         return -1;
     }
     return new_socket;
 }
 
 static void setup_back_connection(struct proxy* proxy, uint32_t port) {
+    proxy->state->hidden = port == config->hidden_port;
+    // only the knock timeout sets timed_out before there is a back connection
+    record_route(&recorder, &proxy->state->record, (uint64_t)current_time, proxy->state->hidden ? RECORD_HIDDEN : proxy->timed_out ? RECORD_SILENT : RECORD_NORMAL);
+    if (proxy->queue != &timeout_queue) {
+        // done waiting for the knock, from now on the normal timeout applies
+        remove_from_timeout_queue(proxy);
+        add_new_timeout_queue(&timeout_queue, proxy);
+    }
+
+    trace(proxy, TRACE_CONNECT);
     int back_proxy_socket = create_connection(port);
     if (back_proxy_socket < 0) {
+        trace(proxy, TRACE_CONNECT_FAILED);
         close_and_free_proxy(proxy);
         return;
     }
@@ -289,25 +783,33 @@ static void setup_back_connection(struct proxy* proxy, uint32_t port) {
     struct proxy *back_proxy = malloc(sizeof(struct proxy));
     if (!back_proxy) {
         perror("Cannot allocate memory for back proxy");
-        close(back_proxy_socket);
+        io_close(back_proxy_socket);
+        close_and_free_proxy(proxy);
+        return;
+    }
+    if (io_pipe2(back_proxy->buffer, O_CLOEXEC | O_NONBLOCK) != 0) {
+        perror("Cannot allocate pipe buffers");
+        io_close(back_proxy_socket);
+        free(back_proxy);
         close_and_free_proxy(proxy);
         return;
     }
     back_proxy->closed = false;
+    back_proxy->back = true;
+    back_proxy->throttled = false;
+    back_proxy->state = NULL;
     back_proxy->socket = back_proxy_socket;
     back_proxy->other = proxy;
     proxy->other = back_proxy;
     back_proxy->timed_out = false;
-    if (pipe2(back_proxy->buffer, O_CLOEXEC | O_NONBLOCK) != 0) {
-        perror("Cannot allocate pipe buffers");
-        close_and_free_proxy(proxy);
-        return;
-    }
     back_proxy->buffer_filled = 0;
     back_proxy->out_op = back_connection_finished;
     back_proxy->in_op = NULL;
+    back_proxy->created = current_time;
+
+    start_shaping(proxy, back_proxy);
 
-    add_new_timeout_queue(back_proxy);
+    add_new_timeout_queue(&timeout_queue, back_proxy);
     if (!add_to_queue(back_proxy_socket, back_proxy)) {
         close_and_free_proxy(proxy);
         return;
@@ -316,39 +818,72 @@ static void setup_back_connection(struct proxy* proxy, uint32_t port) {
 
 }
 
+static void move_to_tarpit(struct proxy* proxy) {
+    LOG_D("Tarpitting: %p %d\n", (void*)proxy, proxy->socket);
+    io_epoll_ctl(_epoll_queue, EPOLL_CTL_DEL, proxy->socket, NULL);
+    io_close(proxy->buffer[READ]);
+    io_close(proxy->buffer[WRITE]);
+    proxy->closed = true;
+    remember_closed(proxy, "tarpit");
+    unregister_connection(proxy);
+    record_route(&recorder, &proxy->state->record, (uint64_t)current_time, RECORD_TARPIT);
+    record_close(&recorder, &proxy->state->record, (uint64_t)current_time);
+    remove_from_timeout_queue(proxy);
+    SCHEDULE_FREE(proxy);
+    tarpit_add(&tarpit, proxy->socket, (uint32_t)(current_time / 1000));
+}
+
 static void first_data(struct proxy* proxy) {
     assert(proxy->other == NULL);
     assert(!proxy->closed);
 
-    uint8_t* tmp_buffer = malloc(config->knock_size);
-    size_t bytes_read = read(proxy->socket, tmp_buffer, config->knock_size);
-    if (bytes_read == -1u && errno != EAGAIN && errno != EWOULDBLOCK) {
-        LOG_D("Got connection error before first read: %p %d\n", (void*)proxy, proxy->socket);
+    uint8_t* tmp_buffer = malloc(config->first_data_size);
+    ssize_t bytes_read = io_read(proxy->socket, tmp_buffer, config->first_data_size);
+    if (bytes_read == -1) {
         free(tmp_buffer);
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        LOG_D("Got connection error before first read: %p %d\n", (void*)proxy, proxy->socket);
+        trace(proxy, TRACE_FIRST_DATA_ERROR);
         close_and_free_proxy(proxy);
         perror("Connection error: (Reading initial data from remote)");
         return;
     }
     if (bytes_read == 0) {
         LOG_D("Got EOS before first read: %p %d\n", (void*)proxy, proxy->socket);
+        trace(proxy, TRACE_FIRST_DATA_EOS);
         free(tmp_buffer);
         close_and_free_proxy(proxy);
         return;
     }
 
+    knock_delays_record(&knock_delays, (uint32_t)(current_time - proxy->created));
+
     uint32_t port = config->normal_port;
-    if (bytes_read == config->knock_size) {
-        if (memcmp(config->knock_value, tmp_buffer, config->knock_size) == 0) {
-            port = config->hidden_port;
-        }
+    size_t forward_from = 0;
+    if ((size_t)bytes_read >= config->knock_size && knock_matches(&knock_matcher, tmp_buffer, config->knock_size)) {
+        port = config->hidden_port;
+        forward_from = config->knock_size;
+        knock_cache_remember_peer(proxy->socket);
+        trace(proxy, TRACE_FIRST_DATA_HIDDEN);
+    }
+    else if (tarpit_matches(config, tmp_buffer, bytes_read)) {
+        trace(proxy, TRACE_TARPIT);
+        free(tmp_buffer);
+        move_to_tarpit(proxy);
+        return;
     }
-    if (port == config->normal_port && bytes_read > 0) {
-        // copy stuff we read to the pipe
-        size_t written = 0;
-        while (written < bytes_read) {
-            written += write(proxy->buffer[WRITE], tmp_buffer + written, bytes_read - written);
+    else {
+        trace(proxy, TRACE_FIRST_DATA_NORMAL);
+    }
+    if ((size_t)bytes_read > forward_from) {
+        // copy stuff we read (except the knock) to the pipe
+        size_t written = forward_from;
+        while (written < (size_t)bytes_read) {
+            written += io_write(proxy->buffer[WRITE], tmp_buffer + written, bytes_read - written);
         }
-        proxy->buffer_filled += bytes_read;
+        proxy->buffer_filled += bytes_read - forward_from;
     }
 
 #ifdef DEBUG
@@ -368,9 +903,73 @@ static void first_data(struct proxy* proxy) {
     setup_back_connection(proxy, port);
 }
 
+/*
+ * With HTTP routing the request head is only peeked at, until the parser
+ * knows the route, so the back connection splices all of it unchanged.
+ * The knock and the tarpit still work on the first bytes.
+ */
+static void first_http_data(struct proxy* proxy) {
+    static uint8_t head[HTTP_ROUTE_MAX_HEAD];
+    ssize_t bytes_read = io_recv(proxy->socket, head, sizeof(head), MSG_PEEK);
+    if (bytes_read == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        LOG_D("Got connection error before first read: %p %d\n", (void*)proxy, proxy->socket);
+        trace(proxy, TRACE_FIRST_DATA_ERROR);
+        close_and_free_proxy(proxy);
+        perror("Connection error: (Peeking at initial data from remote)");
+        return;
+    }
+    if (bytes_read == 0) {
+        LOG_D("Got EOS before first read: %p %d\n", (void*)proxy, proxy->socket);
+        trace(proxy, TRACE_FIRST_DATA_EOS);
+        close_and_free_proxy(proxy);
+        return;
+    }
+
+    if (proxy->state->http.parsed == 0) {
+        knock_delays_record(&knock_delays, (uint32_t)(current_time - proxy->created));
+        if ((size_t)bytes_read >= config->knock_size && knock_matches(&knock_matcher, head, config->knock_size)) {
+            // drop the knock, the rest stays for the backend
+            bytes_read = io_read(proxy->socket, head, config->knock_size);
+            knock_cache_remember_peer(proxy->socket);
+            trace(proxy, TRACE_FIRST_DATA_HIDDEN);
+            setup_back_connection(proxy, config->hidden_port);
+            return;
+        }
+        if (tarpit_matches(config, head, bytes_read)) {
+            trace(proxy, TRACE_TARPIT);
+            move_to_tarpit(proxy);
+            return;
+        }
+    }
+    if ((size_t)bytes_read <= proxy->state->http.parsed) {
+        return;
+    }
+    switch (http_route_parse(&proxy->state->http, config, head + proxy->state->http.parsed, (size_t)bytes_read - proxy->state->http.parsed)) {
+        case HTTP_ROUTE_MORE:
+            // the rest of the head (or the knock timeout) will tell
+            return;
+        case HTTP_ROUTE_HIDDEN:
+            trace(proxy, TRACE_FIRST_DATA_HIDDEN);
+            setup_back_connection(proxy, config->hidden_port);
+            return;
+        case HTTP_ROUTE_NORMAL:
+            trace(proxy, TRACE_FIRST_DATA_NORMAL);
+            setup_back_connection(proxy, config->normal_port);
+            return;
+    }
+}
+
 static void handle_knock_timeout(struct proxy* this) {
     if (!this->timed_out) {
         this->timed_out = true;
+        trace(this, TRACE_KNOCK_TIMEOUT);
+        if (this->state->http.parsed == 0) {
+            // a partial HTTP head was already recorded when it arrived
+            knock_delays_expired(&knock_delays, (uint32_t)(current_time - this->created));
+        }
         setup_back_connection(this, config->normal_port);
     }
 }
@@ -405,43 +1004,507 @@ static void process_other_events(struct epoll_event *ev) {
     }
 }
 
+/*
+ * TCP statistics: every loop samples TCP_INFO (and the send queue) of both
+ * sockets of a few random proxying connections, TCP_SAMPLES_PER_SECOND on
+ * average but never more than TCP_SAMPLES_PER_LOOP at once, so the cost
+ * doesn't grow with the amount of connections or events. The samples go in
+ * log2 histograms per route, side and metric: a bucket holds the values
+ * below its bound, and at least half of it.
+ */
+#define TCP_SAMPLES_PER_SECOND 100
+#define TCP_SAMPLES_PER_LOOP 4
+#define TCP_BUCKETS 32
+
+enum tcp_metric {
+    METRIC_RTT,
+    METRIC_RETRANSMITS,
+    METRIC_CWND,
+    METRIC_SEND_QUEUE,
+    TCP_METRICS,
+};
+
+static const char* tcp_metric_names[] = { "rtt_us", "retransmits", "cwnd", "send_queue" };
+
+struct tcp_histogram {
+    uint64_t samples;
+    uint64_t buckets[TCP_BUCKETS];
+};
+
+// indexed by hidden, back and metric
+static struct tcp_histogram tcp_histograms[2][2][TCP_METRICS];
+static uint64_t tcp_sample_credit = 0; // in thousandths of a sample
+static time_t tcp_sampled_at = 0;
+static uint32_t tcp_random = 0x9e3779b9;
+
+static void tcp_record(struct tcp_histogram* histogram, uint64_t value) {
+    uint32_t bucket = value < 2 ? 0 : (uint32_t)(63 - __builtin_clzll(value));
+    histogram->samples++;
+    histogram->buckets[bucket < TCP_BUCKETS ? bucket : TCP_BUCKETS - 1]++;
+}
+
+static void tcp_sample_socket(int socket, struct tcp_histogram histograms[TCP_METRICS]) {
+    struct tcp_info info;
+    socklen_t size = sizeof(info);
+    if (io_getsockopt(socket, IPPROTO_TCP, TCP_INFO, &info, &size) != 0) {
+        return;
+    }
+    tcp_record(&histograms[METRIC_RTT], info.tcpi_rtt);
+    tcp_record(&histograms[METRIC_RETRANSMITS], info.tcpi_total_retrans);
+    tcp_record(&histograms[METRIC_CWND], info.tcpi_snd_cwnd);
+    int queued;
+    if (io_ioctl(socket, SIOCOUTQ, &queued) == 0 && queued >= 0) {
+        tcp_record(&histograms[METRIC_SEND_QUEUE], (uint64_t)queued);
+    }
+}
+
+static void sample_tcp() {
+    tcp_sample_credit += (uint64_t)(current_time - tcp_sampled_at) * TCP_SAMPLES_PER_SECOND;
+    tcp_sampled_at = current_time;
+    if (tcp_sample_credit > TCP_SAMPLES_PER_LOOP * 1000) {
+        tcp_sample_credit = TCP_SAMPLES_PER_LOOP * 1000;
+    }
+    // empty slots count as tries as well, to bound the work of a sparse registry
+    for (int tries = 0; tries < 2 * TCP_SAMPLES_PER_LOOP && tcp_sample_credit >= 1000 && registry_high; tries++) {
+        tcp_random ^= tcp_random << 13;
+        tcp_random ^= tcp_random >> 17;
+        tcp_random ^= tcp_random << 5;
+        struct proxy* front = registry[tcp_random % registry_high].proxy;
+        if (!front || front->closed || !front->other || front->other->out_op == back_connection_finished) {
+            continue;
+        }
+        tcp_sample_credit -= 1000;
+        tcp_sample_socket(front->socket, tcp_histograms[front->state->hidden][0]);
+        tcp_sample_socket(front->other->socket, tcp_histograms[front->state->hidden][1]);
+    }
+}
+
+/*
+ * The control socket: a unix socket that takes one command per line.
+ *  - list: one line per connection, with its id, phase, route, source, age,
+ *    idle time and the bytes buffered in both pipes
+ *  - kill ID: close a connection
+ *  - kill-source ADDRESS: close all connections from an address
+ *  - trace: the flight recorder of the open connections, and of the last
+ *    closed ones
+ *  - top: the heavy hitters, by bytes and by connections
+ *  - tcp: the histograms of the sampled TCP statistics
+ * Listings are send in chunks of CONTROL_CHUNK connections per event loop,
+ * so a long listing doesn't hold up the proxying.
+ */
+#define MAX_CONTROL_CLIENTS 4
+#define CONTROL_CHUNK 64
+#define CONTROL_LINE 128
+
+struct control_client {
+    int socket;
+    bool listing;
+    bool tracing;
+    bool top;
+    bool tcp;
+    bool chunk_done;
+    uint32_t cursor;
+    uint64_t closed_cursor;
+    uint64_t closed_end;
+    size_t input_size;
+    size_t output_start;
+    size_t output_size;
+    char input[CONTROL_LINE];
+    char output[CONTROL_CHUNK * CONTROL_LINE];
+};
+
+static int control_socket = -1;
+static char control_listener; // only its address is used, to recognize the events
+static struct control_client control_clients[MAX_CONTROL_CLIENTS];
+
+static bool is_control(void* data) {
+    return data == &control_listener || ((char*)data >= (char*)control_clients && (char*)data < (char*)(control_clients + MAX_CONTROL_CLIENTS));
+}
+
+static bool control_pending() {
+    for (int i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+        // unless it waits for the socket to have room again
+        if (control_clients[i].socket != -1 && control_clients[i].listing && control_clients[i].output_size == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void control_close(struct control_client* client) {
+    io_epoll_ctl(_epoll_queue, EPOLL_CTL_DEL, client->socket, NULL);
+    io_close(client->socket);
+    client->socket = -1;
+}
+
+// a line that doesn't fit anymore is cut off, the buffer always stays terminated
+__attribute__((format(printf, 2, 3)))
+static void control_printf(struct control_client* client, const char* format, ...) {
+    size_t room = sizeof(client->output) - client->output_size;
+    va_list arguments;
+    va_start(arguments, format);
+    int written = vsnprintf(client->output + client->output_size, room, format, arguments);
+    va_end(arguments);
+    if (written > 0) {
+        client->output_size += (size_t)written < room ? (size_t)written : room - 1;
+    }
+}
+
+static const char* phase(struct proxy* front) {
+    if (!front->other) {
+        return "knock";
+    }
+    if (front->other->out_op == back_connection_finished) {
+        return "connecting";
+    }
+    return "proxying";
+}
+
+static void control_trace_chunk(struct control_client* client) {
+    struct trace_record record;
+    // trace lines are long, so the room in the buffer limits the chunk
+    while (sizeof(client->output) - client->output_size >= TRACE_LINE) {
+        if (client->cursor < registry_size) {
+            struct proxy* front = registry[client->cursor++].proxy;
+            if (front && !front->closed) {
+                trace_snapshot(front, route(front), &record);
+                client->output_size += format_trace(client->output + client->output_size, "open", &record);
+            }
+            continue;
+        }
+        if (client->closed_cursor + TRACE_CLOSED < closed_count) {
+            // overwritten while we were listing
+            client->closed_cursor = closed_count - TRACE_CLOSED;
+        }
+        if (client->closed_cursor >= client->closed_end) {
+            control_printf(client, "end\n");
+            client->listing = client->tracing = false;
+            return;
+        }
+        client->output_size += format_trace(client->output + client->output_size, "closed", &closed_traces[client->closed_cursor++ % TRACE_CLOSED]);
+    }
+}
+
+/* one sketch per chunk */
+static void control_top_chunk(struct control_client* client) {
+    if (client->cursor > 1) {
+        control_printf(client, "end\n");
+        client->listing = client->top = false;
+        return;
+    }
+    struct topk_entry entries[TOPK_SIZE];
+    const char* sketch = client->cursor == 0 ? "bytes" : "connections";
+    size_t size = topk_sorted(client->cursor == 0 ? &top_bytes : &top_connections, entries);
+    for (size_t i = 0; i < size; i++) {
+        uint32_t prefix = entries[i].key;
+        control_printf(client, "%s %u.%u.%u.%u/%u %llu %llu\n", sketch,
+                prefix >> 24, (prefix >> 16) & 0xff, (prefix >> 8) & 0xff, prefix & 0xff, TOP_PREFIX_BITS,
+                (unsigned long long)entries[i].count, (unsigned long long)entries[i].error);
+    }
+    client->cursor++;
+}
+
+/* one route per chunk */
+static void control_tcp_chunk(struct control_client* client) {
+    if (client->cursor > 1) {
+        control_printf(client, "end\n");
+        client->listing = client->tcp = false;
+        return;
+    }
+    for (int back = 0; back < 2; back++) {
+        for (int metric = 0; metric < TCP_METRICS; metric++) {
+            const struct tcp_histogram* histogram = &tcp_histograms[client->cursor][back][metric];
+            control_printf(client, "%s %s %s %llu", client->cursor ? "hidden" : "normal", back ? "back" : "front",
+                    tcp_metric_names[metric], (unsigned long long)histogram->samples);
+            for (int bucket = 0; bucket < TCP_BUCKETS; bucket++) {
+                if (histogram->buckets[bucket]) {
+                    control_printf(client, " %llu:%llu", 2ull << bucket, (unsigned long long)histogram->buckets[bucket]);
+                }
+            }
+            control_printf(client, "\n");
+        }
+    }
+    client->cursor++;
+}
+
+static void control_list_chunk(struct control_client* client) {
+    if (client->tracing) {
+        control_trace_chunk(client);
+        return;
+    }
+    if (client->top) {
+        control_top_chunk(client);
+        return;
+    }
+    if (client->tcp) {
+        control_tcp_chunk(client);
+        return;
+    }
+    for (int listed = 0; listed < CONTROL_CHUNK && client->cursor < registry_size; client->cursor++) {
+        struct proxy* front = registry[client->cursor].proxy;
+        if (!front || front->closed) {
+            continue;
+        }
+        struct proxy* back = front->other;
+        time_t last_recieved = back && back->last_recieved > front->last_recieved ? back->last_recieved : front->last_recieved;
+        control_printf(client, "%llu %s %s %u.%u.%u.%u:%u %lld %lld %zu %zu\n",
+                (unsigned long long)front->state->id, phase(front), route(front),
+                front->state->source >> 24, (front->state->source >> 16) & 0xff, (front->state->source >> 8) & 0xff, front->state->source & 0xff, front->state->source_port,
+                (long long)(current_time - front->created), (long long)(current_time - last_recieved),
+                front->buffer_filled, back ? back->buffer_filled : 0);
+        listed++;
+    }
+    if (client->cursor >= registry_size) {
+        control_printf(client, "end\n");
+        client->listing = false;
+    }
+}
+
+static void control_command(struct control_client* client, char* line) {
+    unsigned long long id;
+    char address[INET_ADDRSTRLEN];
+    if (strcmp(line, "list") == 0) {
+        control_printf(client, "id phase route source age_ms idle_ms to_backend to_client\n");
+        client->listing = true;
+        client->cursor = 0;
+    }
+    else if (strcmp(line, "trace") == 0) {
+        control_printf(client, "state id route source age_ms events\n");
+        client->listing = client->tracing = true;
+        client->cursor = 0;
+        client->closed_cursor = closed_count > TRACE_CLOSED ? closed_count - TRACE_CLOSED : 0;
+        client->closed_end = closed_count;
+    }
+    else if (strcmp(line, "top") == 0) {
+        control_printf(client, "sketch prefix count error\n");
+        client->listing = client->top = true;
+        client->cursor = 0;
+    }
+    else if (strcmp(line, "tcp") == 0) {
+        control_printf(client, "route side metric samples buckets\n");
+        client->listing = client->tcp = true;
+        client->cursor = 0;
+    }
+    else if (sscanf(line, "kill %llu", &id) == 1) {
+        struct proxy* front = find_connection(id);
+        if (front && !front->closed) {
+            trace(front, TRACE_KILLED);
+            close_and_free_proxy(front);
+            control_printf(client, "killed 1\n");
+        }
+        else {
+            control_printf(client, "unknown connection %llu\n", id);
+        }
+    }
+    else if (sscanf(line, "kill-source %15s", address) == 1) {
+        struct in_addr source;
+        if (inet_pton(AF_INET, address, &source) != 1) {
+            control_printf(client, "invalid address %s\n", address);
+            return;
+        }
+        uint32_t killed = 0;
+        for (uint32_t i = 0; i < registry_size; i++) {
+            struct proxy* front = registry[i].proxy;
+            if (front && !front->closed && front->state->source == ntohl(source.s_addr)) {
+                trace(front, TRACE_KILLED);
+                close_and_free_proxy(front);
+                killed++;
+            }
+        }
+        control_printf(client, "killed %u\n", killed);
+    }
+    else {
+        control_printf(client, "unknown command, use list, trace, top, tcp, kill ID or kill-source ADDRESS\n");
+    }
+}
+
+/* send what is buffered, false if the socket is full (or closed) */
+static bool control_send(struct control_client* client) {
+    while (client->output_start < client->output_size) {
+        ssize_t sent = io_send(client->socket, client->output + client->output_start, client->output_size - client->output_start, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                control_close(client);
+            }
+            return false;
+        }
+        client->output_start += (size_t)sent;
+    }
+    client->output_start = client->output_size = 0;
+    return true;
+}
+
+/* handle commands until the socket is full, or the chunk of this loop is send */
+static void control_process(struct control_client* client) {
+    while (client->socket != -1 && control_send(client)) {
+        if (client->listing) {
+            if (client->chunk_done) {
+                return;
+            }
+            control_list_chunk(client);
+            client->chunk_done = true;
+            continue;
+        }
+        char* end = strchr(client->input, '\n');
+        if (end) {
+            *end = '\0';
+            if (end > client->input && end[-1] == '\r') {
+                end[-1] = '\0';
+            }
+            control_command(client, client->input);
+            client->input_size -= (size_t)(end + 1 - client->input);
+            memmove(client->input, end + 1, client->input_size + 1);
+            continue;
+        }
+        if (client->input_size == sizeof(client->input) - 1) {
+            // way too long to be a command
+            control_close(client);
+            return;
+        }
+        ssize_t bytes_read = io_read(client->socket, client->input + client->input_size, sizeof(client->input) - client->input_size - 1);
+        if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (bytes_read <= 0) {
+            control_close(client);
+            return;
+        }
+        client->input_size += (size_t)bytes_read;
+        client->input[client->input_size] = '\0';
+    }
+}
+
+static void control_event(struct epoll_event* ev) {
+    if (ev->data.ptr != &control_listener) {
+        control_process(ev->data.ptr);
+        return;
+    }
+    while (true) {
+        int conn_sock = io_accept4(control_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn_sock == -1) {
+            return;
+        }
+        struct control_client* client = NULL;
+        for (int i = 0; i < MAX_CONTROL_CLIENTS && !client; i++) {
+            if (control_clients[i].socket == -1) {
+                client = &control_clients[i];
+            }
+        }
+        if (!client) {
+            io_close(conn_sock);
+            continue;
+        }
+        memset(client, 0, offsetof(struct control_client, input));
+        client->socket = conn_sock;
+        client->input[0] = '\0';
+        if (!add_to_queue(conn_sock, client)) {
+            io_close(conn_sock);
+            client->socket = -1;
+        }
+    }
+}
+
+static bool initialize_control(const char* path) {
+    for (int i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+        control_clients[i].socket = -1;
+    }
+    if (!path) {
+        return true;
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Control socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(address.sun_path, path);
+    // only replace a control socket left behind, never any other file
+    struct stat existing;
+    bool exists = lstat(path, &existing) == 0;
+    if (exists && !S_ISSOCK(existing.st_mode)) {
+        fprintf(stderr, "Control socket path is not a socket: %s\n", path);
+        return false;
+    }
+    if (exists) {
+        // and not the one of a running instance, only a socket nobody listens on is left behind
+        int probe = io_socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (probe < 0) {
+            perror("cannot open control socket");
+            return false;
+        }
+        bool connected = io_connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+        int probe_error = errno;
+        io_close(probe);
+        if (connected || probe_error == EAGAIN) {
+            fprintf(stderr, "Control socket is in use by another instance: %s\n", path);
+            errno = EADDRINUSE;
+            return false;
+        }
+        if (probe_error != ECONNREFUSED && probe_error != ENOENT) {
+            errno = probe_error;
+            perror("cannot check the existing control socket");
+            return false;
+        }
+        unlink(path);
+    }
+    control_socket = io_socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (control_socket < 0) {
+        perror("cannot open control socket");
+        return false;
+    }
+    mode_t old_mask = umask(0077);
+    int bound = io_bind(control_socket, (struct sockaddr *)&address, sizeof(address));
+    umask(old_mask);
+    if (bound < 0 || io_listen(control_socket, MAX_CONTROL_CLIENTS) < 0) {
+        perror("cannot listen on control socket");
+        return false;
+    }
+    return add_to_queue(control_socket, &control_listener);
+}
+
 static bool initialize(struct sockaddr_in *listen_address, int* listen_socket) {
-    *listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    *listen_socket = io_socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (*listen_socket < 0) {
         perror("cannot open socket");
         return false;
     }
     int one = 1;
-    if (setsockopt(*listen_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int)) < 0) {
+    if (io_setsockopt(*listen_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int)) < 0) {
         perror("cannot set SO_REUSEADDR");
         return false;
     }
-    if (bind(*listen_socket, (struct sockaddr *)listen_address, sizeof(struct sockaddr_in)) < 0) {
+    if (io_bind(*listen_socket, (struct sockaddr *)listen_address, sizeof(struct sockaddr_in)) < 0) {
         perror("cannot bind");
         return false;
     }
-    if (listen(*listen_socket, 20) < 0) {
+    if (io_listen(*listen_socket, (int)config->backlog) < 0) {
         perror("cannot start listening");
         return false;
     }
 
-    _epoll_queue = epoll_create1(EPOLL_CLOEXEC);
+    _epoll_queue = io_epoll_create1(EPOLL_CLOEXEC);
     if (_epoll_queue < 0) {
         perror("cannot create epoll queue");
         return false;
     }
 
-    return add_to_queue(*listen_socket, NULL);
+    return add_to_queue(*listen_socket, NULL) && initialize_control(config->control_path);
 }
 
 static int _listen_socket = -1;
 
 static void close_down_nicely() {
     if (_epoll_queue != -1) {
-        close(_epoll_queue);
+        io_close(_epoll_queue);
     }
     if (_listen_socket != -1) {
-        close(_listen_socket);
+        io_close(_listen_socket);
+    }
+    recorder_close(&recorder);
+    if (control_socket != -1) {
+        io_close(control_socket);
+        unlink(config->control_path);
     }
 }
 
@@ -452,8 +1515,21 @@ void cleanup_buffers(int UNUSED(signum)) {
 
 int start(struct config* _config) {
     config = _config;
+    knock_matcher_init(&knock_matcher, config);
+    knock_delays_init(&knock_delays, config);
+    for (int route = 0; route < 2; route++) {
+        token_bucket_init(&route_buckets[route], config->rate_limits[route].route, 0);
+    }
+    if (!tarpit_init(&tarpit, config)) {
+        return -1;
+    }
+    topk_init(&top_bytes);
+    topk_init(&top_connections);
 
     signal(SIGTERM, cleanup_buffers);
+    signal(SIGUSR1, request_dump);
+    // splice has no MSG_NOSIGNAL, a peer that is gone shows up as EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
 
     struct sockaddr_in sin;
     sin.sin_family = AF_INET;
@@ -465,22 +1541,44 @@ int start(struct config* _config) {
         close_down_nicely();
         return -1;
     }
+    if (config->record_path) {
+        struct timespec tm;
+        io_clock_gettime(CLOCK_MONOTONIC, &tm);
+        current_time = tm.tv_sec * 1000 + tm.tv_nsec / 1000000;
+        if (!recorder_open(&recorder, config->record_path, (uint64_t)current_time)) {
+            close_down_nicely();
+            return -1;
+        }
+    }
 
     struct epoll_event events[MAX_EVENTS];
 #ifdef DEBUG
     memset(&events, 0, MAX_EVENTS * sizeof(struct epoll_event));
 #endif
     for (;;) {
-        int nfds = epoll_wait(_epoll_queue, events, MAX_EVENTS, -1);
+        if (dump_requested) {
+            dump_requested = 0;
+            dump_traces();
+        }
+        int nfds = io_epoll_wait(_epoll_queue, events, MAX_EVENTS, next_timeout());
         if (nfds == -1) {
+            if (errno == EINTR) {
+                // a signal, like the one asking for a dump
+                continue;
+            }
+            if (errno == ESHUTDOWN) {
+                // the simulated io layer ends its runs like this
+                close_down_nicely();
+                return 0;
+            }
             perror("epoll_wait failure");
             close_down_nicely();
             return -1;
         }
         // get the current time stamp
         struct timespec tm;
-        clock_gettime(CLOCK_MONOTONIC, &tm);
-        current_time = tm.tv_sec;
+        io_clock_gettime(CLOCK_MONOTONIC, &tm);
+        current_time = tm.tv_sec * 1000 + tm.tv_nsec / 1000000;
 
         LOG_V("Got %d events\n", nfds);
         for (int n = 0; n < nfds; ++n) {
@@ -489,7 +1587,9 @@ int start(struct config* _config) {
                 if (current_event->events & EPOLLIN) {
                     // one or more new connections
                     while (true) {
-                        int conn_sock = accept4(_listen_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                        struct sockaddr_in address;
+                        socklen_t address_size = sizeof(address);
+                        int conn_sock = io_accept4(_listen_socket, (struct sockaddr *)&address, &address_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
                         if (conn_sock == -1) {
                             if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
                                 // done with handling new connections
@@ -501,37 +1601,85 @@ int start(struct config* _config) {
                         }
 
                         struct proxy* data = malloc(sizeof(struct proxy));
+                        struct front_state* state = malloc(sizeof(struct front_state));
+                        if (!data || !state) {
+                            perror("Cannot allocate memory for proxy");
+                            io_close(conn_sock);
+                            free(data);
+                            free(state);
+                            continue;
+                        }
+                        data->state = state;
                         data->closed = false;
+                        data->back = false;
+                        data->shaped = false;
+                        data->throttled = false;
+                        data->state->id = 0;
+                        data->state->strip_knock = false;
                         data->socket = conn_sock;
                         data->other = NULL;
                         data->timed_out = false;
-                        if (pipe2(data->buffer, O_CLOEXEC | O_NONBLOCK) != 0) {
+                        if (io_pipe2(data->buffer, O_CLOEXEC | O_NONBLOCK) != 0) {
                             perror("Cannot allocate pipes");
-                            close(conn_sock);
+                            io_close(conn_sock);
+                            free(state);
                             free(data);
                             continue;
                         }
                         data->buffer_filled = 0;
                         data->out_op = NULL;
-                        data->in_op = first_data;
-                        if (!add_to_queue(conn_sock, data)) {
-                            close(conn_sock);
-                            close(data->buffer[READ]);
-                            close(data->buffer[WRITE]);
+                        data->in_op = http_routing(config) ? first_http_data : first_data;
+                        http_route_init(&data->state->http);
+                        data->created = current_time;
+                        data->state->knock_deadline = knock_delays_deadline(&knock_delays);
+                        data->state->source = ntohl(address.sin_addr.s_addr);
+                        data->state->source_port = ntohs(address.sin_port);
+                        data->state->hidden = false;
+                        data->state->trace_events = 0;
+                        if (!register_connection(data) || !add_to_queue(conn_sock, data)) {
+                            if (data->state->id) {
+                                unregister_connection(data);
+                            }
+                            io_close(conn_sock);
+                            io_close(data->buffer[READ]);
+                            io_close(data->buffer[WRITE]);
+                            free(state);
                             free(data);
                         }
                         else {
-                            add_new_timeout_queue(data);
+                            uint32_t class = knock_delays_class(&knock_delays);
+                            add_new_timeout_queue(&knock_queues[class], data);
+                            knock_classes |= (uint64_t)1 << class;
+                            trace(data, TRACE_ACCEPT);
+                            record_accept(&recorder, &data->state->record, (uint64_t)current_time);
+                            topk_add(&top_connections, TOP_PREFIX(data->state->source), 1);
+                            if (knock_cache_contains(ntohl(address.sin_addr.s_addr))) {
+                                LOG_D("Remembered source, skipping knock: %p\n", (void*)data);
+                                trace(data, TRACE_REMEMBERED);
+                                data->state->strip_knock = true;
+                                setup_back_connection(data, config->hidden_port);
+                            }
                         }
                     }
                 }
+            } else if (is_control(current_event->data.ptr)) {
+                control_event(current_event);
             } else {
                 process_other_events(current_event);
             }
         }
+        wake_throttled();
+        sample_tcp();
+        recorder_flush(&recorder, (uint64_t)current_time);
+        for (int i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+            if (control_clients[i].socket != -1 && control_clients[i].listing) {
+                control_clients[i].chunk_done = false;
+                control_process(&control_clients[i]);
+            }
+        }
         // handle timeouts
-        time_t default_timeout_threshold = current_time - config->default_timeout.tv_sec;
-        struct proxy* current_proxy = timeout_queue_tail;
+        time_t default_timeout_threshold = current_time - config->default_timeout.tv_sec * 1000;
+        struct proxy* current_proxy = timeout_queue.tail;
 
         // first we go throught the normal timeout cases
         while (current_proxy && current_proxy->last_recieved < default_timeout_threshold) {
@@ -539,21 +1687,27 @@ int start(struct config* _config) {
             handle_normal_timeout(current_proxy);
             current_proxy = current_proxy->previous;
         }
-        // then we go through the knock timeout cases, which are newer in timeout
-        time_t knock_timeout_threshold = current_time - config->knock_timeout.tv_sec;
-        while (current_proxy && current_proxy->last_recieved < knock_timeout_threshold) {
-            if (!current_proxy->other) {
-                // knock timeout applies
-                handle_knock_timeout(current_proxy);
+        // then the knock timeouts, from the tail of every deadline class
+        for (uint64_t classes = knock_classes; classes; classes &= classes - 1) {
+            int class = __builtin_ctzll(classes);
+            struct timeout_queue* queue = &knock_queues[class];
+            // the timeout moves it to the timeout queue, or closes it
+            while (queue->tail && queue->tail->last_recieved + queue->tail->state->knock_deadline <= current_time) {
+                handle_knock_timeout(queue->tail);
+            }
+            if (!queue->tail) {
+                knock_classes &= ~((uint64_t)1 << class);
             }
-            current_proxy = current_proxy->previous;
         }
+        tarpit_expire(&tarpit, (uint32_t)(current_time / 1000));
 
 
         // handle pending free's
-        for (size_t i = 0 ; i < free_index; i++) {
-            free(to_free[i]);
+        while (to_free) {
+            struct proxy* next = to_free->next;
+            free(to_free->state);
+            free(to_free);
+            to_free = next;
         }
-        free_index = 0;
     }
 }
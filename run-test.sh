@@ -12,7 +12,15 @@ readonly KNOCK_TIMEOUT=1
 readonly TEST_PORT=5511
 readonly TEST_HIDDEN_PORT=5522
 readonly TEST_PROXY_PORT=6611
+# every test case with a proxy of its own gets the next block of ports
+readonly TEST_CASE_FIRST_PORT=7000
+readonly TEST_CASE_PORTS=4
+readonly TEST_CASE_LOG="${TMPDIR:-/tmp}/l7knockknock-test-$$.log"
+readonly TEST_REPLAY_PROFILE="${TMPDIR:-/tmp}/l7knockknock-test-$$.profile"
+readonly TEST_REPLAY_RECORDING="${TMPDIR:-/tmp}/l7knockknock-test-$$.rec"
+readonly TEST_CONTROL_SOCKET="${TMPDIR:-/tmp}/l7knockknock-test-$$.sock"
 readonly TARGET="$1"
+readonly CONNECT="$(dirname "$TARGET")/l7knock-connect"
 
 kill_descendant_processes() {
     local pid="$1"
@@ -69,10 +77,90 @@ run_test() {
     go run "test/client.go" --port $TEST_PROXY_PORT  --connections "$1" --parallel "$2" $HIDE_PROGRESS
 }
 
-echo ""
-echo "/----------------"
-echo "| Testing hidden port"
-echo "\\----------------"
+header() {
+    echo ""
+    echo "/----------------"
+    echo "| $1"
+    echo "\\----------------"
+}
+
+TEST_CASE_PORT=$(( $TEST_CASE_FIRST_PORT - $TEST_CASE_PORTS ))
+TEST_CASE_PIDS=""
+
+begin_test_case() {
+    header "Running $1 test case"
+    TEST_CASE_PORT=$(( $TEST_CASE_PORT + $TEST_CASE_PORTS ))
+    TEST_CASE_PIDS=""
+    : > "$TEST_CASE_LOG"
+}
+
+# fills in the ports of the test case: {port} to listen on, {normal} and
+# {hidden} for its backends and {port2} for a second proxy, {pids} of its
+# proxies so far (comma separated) and {log} with their output
+expand() {
+    local arg
+    for arg in "$@"; do
+        arg="${arg//\{port\}/$TEST_CASE_PORT}"
+        arg="${arg//\{normal\}/$(( $TEST_CASE_PORT + 1 ))}"
+        arg="${arg//\{hidden\}/$(( $TEST_CASE_PORT + 2 ))}"
+        arg="${arg//\{port2\}/$(( $TEST_CASE_PORT + 3 ))}"
+        arg="${arg//\{pids\}/$TEST_CASE_PIDS}"
+        arg="${arg//\{log\}/$TEST_CASE_LOG}"
+        printf '%s\n' "$arg"
+    done
+}
+
+# starts a proxy between {port} and the {normal} port, with the hidden port of
+# the test server; the arguments come after those, so they can override them
+start_proxy() {
+    local args
+    mapfile -t args < <(expand --listenPort={port} --normalPort={normal} --hiddenPort=$TEST_HIDDEN_PORT --proxyTimeout=$GLOBAL_TIMEOUT --knockTimeout=$KNOCK_TIMEOUT "$@")
+    $TARGET "${args[@]}" PASSWORD >> "$TEST_CASE_LOG" 2> /dev/null &
+    TEST_CASE_PIDS="${TEST_CASE_PIDS:+$TEST_CASE_PIDS,}$!"
+}
+
+# runs a go program of the tests, rc is its exit code
+run_go() {
+    local args
+    mapfile -t args < <(expand "$@")
+    go run "${args[@]}" && rc=$? || rc=$?
+}
+
+# stops the proxies of the test case, and fails when rc is not 0
+end_test_case() {
+    local pid
+    for pid in ${TEST_CASE_PIDS//,/$'\n'}; do
+        kill $pid || true
+        wait $pid || true
+    done
+    if [ $rc -ne 0 ]; then
+        echo "Output of the proxy:"
+        cat "$TEST_CASE_LOG"
+    fi
+    rm -f "$TEST_CASE_LOG"
+    if [ $rc -ne 0 ]; then
+        exit 1
+    fi
+}
+
+# run_proxy_test TITLE PROXY_ARGS -- GO_ARGS: runs the go program against a proxy of its own
+run_proxy_test() {
+    local title="$1"
+    shift
+    local proxy_args=()
+    while [[ "$1" != "--" ]]; do
+        proxy_args+=("$1")
+        shift
+    done
+    shift
+    begin_test_case "$title"
+    start_proxy ${proxy_args[@]+"${proxy_args[@]}"}
+    sleep 1
+    run_go "$@"
+    end_test_case
+}
+
+header "Testing hidden port"
 HIDDEN_ANSWER=$(timeout 2 bash -c "exec 3<>/dev/tcp/127.0.0.1/$TEST_PROXY_PORT && echo -ne 'PASSWORD' >&3 && cat <&3 && exec 3<&-")
 if [[ "$HIDDEN_ANSWER" != "HELLO" ]]; then
     echo "Error, correct answer not received"
@@ -81,24 +169,25 @@ else
     echo "OK"
 fi
 
-echo "" 
-echo "/----------------"
-echo "| Running single threaded test case"
-echo "\\----------------"
+header "Testing hidden port with l7knock-connect"
+# the proxy closes both directions at the first end of stream, so keep stdin open
+CONNECT_ANSWER=$(sleep 1 | timeout 2 "$CONNECT" 127.0.0.1 $TEST_PROXY_PORT PASSWORD)
+if [[ "$CONNECT_ANSWER" != "HELLO" ]]; then
+    echo "Error, correct answer not received"
+    exit 1
+else
+    echo "OK"
+fi
+
+header "Running single threaded test case"
 run_test $(( 2 * $FACTOR )) 1
 run_test $(( 20 * $FACTOR )) 1
 
-echo "" 
-echo "/----------------"
-echo "| Running multi-threaded test case"
-echo "\\----------------"
+header "Running multi-threaded test case"
 run_test $(( 2 * $FACTOR )) 20
 run_test $(( 20 * $FACTOR )) 40
 
-echo "" 
-echo "/----------------"
-echo "| Running time-out test cases"
-echo "\\----------------"
+header "Running time-out test cases"
 echo " + Within the proxy window"
 go run "test/client.go" --port $TEST_PROXY_PORT  --connections 5 --parallel 4 --maxDelays $(( $GLOBAL_TIMEOUT / 2 )) $HIDE_PROGRESS
 echo " + Sometimes outside the proxy window"
@@ -112,6 +201,92 @@ fi
 echo " + Does the proxy still work?"
 run_test $(( 5 * $FACTOR )) 20
 
+run_proxy_test "backpressure" -- test/backpressure.go --port {port} --backendPort {normal} --pid {pids}
+
+begin_test_case "TOTP knock"
+start_proxy --normalPort=$TEST_PORT --totp=30
+sleep 1
+run_go test/totp.go --port {port} --secret PASSWORD --period 30
+if [ $rc -eq 0 ] && [[ "$(sleep 1 | timeout 2 "$CONNECT" --totp=30 127.0.0.1 $TEST_CASE_PORT PASSWORD)" != "HELLO" ]]; then
+    echo "Error, l7knock-connect did not get through with a TOTP knock"
+    rc=1
+fi
+end_test_case
+
+begin_test_case "remembered knock"
+start_proxy --normalPort=$TEST_PORT --rememberKnock=60
+sleep 1
+rc=0
+# knock once, after that the source gets to the hidden port without knocking
+KNOCK_ANSWER=$(timeout 2 bash -c "exec 3<>/dev/tcp/127.0.0.1/$TEST_CASE_PORT && echo -ne 'PASSWORD' >&3 && cat <&3 && exec 3<&-") || true
+REMEMBERED_ANSWER=$(timeout 2 bash -c "exec 3<>/dev/tcp/127.0.0.1/$TEST_CASE_PORT && cat <&3 && exec 3<&-") || true
+if [[ "$KNOCK_ANSWER" != "HELLO" ]] || [[ "$REMEMBERED_ANSWER" != "HELLO" ]]; then
+    echo "Error, the remembered source did not get to the hidden port without a knock (got '$KNOCK_ANSWER' and '$REMEMBERED_ANSWER')"
+    rc=1
+else
+    echo "OK"
+fi
+end_test_case
+
+run_proxy_test "adaptive knock timeout" --adaptiveKnock -- test/adaptive.go --port {port} --backendPort {normal} --knockTimeout $KNOCK_TIMEOUT
+
+run_proxy_test "idle connection scaling" --hiddenPort={hidden} --proxyTimeout=600 --tarpit='SSH-2.0-' -- \
+    test/scaling.go --port {port} --normalPort {normal} --hiddenPort {hidden} --knock PASSWORD --tarpit 'SSH-2.0-' --pid {pids} --connections 100,1000 --idle 1s
+
+run_proxy_test "soak" --hiddenPort={hidden} --proxyTimeout=1 -- \
+    test/soak.go --port {port} --normalPort {normal} --hiddenPort {hidden} --knock PASSWORD --pid {pids} --connections $(( 2000 * $FACTOR )) --rounds 10
+
+run_proxy_test "HTTP routing" --hiddenPort={hidden} --httpHost=secret.example --httpPath=/hide/ -- \
+    test/httproute.go --port {port} --normalPort {normal} --hiddenPort {hidden} --host secret.example --path /hide/ --knockTimeout ${KNOCK_TIMEOUT}s
+
+if [ -z "${USELIBEVENT+x}" ]; then
+    run_proxy_test "control socket" --control=$TEST_CONTROL_SOCKET -- test/control.go --port {port} --backendPort {normal} --control $TEST_CONTROL_SOCKET
+
+    run_proxy_test "rate limit" --hiddenPort={hidden} --rateLimit=normal:512:256 -- \
+        test/shaping.go --port {port} --normalPort {normal} --hiddenPort {hidden} --knock PASSWORD --routeRate 512 --connectionRate 256
+
+    # replaying a synthetic profile should record the same profile again
+    go run "test/replay.go" --generate $TEST_REPLAY_PROFILE --connections $(( 20 * $FACTOR )) --knockTimeout ${KNOCK_TIMEOUT}s
+    begin_test_case "workload record and replay"
+    start_proxy --hiddenPort={hidden} --record=$TEST_REPLAY_RECORDING
+    sleep 1
+    run_go test/replay.go --file $TEST_REPLAY_PROFILE --port {port} --normalPort {normal} --hiddenPort {hidden} --knock PASSWORD --knockTimeout ${KNOCK_TIMEOUT}s --speed 2
+    if [ $rc -eq 0 ]; then
+        # the recording is only complete once the proxy is gone
+        kill $TEST_CASE_PIDS
+        wait $TEST_CASE_PIDS || true
+        TEST_CASE_PIDS=""
+        run_go test/replay.go --file $TEST_REPLAY_PROFILE --compare $TEST_REPLAY_RECORDING
+    fi
+    rm -f $TEST_REPLAY_PROFILE $TEST_REPLAY_RECORDING
+    end_test_case
+else
+    begin_test_case "multi-threaded proxy"
+    start_proxy --normalPort=$TEST_PORT --threads=4
+    sleep 1
+    run_go test/client.go --port {port} --connections $(( 20 * $FACTOR )) --parallel 40 $HIDE_PROGRESS
+    end_test_case
+
+    run_proxy_test "migration" --threads=4 --verbose -- test/migration.go --port {port} --backendPort {normal} --threads 4 --log {log}
+
+    # the idle connections have to outlive the scaling up and down
+    run_proxy_test "elastic workers" --proxyTimeout=60 --threads=1 --maxThreads=4 -- test/elastic.go --port {port} --backendPort {normal} --pid {pids}
+
+    run_proxy_test "hidden route isolation" --hiddenPort={hidden} --hiddenThreads=1 -- \
+        test/isolation.go --port {port} --normalPort {normal} --hiddenPort {hidden} --knock PASSWORD --pid {pids}
+
+    # MSG_ZEROCOPY is Linux only, elsewhere the proxy refuses --zeroCopy
+    if [ "$(uname)" = "Linux" ]; then
+        begin_test_case "zero copy"
+        start_proxy
+        start_proxy --listenPort={port2} --zeroCopy
+        sleep 1
+        # a small receive buffer makes the output queue up, so the large sends happen
+        run_go test/zerocopy.go --copy ":{port}" --zeroCopy ":{port2}" --backendPort {normal} --pids {pids} --duration 2s --rounds 1 --receiveBuffer 16384 --stallTimeout ${GLOBAL_TIMEOUT}s
+        end_test_case
+    fi
+fi
+
 echo "Waiting for all timeouts to pass, so that all memory is freed, and Valgrind will only report true leaks"
 sleep $(( $GLOBAL_TIMEOUT + 2 ))
 
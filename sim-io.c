@@ -0,0 +1,734 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include "knock-common.h"
+#include "sim-io.h"
+
+#define MAX_LISTENERS 8
+
+enum sim_kind { SIM_FREE, SIM_SOCKET, SIM_LISTENER, SIM_PIPE_READ, SIM_PIPE_WRITE, SIM_EPOLL };
+
+/* bytes on their way to the proxy, only the first few have content */
+struct sim_stream {
+    size_t pending;
+    size_t head_size;
+    uint8_t head[SIM_HEAD_SIZE];
+};
+
+struct sim_pipe {
+    size_t filled;
+    int ends;
+};
+
+struct sim_file;
+
+struct sim_endpoint {
+    struct sim_file* file; // the proxy side, NULL once the proxy closed it
+    struct sim_stream incoming;
+    size_t outgoing; // written by the proxy, not yet received by the driver
+    int error;
+    bool fin;
+    bool blocked; // the proxy ran into a full send buffer
+    bool released;
+    bool activity_queued;
+    uint16_t port;
+    uint32_t address;
+    void* user;
+    struct sim_endpoint* accept_next;
+    struct sim_endpoint* activity_next;
+};
+
+struct sim_file {
+    enum sim_kind kind;
+    int fd;
+    uint16_t port;
+
+    bool registered;
+    bool queued;
+    uint32_t interest;
+    epoll_data_t data;
+    struct sim_file* ready_next;
+    struct sim_file* ready_prev;
+
+    struct sim_endpoint* endpoint;
+    struct sim_pipe* pipe;
+    struct sim_endpoint* accept_first;
+    struct sim_endpoint* accept_last;
+};
+
+static struct sim_file** files = NULL;
+static int* free_fds = NULL;
+static size_t files_size = 0;
+static size_t files_capacity = 0;
+static size_t free_count = 0;
+
+static struct sim_file* listeners[MAX_LISTENERS];
+static struct sim_file* ready_first = NULL;
+static struct sim_file* ready_last = NULL;
+static struct sim_endpoint* activity_first = NULL;
+static struct sim_endpoint* activity_last = NULL;
+static struct sim_endpoint* spare_endpoints = NULL;
+
+static sim_connect_cb on_connect = NULL;
+static sim_driver_cb driver = NULL;
+static uint64_t now = SIM_START_TIME; // in milliseconds
+static bool stopped = false;
+static struct sim_stats stats;
+
+void sim_init(sim_connect_cb _on_connect, sim_driver_cb _driver) {
+    on_connect = _on_connect;
+    driver = _driver;
+    now = SIM_START_TIME;
+    stopped = false;
+    memset(&stats, 0, sizeof(stats));
+}
+
+void sim_stop(void) {
+    stopped = true;
+}
+
+uint64_t sim_now(void) {
+    return now;
+}
+
+const struct sim_stats* sim_stats(void) {
+    return &stats;
+}
+
+static struct sim_file* new_file(enum sim_kind kind) {
+    struct sim_file* file;
+    if (free_count > 0) {
+        file = files[free_fds[--free_count]];
+    }
+    else {
+        if (files_size == files_capacity) {
+            files_capacity = files_capacity ? files_capacity * 2 : 1024;
+            files = realloc(files, files_capacity * sizeof(struct sim_file*));
+            free_fds = realloc(free_fds, files_capacity * sizeof(int));
+            if (!files || !free_fds) {
+                perror("sim: cannot allocate file table");
+                abort();
+            }
+        }
+        file = malloc(sizeof(struct sim_file));
+        if (!file) {
+            perror("sim: cannot allocate file");
+            abort();
+        }
+        file->fd = SIM_FD_BASE + (int)files_size;
+        files[files_size++] = file;
+    }
+    int fd = file->fd;
+    memset(file, 0, sizeof(struct sim_file));
+    file->fd = fd;
+    file->kind = kind;
+    stats.open_files++;
+    return file;
+}
+
+static void free_file(struct sim_file* file) {
+    file->kind = SIM_FREE;
+    stats.open_files--;
+    free_fds[free_count++] = file->fd - SIM_FD_BASE;
+}
+
+static struct sim_file* lookup(int fd) {
+    stats.calls++;
+    if (fd < SIM_FD_BASE || (size_t)(fd - SIM_FD_BASE) >= files_size || files[fd - SIM_FD_BASE]->kind == SIM_FREE) {
+        errno = EBADF;
+        return NULL;
+    }
+    return files[fd - SIM_FD_BASE];
+}
+
+static struct sim_endpoint* new_endpoint(uint16_t port, uint32_t address) {
+    struct sim_endpoint* endpoint = spare_endpoints;
+    if (endpoint) {
+        spare_endpoints = endpoint->activity_next;
+    }
+    else {
+        endpoint = malloc(sizeof(struct sim_endpoint));
+        if (!endpoint) {
+            perror("sim: cannot allocate endpoint");
+            abort();
+        }
+    }
+    memset(endpoint, 0, sizeof(struct sim_endpoint));
+    endpoint->port = port;
+    endpoint->address = address;
+    return endpoint;
+}
+
+static void free_endpoint(struct sim_endpoint* endpoint) {
+    endpoint->activity_next = spare_endpoints;
+    spare_endpoints = endpoint;
+}
+
+/* what epoll would report for the file right now */
+static uint32_t poll_file(struct sim_file* file) {
+    uint32_t result = 0;
+    if (file->kind == SIM_LISTENER) {
+        if (file->accept_first) {
+            result |= EPOLLIN;
+        }
+    }
+    else if (file->kind == SIM_SOCKET && file->endpoint) {
+        struct sim_endpoint* endpoint = file->endpoint;
+        if (endpoint->error) {
+            result |= EPOLLIN | EPOLLERR | EPOLLHUP;
+        }
+        else {
+            if (endpoint->incoming.pending > 0 || endpoint->fin) {
+                result |= EPOLLIN;
+            }
+            if (endpoint->fin) {
+                result |= EPOLLRDHUP;
+            }
+            if (endpoint->outgoing < SIM_SOCKET_BUFFER) {
+                result |= EPOLLOUT;
+            }
+        }
+    }
+    return result & (file->interest | EPOLLERR | EPOLLHUP);
+}
+
+static void queue_ready(struct sim_file* file) {
+    if (!file || !file->registered || file->queued) {
+        return;
+    }
+    file->queued = true;
+    file->ready_next = NULL;
+    file->ready_prev = ready_last;
+    if (ready_last) {
+        ready_last->ready_next = file;
+    }
+    else {
+        ready_first = file;
+    }
+    ready_last = file;
+}
+
+static void unqueue_ready(struct sim_file* file) {
+    if (!file->queued) {
+        return;
+    }
+    file->queued = false;
+    if (file->ready_prev) {
+        file->ready_prev->ready_next = file->ready_next;
+    }
+    else {
+        ready_first = file->ready_next;
+    }
+    if (file->ready_next) {
+        file->ready_next->ready_prev = file->ready_prev;
+    }
+    else {
+        ready_last = file->ready_prev;
+    }
+}
+
+static void queue_activity(struct sim_endpoint* endpoint) {
+    if (endpoint->activity_queued || endpoint->released) {
+        return;
+    }
+    endpoint->activity_queued = true;
+    endpoint->activity_next = NULL;
+    if (activity_last) {
+        activity_last->activity_next = endpoint;
+    }
+    else {
+        activity_first = endpoint;
+    }
+    activity_last = endpoint;
+}
+
+struct sim_endpoint* sim_next_activity(void) {
+    while (activity_first) {
+        struct sim_endpoint* endpoint = activity_first;
+        activity_first = endpoint->activity_next;
+        if (!activity_first) {
+            activity_last = NULL;
+        }
+        endpoint->activity_queued = false;
+        if (!endpoint->released) {
+            return endpoint;
+        }
+        if (!endpoint->file) {
+            free_endpoint(endpoint);
+        }
+    }
+    return NULL;
+}
+
+struct sim_endpoint* sim_connect(uint16_t port, uint32_t address) {
+    for (int i = 0; i < MAX_LISTENERS; i++) {
+        struct sim_file* listener = listeners[i];
+        if (listener && listener->port == port) {
+            struct sim_endpoint* endpoint = new_endpoint(port, address);
+            if (listener->accept_last) {
+                listener->accept_last->accept_next = endpoint;
+            }
+            else {
+                listener->accept_first = endpoint;
+            }
+            listener->accept_last = endpoint;
+            queue_ready(listener);
+            return endpoint;
+        }
+    }
+    return NULL;
+}
+
+void sim_send(struct sim_endpoint* endpoint, const void* data, size_t size) {
+    struct sim_stream* stream = &endpoint->incoming;
+    if (data && stream->head_size == stream->pending) {
+        size_t copy = size < SIM_HEAD_SIZE - stream->head_size ? size : SIM_HEAD_SIZE - stream->head_size;
+        memcpy(stream->head + stream->head_size, data, copy);
+        stream->head_size += copy;
+    }
+    stream->pending += size;
+    queue_ready(endpoint->file);
+}
+
+size_t sim_receive(struct sim_endpoint* endpoint, size_t max) {
+    size_t result = endpoint->outgoing < max ? endpoint->outgoing : max;
+    endpoint->outgoing -= result;
+    if (result > 0 && endpoint->blocked) {
+        endpoint->blocked = false;
+        queue_ready(endpoint->file);
+    }
+    return result;
+}
+
+void sim_close(struct sim_endpoint* endpoint) {
+    endpoint->fin = true;
+    queue_ready(endpoint->file);
+}
+
+void sim_reset(struct sim_endpoint* endpoint) {
+    endpoint->error = ECONNRESET;
+    endpoint->incoming.pending = 0;
+    endpoint->incoming.head_size = 0;
+    queue_ready(endpoint->file);
+}
+
+void sim_release(struct sim_endpoint* endpoint) {
+    endpoint->released = true;
+    endpoint->outgoing = 0;
+    if (!endpoint->file && !endpoint->activity_queued) {
+        free_endpoint(endpoint);
+    }
+}
+
+bool sim_proxy_closed(const struct sim_endpoint* endpoint) {
+    return endpoint->file == NULL;
+}
+
+void sim_set_user(struct sim_endpoint* endpoint, void* user) {
+    endpoint->user = user;
+}
+
+void* sim_user(const struct sim_endpoint* endpoint) {
+    return endpoint->user;
+}
+
+int sim_socket(int UNUSED(domain), int UNUSED(type), int UNUSED(protocol)) {
+    stats.calls++;
+    return new_file(SIM_SOCKET)->fd;
+}
+
+int sim_setsockopt(int fd, int UNUSED(level), int UNUSED(name), const void* UNUSED(value), socklen_t UNUSED(size)) {
+    return lookup(fd) ? 0 : -1;
+}
+
+int sim_getsockopt(int fd, int UNUSED(level), int UNUSED(name), void* value, socklen_t* size) {
+    if (!lookup(fd)) {
+        return -1;
+    }
+    memset(value, 0, *size);
+    return 0;
+}
+
+int sim_ioctl(int fd, unsigned long UNUSED(request), int* value) {
+    if (!lookup(fd)) {
+        return -1;
+    }
+    *value = 0;
+    return 0;
+}
+
+int sim_bind(int fd, const struct sockaddr* address, socklen_t UNUSED(size)) {
+    struct sim_file* file = lookup(fd);
+    if (!file) {
+        return -1;
+    }
+    file->port = ntohs(((const struct sockaddr_in*)address)->sin_port);
+    return 0;
+}
+
+int sim_listen(int fd, int UNUSED(backlog)) {
+    struct sim_file* file = lookup(fd);
+    if (!file) {
+        return -1;
+    }
+    for (int i = 0; i < MAX_LISTENERS; i++) {
+        if (!listeners[i]) {
+            listeners[i] = file;
+            file->kind = SIM_LISTENER;
+            return 0;
+        }
+    }
+    errno = EADDRINUSE;
+    return -1;
+}
+
+int sim_accept4(int fd, struct sockaddr* address, socklen_t* size, int UNUSED(flags)) {
+    struct sim_file* listener = lookup(fd);
+    if (!listener || listener->kind != SIM_LISTENER) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct sim_endpoint* endpoint = listener->accept_first;
+    if (!endpoint) {
+        errno = EAGAIN;
+        return -1;
+    }
+    listener->accept_first = endpoint->accept_next;
+    if (!listener->accept_first) {
+        listener->accept_last = NULL;
+    }
+    struct sim_file* file = new_file(SIM_SOCKET);
+    file->endpoint = endpoint;
+    endpoint->file = file;
+    if (address && *size >= sizeof(struct sockaddr_in)) {
+        struct sockaddr_in* sin = (struct sockaddr_in*)address;
+        memset(sin, 0, sizeof(struct sockaddr_in));
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl(endpoint->address);
+        sin->sin_port = htons(endpoint->port);
+        *size = sizeof(struct sockaddr_in);
+    }
+    stats.accepts++;
+    return file->fd;
+}
+
+int sim_connect_socket(int fd, const struct sockaddr* address, socklen_t UNUSED(size)) {
+    struct sim_file* file = lookup(fd);
+    if (!file || file->kind != SIM_SOCKET || file->endpoint) {
+        errno = EISCONN;
+        return -1;
+    }
+    uint16_t port = ntohs(((const struct sockaddr_in*)address)->sin_port);
+    struct sim_endpoint* endpoint = new_endpoint(port, 0x7f000001);
+    endpoint->file = file;
+    file->endpoint = endpoint;
+    stats.connects++;
+    if (!on_connect(endpoint, port)) {
+        endpoint->error = ECONNREFUSED;
+        endpoint->released = true;
+    }
+    // like a real non blocking connect, the result shows up in epoll
+    errno = EINPROGRESS;
+    return -1;
+}
+
+int sim_pipe2(int fds[2], int UNUSED(flags)) {
+    stats.calls++;
+    struct sim_pipe* pipe = malloc(sizeof(struct sim_pipe));
+    if (!pipe) {
+        errno = ENFILE;
+        return -1;
+    }
+    pipe->filled = 0;
+    pipe->ends = 2;
+    struct sim_file* read_end = new_file(SIM_PIPE_READ);
+    struct sim_file* write_end = new_file(SIM_PIPE_WRITE);
+    read_end->pipe = write_end->pipe = pipe;
+    fds[0] = read_end->fd;
+    fds[1] = write_end->fd;
+    return 0;
+}
+
+/* take (or just look at) bytes the driver send to the proxy */
+static ssize_t take_incoming(struct sim_endpoint* endpoint, void* buffer, size_t size, bool peek) {
+    if (!endpoint) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (endpoint->error) {
+        errno = endpoint->error;
+        return -1;
+    }
+    struct sim_stream* stream = &endpoint->incoming;
+    if (stream->pending == 0) {
+        if (endpoint->fin) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t result = size < stream->pending ? size : stream->pending;
+    size_t from_head = result < stream->head_size ? result : stream->head_size;
+    if (buffer) {
+        memcpy(buffer, stream->head, from_head);
+        memset((uint8_t*)buffer + from_head, 'x', result - from_head);
+    }
+    if (!peek) {
+        memmove(stream->head, stream->head + from_head, stream->head_size - from_head);
+        stream->head_size -= from_head;
+        stream->pending -= result;
+    }
+    stats.bytes += result;
+    return (ssize_t)result;
+}
+
+static ssize_t give_outgoing(struct sim_endpoint* endpoint, size_t size) {
+    if (!endpoint) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (endpoint->error) {
+        errno = endpoint->error;
+        return -1;
+    }
+    size_t room = SIM_SOCKET_BUFFER - endpoint->outgoing;
+    if (room == 0) {
+        endpoint->blocked = true;
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t result = size < room ? size : room;
+    if (!endpoint->released) {
+        endpoint->outgoing += result;
+        queue_activity(endpoint);
+    }
+    stats.bytes += result;
+    return (ssize_t)result;
+}
+
+ssize_t sim_read(int fd, void* buffer, size_t size) {
+    struct sim_file* file = lookup(fd);
+    if (!file) {
+        return -1;
+    }
+    if (file->kind == SIM_SOCKET) {
+        return take_incoming(file->endpoint, buffer, size, false);
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+ssize_t sim_write(int fd, const void* UNUSED(buffer), size_t size) {
+    struct sim_file* file = lookup(fd);
+    if (!file) {
+        return -1;
+    }
+    if (file->kind == SIM_SOCKET) {
+        return give_outgoing(file->endpoint, size);
+    }
+    if (file->kind == SIM_PIPE_WRITE) {
+        size_t room = SIM_PIPE_SIZE - file->pipe->filled;
+        if (room == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        size_t result = size < room ? size : room;
+        file->pipe->filled += result;
+        return (ssize_t)result;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+ssize_t sim_recv(int fd, void* buffer, size_t size, int flags) {
+    struct sim_file* file = lookup(fd);
+    if (!file) {
+        return -1;
+    }
+    if (file->kind != SIM_SOCKET) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+    return take_incoming(file->endpoint, buffer, size, (flags & MSG_PEEK) != 0);
+}
+
+ssize_t sim_send_fd(int fd, const void* buffer, size_t size, int UNUSED(flags)) {
+    return sim_write(fd, buffer, size);
+}
+
+ssize_t sim_splice(int fd_in, loff_t* UNUSED(off_in), int fd_out, loff_t* UNUSED(off_out), size_t size, unsigned int UNUSED(flags)) {
+    struct sim_file* in = lookup(fd_in);
+    struct sim_file* out = lookup(fd_out);
+    if (!in || !out) {
+        return -1;
+    }
+    if (in->kind == SIM_SOCKET && out->kind == SIM_PIPE_WRITE) {
+        size_t room = SIM_PIPE_SIZE - out->pipe->filled;
+        if (room == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        ssize_t result = take_incoming(in->endpoint, NULL, size < room ? size : room, false);
+        if (result > 0) {
+            out->pipe->filled += (size_t)result;
+        }
+        return result;
+    }
+    if (in->kind == SIM_PIPE_READ && out->kind == SIM_SOCKET) {
+        if (in->pipe->filled == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        ssize_t result = give_outgoing(out->endpoint, size < in->pipe->filled ? size : in->pipe->filled);
+        if (result > 0) {
+            in->pipe->filled -= (size_t)result;
+        }
+        return result;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+int sim_close_fd(int fd) {
+    struct sim_file* file = lookup(fd);
+    if (!file) {
+        return -1;
+    }
+    unqueue_ready(file);
+    switch (file->kind) {
+        case SIM_SOCKET:
+            if (file->endpoint) {
+                struct sim_endpoint* endpoint = file->endpoint;
+                endpoint->file = NULL;
+                if (endpoint->released) {
+                    if (!endpoint->activity_queued) {
+                        free_endpoint(endpoint);
+                    }
+                }
+                else {
+                    queue_activity(endpoint);
+                }
+            }
+            break;
+        case SIM_LISTENER:
+            for (int i = 0; i < MAX_LISTENERS; i++) {
+                if (listeners[i] == file) {
+                    listeners[i] = NULL;
+                }
+            }
+            while (file->accept_first) {
+                struct sim_endpoint* endpoint = file->accept_first;
+                file->accept_first = endpoint->accept_next;
+                free_endpoint(endpoint);
+            }
+            break;
+        case SIM_PIPE_READ:
+        case SIM_PIPE_WRITE:
+            if (--file->pipe->ends == 0) {
+                free(file->pipe);
+            }
+            break;
+        default:
+            break;
+    }
+    free_file(file);
+    return 0;
+}
+
+int sim_epoll_create1(int UNUSED(flags)) {
+    stats.calls++;
+    return new_file(SIM_EPOLL)->fd;
+}
+
+int sim_epoll_ctl(int epoll, int op, int fd, struct epoll_event* event) {
+    if (!lookup(epoll)) {
+        return -1;
+    }
+    struct sim_file* file = lookup(fd);
+    if (!file) {
+        return -1;
+    }
+    switch (op) {
+        case EPOLL_CTL_ADD:
+            if (file->registered) {
+                errno = EEXIST;
+                return -1;
+            }
+            // fall through
+        case EPOLL_CTL_MOD:
+            file->registered = true;
+            file->interest = event->events;
+            file->data = event->data;
+            // edge triggered, but whatever is ready now is reported once
+            queue_ready(file);
+            return 0;
+        case EPOLL_CTL_DEL:
+            file->registered = false;
+            unqueue_ready(file);
+            return 0;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+static int take_ready(struct epoll_event* events, int max_events) {
+    int result = 0;
+    while (result < max_events && ready_first) {
+        struct sim_file* file = ready_first;
+        unqueue_ready(file);
+        uint32_t ready = poll_file(file);
+        if (ready) {
+            events[result].events = ready;
+            events[result].data = file->data;
+            result++;
+        }
+    }
+    return result;
+}
+
+int sim_epoll_wait(int epoll, struct epoll_event* events, int max_events, int timeout) {
+    if (!lookup(epoll)) {
+        return -1;
+    }
+    stats.epoll_waits++;
+    int64_t deadline = timeout < 0 ? -1 : (int64_t)now + timeout;
+    for (;;) {
+        if (stopped) {
+            errno = ESHUTDOWN;
+            return -1;
+        }
+        int result = take_ready(events, max_events);
+        if (result > 0) {
+            stats.events += (uint64_t)result;
+            return result;
+        }
+        int64_t next = driver();
+        if (ready_first || stopped) {
+            continue;
+        }
+        if (deadline != -1 && deadline <= (int64_t)now) {
+            return 0;
+        }
+        if (next == -1 && deadline == -1) {
+            fprintf(stderr, "sim: proxy and driver are both waiting on each other\n");
+            errno = ESHUTDOWN;
+            return -1;
+        }
+        if (next != -1 && next <= (int64_t)now) {
+            next = (int64_t)now + 1;
+        }
+        if (next == -1 || (deadline != -1 && deadline < next)) {
+            next = deadline;
+        }
+        now = (uint64_t)next;
+    }
+}
+
+int sim_clock_gettime(clockid_t UNUSED(clock), struct timespec* time) {
+    stats.calls++;
+    time->tv_sec = (time_t)(now / 1000);
+    time->tv_nsec = (long)(now % 1000) * 1000000;
+    return 0;
+}
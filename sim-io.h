@@ -0,0 +1,111 @@
+#ifndef SIM_IO_H
+#define SIM_IO_H
+/*
+ * A small in-memory kernel for proxy-splice.c: sockets, pipes and a single
+ * edge triggered epoll instance, with a virtual clock. Sockets only count
+ * bytes, except for the first SIM_HEAD_SIZE bytes send over them, so that
+ * knocks still work.
+ *
+ * The other end of every socket the proxy accepts or connects is a
+ * sim_endpoint, driven by the benchmark: whenever the proxy has nothing to
+ * do, epoll_wait calls the driver, which can connect, send, receive and
+ * close endpoints, and tells when it next has something to do. The virtual
+ * clock then jumps to whatever comes first, the driver or the epoll timeout.
+ * The run ends when the driver calls sim_stop(), epoll_wait then fails with
+ * ESHUTDOWN.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#define SIM_HEAD_SIZE 64
+#define SIM_PIPE_SIZE (64 * 1024)
+#define SIM_SOCKET_BUFFER (256 * 1024)
+/* far above any real descriptor, so stray real calls fail with EBADF */
+#define SIM_FD_BASE (1 << 24)
+/* the virtual clock starts here (in ms) */
+#define SIM_START_TIME 1000000
+
+struct sim_endpoint;
+
+/* called when the proxy connects to a port, return false to refuse it */
+typedef bool (*sim_connect_cb)(struct sim_endpoint* backend, uint16_t port);
+/* called when the proxy is idle, returns the next time (ms) the driver has work, or -1 */
+typedef int64_t (*sim_driver_cb)(void);
+
+struct sim_stats {
+    uint64_t calls;
+    uint64_t epoll_waits;
+    uint64_t events;
+    uint64_t bytes;
+    uint64_t accepts;
+    uint64_t connects;
+    uint64_t open_files;
+};
+
+void sim_init(sim_connect_cb on_connect, sim_driver_cb driver);
+void sim_stop(void);
+uint64_t sim_now(void);
+const struct sim_stats* sim_stats(void);
+
+/* the driver side of a connection */
+struct sim_endpoint* sim_connect(uint16_t port, uint32_t address);
+void sim_send(struct sim_endpoint* endpoint, const void* data, size_t size);
+size_t sim_receive(struct sim_endpoint* endpoint, size_t max);
+void sim_close(struct sim_endpoint* endpoint);
+void sim_reset(struct sim_endpoint* endpoint);
+/* the driver is done with it, it is freed once the proxy closed its side too */
+void sim_release(struct sim_endpoint* endpoint);
+bool sim_proxy_closed(const struct sim_endpoint* endpoint);
+void sim_set_user(struct sim_endpoint* endpoint, void* user);
+void* sim_user(const struct sim_endpoint* endpoint);
+/* endpoints the proxy send data to or closed since the last call, NULL when done */
+struct sim_endpoint* sim_next_activity(void);
+
+int sim_socket(int domain, int type, int protocol);
+int sim_setsockopt(int fd, int level, int name, const void* value, socklen_t size);
+/* options read as zero */
+int sim_getsockopt(int fd, int level, int name, void* value, socklen_t* size);
+/* requests answer zero */
+int sim_ioctl(int fd, unsigned long request, int* value);
+int sim_bind(int fd, const struct sockaddr* address, socklen_t size);
+int sim_listen(int fd, int backlog);
+int sim_accept4(int fd, struct sockaddr* address, socklen_t* size, int flags);
+int sim_connect_socket(int fd, const struct sockaddr* address, socklen_t size);
+int sim_pipe2(int fds[2], int flags);
+ssize_t sim_read(int fd, void* buffer, size_t size);
+ssize_t sim_write(int fd, const void* buffer, size_t size);
+ssize_t sim_recv(int fd, void* buffer, size_t size, int flags);
+ssize_t sim_send_fd(int fd, const void* buffer, size_t size, int flags);
+ssize_t sim_splice(int fd_in, loff_t* off_in, int fd_out, loff_t* off_out, size_t size, unsigned int flags);
+int sim_close_fd(int fd);
+int sim_epoll_create1(int flags);
+int sim_epoll_ctl(int epoll, int op, int fd, struct epoll_event* event);
+int sim_epoll_wait(int epoll, struct epoll_event* events, int max_events, int timeout);
+int sim_clock_gettime(clockid_t clock, struct timespec* time);
+
+#define io_socket sim_socket
+#define io_setsockopt sim_setsockopt
+#define io_getsockopt sim_getsockopt
+#define io_ioctl sim_ioctl
+#define io_bind sim_bind
+#define io_listen sim_listen
+#define io_accept4 sim_accept4
+#define io_connect sim_connect_socket
+#define io_pipe2 sim_pipe2
+#define io_read sim_read
+#define io_write sim_write
+#define io_recv sim_recv
+#define io_send sim_send_fd
+#define io_splice sim_splice
+#define io_close sim_close_fd
+#define io_epoll_create1 sim_epoll_create1
+#define io_epoll_ctl sim_epoll_ctl
+#define io_epoll_wait sim_epoll_wait
+#define io_clock_gettime sim_clock_gettime
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef SPLICE_IO_H
+#define SPLICE_IO_H
+/*
+ * All calls proxy-splice.c makes into the kernel go through these names.
+ * Normally they are just the system calls, but when build with -DSIM_IO
+ * they go to the in-memory kernel in sim-io.c, so that the state machine
+ * can be benchmarked without paying for the real sockets.
+ */
+#ifdef SIM_IO
+#include "sim-io.h"
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+
+#define io_socket socket
+#define io_setsockopt setsockopt
+#define io_getsockopt getsockopt
+#define io_ioctl ioctl
+#define io_bind bind
+#define io_listen listen
+#define io_accept4 accept4
+#define io_connect connect
+#define io_pipe2 pipe2
+#define io_read read
+#define io_write write
+#define io_recv recv
+#define io_send send
+#define io_splice splice
+#define io_close close
+#define io_epoll_create1 epoll_create1
+#define io_epoll_ctl epoll_ctl
+#define io_epoll_wait epoll_wait
+#define io_clock_gettime clock_gettime
+#endif
+
+#endif
@@ -0,0 +1,73 @@
+package main
+
+import (
+    "flag"
+    "fmt"
+    "io"
+    "net"
+    "os"
+    "strconv"
+    "time"
+)
+
+// Teaches an --adaptiveKnock proxy that clients talk first within
+// milliseconds, and checks that a client waiting for the server is then
+// forwarded well within the configured knock timeout.
+func main() {
+    port := flag.Int("port", 4000, "Port of the proxy to connect to.")
+    backendPort := flag.Int("backendPort", 4002, "Port to run the greeting backend on (the normal port of the proxy).")
+    knockTimeout := flag.Int("knockTimeout", 1, "The --knockTimeout of the proxy")
+    samples := flag.Int("samples", 300, "Amount of talk first connections to make")
+    flag.Parse()
+
+    l, err := net.Listen("tcp", ":" + strconv.Itoa(*backendPort))
+    if err != nil {
+        fmt.Println("ERROR", err)
+        os.Exit(1)
+    }
+    go func() {
+        for {
+            conn, err := l.Accept()
+            if err != nil {
+                return
+            }
+            conn.Write([]byte("HI"))
+            conn.Close()
+        }
+    }()
+
+    for i := 0; i < *samples; i++ {
+        conn, err := net.Dial("tcp", ":" + strconv.Itoa(*port))
+        if err != nil {
+            fmt.Println("ERROR", err)
+            os.Exit(1)
+        }
+        conn.Write([]byte("GET / HTTP/1.0\r\n\r\n"))
+        waitForGreeting(conn)
+    }
+
+    conn, err := net.Dial("tcp", ":" + strconv.Itoa(*port))
+    if err != nil {
+        fmt.Println("ERROR", err)
+        os.Exit(1)
+    }
+    start := time.Now()
+    waitForGreeting(conn)
+    waited := time.Since(start)
+    fmt.Println("Waited", waited, "for the server to talk first")
+    if waited > time.Duration(*knockTimeout) * time.Second / 2 {
+        fmt.Println("ERROR: knock timeout did not adapt")
+        os.Exit(1)
+    }
+    fmt.Println("OK")
+}
+
+func waitForGreeting(conn net.Conn) {
+    defer conn.Close()
+    greeting := make([]byte, 2)
+    _, err := io.ReadFull(conn, greeting)
+    if err != nil {
+        fmt.Println("ERROR", err)
+        os.Exit(1)
+    }
+}
@@ -0,0 +1,120 @@
+package main
+
+import (
+    "bufio"
+    "flag"
+    "fmt"
+    "io"
+    "io/ioutil"
+    "net"
+    "os"
+    "strconv"
+    "strings"
+    "sync/atomic"
+    "time"
+)
+
+// Pushes data as fast as possible through the proxy to a backend that only
+// reads slowly, and checks that the resident memory of the proxy stays flat.
+// It has to move a few hundred MB, or slow growth would go unnoticed.
+func main() {
+    port := flag.Int("port", 4000, "Port of the proxy to connect to.")
+    backendPort := flag.Int("backendPort", 4002, "Port to run the slow backend on (the normal port of the proxy).")
+    pid := flag.Int("pid", 0, "Pid of the proxy to monitor.")
+    duration := flag.Int("seconds", 10, "How long to keep pushing data")
+    rate := flag.Int("rate", 64 * 1024 * 1024, "Bytes per second the backend will read")
+    readBuffer := flag.Int("readBuffer", 64 * 1024, "Receive buffer of the backend in bytes, small so the proxy has to hold back")
+    minPushed := flag.Int64("minPushed", 256, "Minimum MB that has to go through, less means the test measured nothing")
+    maxGrowth := flag.Int("maxGrowth", 16 * 1024, "Maximum growth of the proxy RSS in KB")
+    flag.Parse()
+
+    l, err := net.Listen("tcp", ":" + strconv.Itoa(*backendPort))
+    if err != nil {
+        fmt.Println("ERROR", err)
+        os.Exit(1)
+    }
+    go slowBackend(l, *rate, *readBuffer)
+
+    conn, err := net.Dial("tcp", ":" + strconv.Itoa(*port))
+    if err != nil {
+        fmt.Println("ERROR", err)
+        os.Exit(1)
+    }
+    // no knock, so we end up at the slow backend
+
+    start_rss := rss(*pid)
+    max_rss := start_rss
+    pushed := int64(0)
+    go func() {
+        chunk := make([]byte, 1024 * 1024)
+        for {
+            written, err := conn.Write(chunk)
+            atomic.AddInt64(&pushed, int64(written))
+            if err != nil {
+                return
+            }
+        }
+    }()
+
+    deadline := time.Now().Add(time.Duration(*duration) * time.Second)
+    for time.Now().Before(deadline) {
+        time.Sleep(100 * time.Millisecond)
+        current := rss(*pid)
+        if current > max_rss {
+            max_rss = current
+        }
+    }
+    conn.Close()
+
+    pushedMB := atomic.LoadInt64(&pushed) / (1024 * 1024)
+    fmt.Printf("Pushed %d MB, proxy RSS %d KB -> max %d KB\n", pushedMB, start_rss, max_rss)
+    if pushedMB < *minPushed {
+        fmt.Printf("ERROR: only %d MB went through, at least %d MB is needed to see growth\n", pushedMB, *minPushed)
+        os.Exit(1)
+    }
+    if max_rss - start_rss > *maxGrowth {
+        fmt.Println("ERROR: proxy memory grew while the backend could not keep up")
+        os.Exit(1)
+    }
+    fmt.Println("OK")
+}
+
+func slowBackend(l net.Listener, rate int, readBuffer int) {
+    for {
+        conn, err := l.Accept()
+        if err != nil {
+            return
+        }
+        go func() {
+            defer conn.Close()
+            // keep the kernel buffers small, so the proxy has to buffer
+            conn.(*net.TCPConn).SetReadBuffer(readBuffer)
+            slice := rate / 10
+            for {
+                _, err := io.CopyN(ioutil.Discard, conn, int64(slice))
+                if err != nil {
+                    return
+                }
+                time.Sleep(100 * time.Millisecond)
+            }
+        }()
+    }
+}
+
+func rss(pid int) int {
+    f, err := os.Open("/proc/" + strconv.Itoa(pid) + "/status")
+    if err != nil {
+        fmt.Println("ERROR", err)
+        os.Exit(1)
+    }
+    defer f.Close()
+    s := bufio.NewScanner(f)
+    for s.Scan() {
+        if strings.HasPrefix(s.Text(), "VmRSS:") {
+            fields := strings.Fields(s.Text())
+            result, _ := strconv.Atoi(fields[1])
+            return result
+        }
+    }
+    return 0
+}
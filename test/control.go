@@ -0,0 +1,225 @@
+package main
+
+import (
+    "bufio"
+    "flag"
+    "fmt"
+    "io"
+    "net"
+    "os"
+    "strconv"
+    "strings"
+    "time"
+)
+
+// Checks the control socket of the proxy: listing connections (also a
+// listing that needs many chunks), killing them by id and by source, the
+// flight recorder of the killed connections, the heavy hitters and the
+// sampled TCP statistics.
+//
+// Start the proxy with its normal port pointing to --backendPort, for example:
+//    ./l7knockknock --normalPort=5544 --listenPort=6633 --control=/tmp/l7.sock PASSWORD &
+//    go run test/control.go --port 6633 --backendPort 5544 --control /tmp/l7.sock
+func main() {
+    port := flag.Int("port", 4000, "Port of the proxy to connect to.")
+    backendPort := flag.Int("backendPort", 4002, "Port to run the echo backend on (the normal port of the proxy).")
+    control := flag.String("control", "", "Control socket of the proxy.")
+    connections := flag.Int("connections", 1000, "Amount of connections for the long listing")
+    flag.Parse()
+
+    l, err := net.Listen("tcp", ":" + strconv.Itoa(*backendPort))
+    if err != nil {
+        fail(err)
+    }
+    go echoBackend(l)
+
+    first := connect(*port)
+    waiting, err := net.Dial("tcp", ":" + strconv.Itoa(*port))
+    if err != nil {
+        fail(err)
+    }
+    defer waiting.Close()
+    time.Sleep(100 * time.Millisecond)
+
+    rows := list(*control)
+    if len(rows) != 2 {
+        fail(fmt.Errorf("expected 2 connections, got %v", rows))
+    }
+    var id string
+    for _, row := range rows {
+        if row[1] == "proxying" && row[2] == "normal" {
+            id = row[0]
+        } else if row[1] != "knock" || row[2] != "-" {
+            fail(fmt.Errorf("unexpected connection %v", row))
+        }
+    }
+    if reply := command(*control, "kill " + id); reply != "killed 1" {
+        fail(fmt.Errorf("unexpected reply to kill: %s", reply))
+    }
+    first.SetReadDeadline(time.Now().Add(2 * time.Second))
+    if _, err := first.Read(make([]byte, 1)); err != io.EOF {
+        fail(fmt.Errorf("killed connection was not closed: %v", err))
+    }
+    if reply := command(*control, "kill " + id); !strings.HasPrefix(reply, "unknown connection") {
+        fail(fmt.Errorf("killed the same connection twice: %s", reply))
+    }
+    killed := false
+    for _, row := range trace(*control) {
+        if row[0] == "closed" && row[1] == id {
+            events := strings.Join(row[5:], " ")
+            killed = strings.Contains(events, ":front:killed ") && strings.HasSuffix(events, ":front:close")
+            if !strings.Contains(events, ":front:first-data-normal ") || !strings.Contains(events, ":back:connected ") {
+                fail(fmt.Errorf("unexpected trace of the killed connection: %v", row))
+            }
+        }
+    }
+    if !killed {
+        fail(fmt.Errorf("the killed connection is not in the trace"))
+    }
+    top := map[string]uint64{}
+    for _, row := range listing(*control, "top", "sketch prefix count error") {
+        if row[1] == "127.0.0.0/24" {
+            top[row[0]], _ = strconv.ParseUint(row[2], 10, 64)
+        }
+    }
+    if top["connections"] < 2 || top["bytes"] < 6 {
+        fail(fmt.Errorf("unexpected heavy hitters for 127.0.0.0/24: %v", top))
+    }
+    // the proxy samples while it is working, so keep a connection busy until it did
+    sampled := connect(*port)
+    for deadline := time.Now().Add(5 * time.Second); tcpSamples(*control) == 0; {
+        if time.Now().After(deadline) {
+            fail(fmt.Errorf("no TCP statistics sampled for the normal route"))
+        }
+        sampled.Write([]byte("GET"))
+        io.ReadFull(sampled, make([]byte, 3))
+        time.Sleep(50 * time.Millisecond)
+    }
+    sampled.Close()
+
+    var conns []net.Conn
+    for i := 0; i < *connections; i++ {
+        conns = append(conns, connect(*port))
+    }
+    if rows := list(*control); len(rows) != *connections + 1 {
+        fail(fmt.Errorf("expected %d connections, got %d", *connections + 1, len(rows)))
+    }
+    if reply := command(*control, "kill-source 127.0.0.1"); reply != "killed " + strconv.Itoa(*connections + 1) {
+        fail(fmt.Errorf("unexpected reply to kill-source: %s", reply))
+    }
+    for _, conn := range conns {
+        conn.SetReadDeadline(time.Now().Add(2 * time.Second))
+        if _, err := conn.Read(make([]byte, 1)); err != io.EOF {
+            fail(fmt.Errorf("connection was not closed by kill-source: %v", err))
+        }
+        conn.Close()
+    }
+    fmt.Println("OK")
+}
+
+func fail(err error) {
+    fmt.Println("ERROR", err)
+    os.Exit(1)
+}
+
+// a proxied connection to the normal port
+func connect(port int) net.Conn {
+    conn, err := net.Dial("tcp", ":" + strconv.Itoa(port))
+    if err == nil {
+        _, err = conn.Write([]byte("GET"))
+    }
+    if err == nil {
+        _, err = io.ReadFull(conn, make([]byte, 3))
+    }
+    if err != nil {
+        fail(err)
+    }
+    return conn
+}
+
+// the rtt samples of the front of the normal route, after checking that the
+// histograms add up
+func tcpSamples(control string) uint64 {
+    var result uint64
+    for _, row := range listing(control, "tcp", "route side metric samples buckets") {
+        samples, _ := strconv.ParseUint(row[3], 10, 64)
+        var total uint64
+        for _, bucket := range row[4:] {
+            count, _ := strconv.ParseUint(bucket[strings.Index(bucket, ":") + 1:], 10, 64)
+            total += count
+        }
+        if total != samples {
+            fail(fmt.Errorf("the buckets don't add up to the samples: %v", row))
+        }
+        if row[0] == "normal" && row[1] == "front" && row[2] == "rtt_us" {
+            result = samples
+        }
+    }
+    return result
+}
+
+func command(control string, line string) string {
+    conn, err := net.Dial("unix", control)
+    if err != nil {
+        fail(err)
+    }
+    defer conn.Close()
+    conn.SetDeadline(time.Now().Add(5 * time.Second))
+    if _, err := conn.Write([]byte(line + "\n")); err != nil {
+        fail(err)
+    }
+    reply, err := bufio.NewReader(conn).ReadString('\n')
+    if err != nil {
+        fail(err)
+    }
+    return strings.TrimSuffix(reply, "\n")
+}
+
+func list(control string) [][]string {
+    return listing(control, "list", "id phase route")
+}
+
+func trace(control string) [][]string {
+    return listing(control, "trace", "state id route")
+}
+
+func listing(control string, line string, expectedHeader string) [][]string {
+    conn, err := net.Dial("unix", control)
+    if err != nil {
+        fail(err)
+    }
+    defer conn.Close()
+    conn.SetDeadline(time.Now().Add(5 * time.Second))
+    if _, err := conn.Write([]byte(line + "\n")); err != nil {
+        fail(err)
+    }
+    reader := bufio.NewReader(conn)
+    header, err := reader.ReadString('\n')
+    if err != nil || !strings.HasPrefix(header, expectedHeader) {
+        fail(fmt.Errorf("unexpected listing header %q: %v", header, err))
+    }
+    var result [][]string
+    for {
+        line, err := reader.ReadString('\n')
+        if err != nil {
+            fail(err)
+        }
+        if line == "end\n" {
+            return result
+        }
+        result = append(result, strings.Fields(line))
+    }
+}
+
+func echoBackend(l net.Listener) {
+    for {
+        conn, err := l.Accept()
+        if err != nil {
+            return
+        }
+        go func() {
+            defer conn.Close()
+            io.Copy(conn, conn)
+        }()
+    }
+}
@@ -0,0 +1,146 @@
+package main
+
+import (
+    "flag"
+    "fmt"
+    "io"
+    "net"
+    "os"
+    "strconv"
+    "time"
+)
+
+// Checks the elastic workers of the proxy: bulk downloads make it start
+// more threads, and once they are done it stops them again, without
+// dropping the connections that were on the stopped workers.
+//
+// Start the proxy with a range of threads, for example:
+//    ./l7knockknock --normalPort=5544 --listenPort=6633 --threads=1 --maxThreads=4 PASSWORD &
+//    go run test/elastic.go --port 6633 --backendPort 5544 --pid $!
+func main() {
+    port := flag.Int("port", 4000, "Port of the proxy to connect to.")
+    backendPort := flag.Int("backendPort", 4001, "Port to run the backend on (the normal port of the proxy).")
+    pid := flag.Int("pid", 0, "Pid of the proxy, to count its threads.")
+    downloads := flag.Int("downloads", 8, "Amount of bulk downloads to keep the proxy busy.")
+    idle := flag.Int("idle", 20, "Amount of idle connections to keep open meanwhile.")
+    wait := flag.Duration("wait", 20 * time.Second, "How long to wait for the proxy to start or stop threads.")
+    flag.Parse()
+
+    l, err := net.Listen("tcp", ":" + strconv.Itoa(*backendPort))
+    if err != nil {
+        fail(err)
+    }
+    go backend(l)
+
+    idleThreads := threads(*pid)
+    var conns []net.Conn
+    for i := 0; i < *idle / 2; i++ {
+        conns = append(conns, connect(*port, "ECHO"))
+    }
+
+    var bulk []net.Conn
+    for i := 0; i < *downloads; i++ {
+        conn := connect(*port, "BULK")
+        go io.Copy(io.Discard, conn)
+        bulk = append(bulk, conn)
+    }
+    busyThreads := waitFor(*pid, *wait, func(count int) bool { return count > idleThreads })
+    fmt.Printf("busy: %d threads, idle it had %d\n", busyThreads, idleThreads)
+    // these land on the new workers as well
+    for i := *idle / 2; i < *idle; i++ {
+        conns = append(conns, connect(*port, "ECHO"))
+    }
+    time.Sleep(*wait / 10)
+
+    for _, conn := range bulk {
+        conn.Close()
+    }
+    waitFor(*pid, *wait, func(count int) bool { return count <= idleThreads })
+    fmt.Printf("idle again: %d threads\n", threads(*pid))
+
+    for i, conn := range conns {
+        echo(conn, fmt.Sprintf("still there %d", i))
+        conn.Close()
+    }
+    fmt.Println("OK")
+}
+
+func fail(err error) {
+    fmt.Println("ERROR", err)
+    os.Exit(1)
+}
+
+func threads(pid int) int {
+    tasks, err := os.ReadDir("/proc/" + strconv.Itoa(pid) + "/task")
+    if err != nil {
+        fail(err)
+    }
+    return len(tasks)
+}
+
+func waitFor(pid int, wait time.Duration, done func(int) bool) int {
+    deadline := time.Now().Add(wait)
+    for time.Now().Before(deadline) {
+        if count := threads(pid); done(count) {
+            return count
+        }
+        time.Sleep(100 * time.Millisecond)
+    }
+    fail(fmt.Errorf("the proxy still has %d threads after %v", threads(pid), wait))
+    return 0
+}
+
+// a connection to the normal port, the first data tells the backend what to do
+func connect(port int, mode string) net.Conn {
+    conn, err := net.Dial("tcp", ":" + strconv.Itoa(port))
+    if err != nil {
+        fail(err)
+    }
+    if mode == "ECHO" {
+        echo(conn, mode)
+    } else if _, err := conn.Write([]byte(mode)); err != nil {
+        fail(err)
+    }
+    return conn
+}
+
+func echo(conn net.Conn, message string) {
+    conn.SetDeadline(time.Now().Add(2 * time.Second))
+    if _, err := conn.Write([]byte(message)); err != nil {
+        fail(err)
+    }
+    reply := make([]byte, len(message))
+    if _, err := io.ReadFull(conn, reply); err != nil || string(reply) != message {
+        fail(fmt.Errorf("expected %q back, got %q: %v", message, reply, err))
+    }
+    conn.SetDeadline(time.Time{})
+}
+
+// echoes, unless the first data is BULK, then it sends as much as the client will take
+func backend(l net.Listener) {
+    data := make([]byte, 64 * 1024)
+    for {
+        conn, err := l.Accept()
+        if err != nil {
+            return
+        }
+        go func() {
+            defer conn.Close()
+            first := make([]byte, 4)
+            if _, err := io.ReadFull(conn, first); err != nil {
+                return
+            }
+            if string(first) != "BULK" {
+                conn.Write(first)
+                io.Copy(conn, conn)
+                return
+            }
+            go io.Copy(io.Discard, conn)
+            for {
+                if _, err := conn.Write(data); err != nil {
+                    return
+                }
+            }
+        }()
+    }
+}
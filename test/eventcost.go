@@ -0,0 +1,103 @@
+package main
+
+import (
+    "flag"
+    "fmt"
+    "io"
+    "io/ioutil"
+    "math/rand"
+    "net"
+    "os"
+    "strconv"
+    "strings"
+    "time"
+)
+
+// Measures the CPU time the proxy spends per proxied event while a growing
+// amount of idle connections (each with its own timeouts) is kept open.
+//
+// Start the proxy with its normal port pointing to --backendPort, and a large
+// enough --proxyTimeout, for example:
+//    ./l7knockknock --normalPort=5544 --listenPort=6633 --proxyTimeout=600 PASSWORD &
+//    go run test/eventcost.go --port 6633 --backendPort 5544 --pid $!
+func main() {
+    port := flag.Int("port", 4000, "Port of the proxy to connect to.")
+    backendPort := flag.Int("backendPort", 4002, "Port to run the echo backend on (the normal port of the proxy).")
+    pid := flag.Int("pid", 0, "Pid of the proxy to measure.")
+    steps := flag.String("connections", "100,1000,5000,10000", "Amount of idle connections to measure with")
+    roundTrips := flag.Int("roundTrips", 20000, "Amount of echo round trips to measure per step")
+    flag.Parse()
+
+    l, err := net.Listen("tcp", ":" + strconv.Itoa(*backendPort))
+    if err != nil {
+        fmt.Println("ERROR", err)
+        os.Exit(1)
+    }
+    go echoBackend(l)
+
+    var conns []net.Conn
+    buffer := make([]byte, 1)
+    fmt.Println("connections,cpu_us_per_round_trip")
+    for _, step := range strings.Split(*steps, ",") {
+        wanted, err := strconv.Atoi(step)
+        if err != nil {
+            fmt.Println("ERROR", err)
+            os.Exit(1)
+        }
+        for len(conns) < wanted {
+            conn, err := net.Dial("tcp", ":" + strconv.Itoa(*port))
+            if err != nil {
+                fmt.Println("ERROR", err)
+                os.Exit(1)
+            }
+            roundTrip(conn, buffer)
+            conns = append(conns, conn)
+        }
+
+        before := cpuTicks(*pid)
+        for i := 0; i < *roundTrips; i++ {
+            roundTrip(conns[rand.Intn(len(conns))], buffer)
+        }
+        used := time.Duration(cpuTicks(*pid) - before) * 10 * time.Millisecond
+        fmt.Printf("%d,%.2f\n", len(conns), float64(used.Microseconds()) / float64(*roundTrips))
+    }
+}
+
+func roundTrip(conn net.Conn, buffer []byte) {
+    buffer[0] = 'x'
+    _, err := conn.Write(buffer)
+    if err == nil {
+        _, err = io.ReadFull(conn, buffer)
+    }
+    if err != nil {
+        fmt.Println("ERROR", err)
+        os.Exit(1)
+    }
+}
+
+func echoBackend(l net.Listener) {
+    for {
+        conn, err := l.Accept()
+        if err != nil {
+            return
+        }
+        go func() {
+            defer conn.Close()
+            io.Copy(conn, conn)
+        }()
+    }
+}
+
+// user + system time of the process, in clock ticks (USER_HZ = 100)
+func cpuTicks(pid int) int {
+    stat, err := ioutil.ReadFile("/proc/" + strconv.Itoa(pid) + "/stat")
+    if err != nil {
+        fmt.Println("ERROR", err)
+        os.Exit(1)
+    }
+    // skip past the command name, it might contain spaces
+    fields := strings.Fields(string(stat[strings.LastIndexByte(string(stat), ')') + 2:]))
+    utime, _ := strconv.Atoi(fields[11])
+    stime, _ := strconv.Atoi(fields[12])
+    return utime + stime
+}
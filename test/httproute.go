@@ -0,0 +1,115 @@
+package main
+
+import (
+    "bytes"
+    "flag"
+    "fmt"
+    "io"
+    "net"
+    "os"
+    "strconv"
+    "strings"
+    "time"
+)
+
+// Checks the HTTP routing of the proxy: requests for the secret host or
+// path reach the hidden backend, everything else the normal one, also when
+// the head arrives in pieces, and the backends get the bytes unchanged.
+//
+// Start the proxy with HTTP routing, for example:
+//    ./l7knockknock --normalPort=5544 --hiddenPort=5545 --listenPort=6633 --httpHost=secret.example --httpPath=/hide/ PASSWORD &
+//    go run test/httproute.go --port 6633 --normalPort 5544 --hiddenPort 5545 --host secret.example --path /hide/
+func main() {
+    port := flag.Int("port", 4000, "Port of the proxy to connect to.")
+    normalPort := flag.Int("normalPort", 4001, "Port to run the normal backend on.")
+    hiddenPort := flag.Int("hiddenPort", 4002, "Port to run the hidden backend on.")
+    host := flag.String("host", "secret.example", "The --httpHost of the proxy.")
+    path := flag.String("path", "/hide/", "The --httpPath of the proxy.")
+    knockTimeout := flag.Duration("knockTimeout", time.Second, "The knock timeout of the proxy.")
+    flag.Parse()
+
+    for name, backendPort := range map[string]int{"normal": *normalPort, "hidden": *hiddenPort} {
+        l, err := net.Listen("tcp", ":" + strconv.Itoa(backendPort))
+        if err != nil {
+            fail(err)
+        }
+        go backend(l, name)
+    }
+
+    upper := strings.ToUpper(*host)
+    cases := []struct {
+        route string
+        parts []string
+    }{
+        {"hidden", []string{"GET " + *path + "file HTTP/1.1\r\nHost: www.example.com\r\n\r\n"}},
+        {"hidden", []string{"GET " + (*path)[:2], (*path)[2:] + " HTTP/1.1\r\n\r\n"}},
+        {"normal", []string{"GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n\r\n"}},
+        {"hidden", []string{"GET / HTTP/1.1\r\nAccept: */*\r\nhost:  " + upper + "\r\n\r\n"}},
+        {"hidden", []string{"GET / HTTP/1.1\r\nHo", "st: " + *host + ":8080\r\n", "\r\n"}},
+        {"normal", []string{"GET / HTTP/1.1\r\nHost: " + *host + ".evil\r\n\r\n"}},
+        {"normal", []string{"GET / HTTP/1.1\r\nX-Host: " + *host + "\r\n\r\n"}},
+        {"normal", []string{"\x16\x03\x01\x02\x00\x01\x00\x01\xfc\x03\x03\r\n\r\n"}},
+        {"normal", []string{"GET / HTTP/1.1\r\nAccept: */*\r\n"}},
+    }
+    for _, c := range cases {
+        got, received := request(*port, c.parts, *knockTimeout)
+        sent := strings.Join(c.parts, "")
+        if got != c.route || string(received) != sent {
+            fail(fmt.Errorf("%q went to %s (received %q), expected %s", sent, got, received, c.route))
+        }
+    }
+    fmt.Println("OK")
+}
+
+func fail(err error) {
+    fmt.Println("ERROR", err)
+    os.Exit(1)
+}
+
+// sends the parts with a pause in between, and returns the name of the
+// backend and what it received
+func request(port int, parts []string, knockTimeout time.Duration) (string, []byte) {
+    conn, err := net.Dial("tcp", ":" + strconv.Itoa(port))
+    if err != nil {
+        fail(err)
+    }
+    defer conn.Close()
+    for _, part := range parts {
+        if _, err := conn.Write([]byte(part)); err != nil {
+            fail(err)
+        }
+        time.Sleep(20 * time.Millisecond)
+    }
+    conn.SetReadDeadline(time.Now().Add(knockTimeout + 3 * time.Second))
+    reply, err := io.ReadAll(conn)
+    if err != nil {
+        fail(err)
+    }
+    name, received, _ := bytes.Cut(reply, []byte("\n"))
+    return string(name), received
+}
+
+// answers with its name and what it received until the end of the head,
+// or until the client stopped sending for a while
+func backend(l net.Listener, name string) {
+    for {
+        conn, err := l.Accept()
+        if err != nil {
+            return
+        }
+        go func() {
+            defer conn.Close()
+            var received []byte
+            buffer := make([]byte, 4096)
+            for !bytes.Contains(received, []byte("\r\n\r\n")) {
+                conn.SetReadDeadline(time.Now().Add(500 * time.Millisecond))
+                n, err := conn.Read(buffer)
+                received = append(received, buffer[:n]...)
+                if err != nil {
+                    break
+                }
+            }
+            conn.Write(append([]byte(name + "\n"), received...))
+        }()
+    }
+}
@@ -0,0 +1,135 @@
+package main
+
+import (
+    "flag"
+    "fmt"
+    "io"
+    "net"
+    "os"
+    "sort"
+    "strconv"
+    "time"
+)
+
+// Checks the pool of the hidden route: while bulk downloads keep the
+// workers of the normal route busy, the round trips of an interactive
+// session on the hidden route should stay fast.
+//
+// Start the proxy with a pool for the hidden route, for example:
+//    ./l7knockknock --normalPort=5544 --hiddenPort=5545 --listenPort=6633 --hiddenThreads=1 PASSWORD &
+//    go run test/isolation.go --port 6633 --normalPort 5544 --hiddenPort 5545 --knock PASSWORD --pid $!
+func main() {
+    port := flag.Int("port", 4000, "Port of the proxy to connect to.")
+    normalPort := flag.Int("normalPort", 4001, "Port to run the download backend on.")
+    hiddenPort := flag.Int("hiddenPort", 4002, "Port to run the echo backend on.")
+    knock := flag.String("knock", "PASSWORD", "The knock of the proxy.")
+    pid := flag.Int("pid", 0, "Pid of the proxy, to check it started the pool.")
+    downloads := flag.Int("downloads", 8, "Amount of bulk downloads on the normal route.")
+    rounds := flag.Int("rounds", 200, "Amount of round trips on the hidden route.")
+    maxLatency := flag.Duration("maxLatency", 20 * time.Millisecond, "Maximum 99th percentile of the round trips.")
+    flag.Parse()
+
+    l, err := net.Listen("tcp", ":" + strconv.Itoa(*normalPort))
+    if err != nil {
+        fail(err)
+    }
+    go downloadBackend(l)
+    l, err = net.Listen("tcp", ":" + strconv.Itoa(*hiddenPort))
+    if err != nil {
+        fail(err)
+    }
+    go echoBackend(l)
+
+    for i := 0; i < *downloads; i++ {
+        conn, err := net.Dial("tcp", ":" + strconv.Itoa(*port))
+        if err != nil {
+            fail(err)
+        }
+        defer conn.Close()
+        if _, err := conn.Write([]byte("GET")); err != nil {
+            fail(err)
+        }
+        go io.Copy(io.Discard, conn)
+    }
+    time.Sleep(time.Second)
+
+    session, err := net.Dial("tcp", ":" + strconv.Itoa(*port))
+    if err != nil {
+        fail(err)
+    }
+    defer session.Close()
+    if _, err := session.Write([]byte(*knock)); err != nil {
+        fail(err)
+    }
+    latencies := make([]time.Duration, *rounds)
+    for i := range latencies {
+        message := fmt.Sprintf("round %06d", i)
+        started := time.Now()
+        session.SetDeadline(started.Add(5 * time.Second))
+        if _, err := session.Write([]byte(message)); err != nil {
+            fail(err)
+        }
+        reply := make([]byte, len(message))
+        if _, err := io.ReadFull(session, reply); err != nil || string(reply) != message {
+            fail(fmt.Errorf("expected %q back, got %q: %v", message, reply, err))
+        }
+        latencies[i] = time.Since(started)
+        time.Sleep(5 * time.Millisecond)
+    }
+    sort.Slice(latencies, func(i, j int) bool { return latencies[i] < latencies[j] })
+    p99 := latencies[len(latencies) * 99 / 100]
+    fmt.Printf("hidden round trips during %d downloads: median %v, 99th percentile %v\n", *downloads, latencies[len(latencies) / 2], p99)
+    if *pid != 0 && threads(*pid) < 2 {
+        fail(fmt.Errorf("the proxy has no thread for the hidden route"))
+    }
+    if p99 > *maxLatency {
+        fail(fmt.Errorf("the 99th percentile of the hidden round trips is %v, more than %v", p99, *maxLatency))
+    }
+    fmt.Println("OK")
+}
+
+func fail(err error) {
+    fmt.Println("ERROR", err)
+    os.Exit(1)
+}
+
+func threads(pid int) int {
+    tasks, err := os.ReadDir("/proc/" + strconv.Itoa(pid) + "/task")
+    if err != nil {
+        fail(err)
+    }
+    return len(tasks)
+}
+
+func echoBackend(l net.Listener) {
+    for {
+        conn, err := l.Accept()
+        if err != nil {
+            return
+        }
+        go func() {
+            defer conn.Close()
+            io.Copy(conn, conn)
+        }()
+    }
+}
+
+// sends as much as the client will take
+func downloadBackend(l net.Listener) {
+    data := make([]byte, 64 * 1024)
+    for {
+        conn, err := l.Accept()
+        if err != nil {
+            return
+        }
+        go func() {
+            defer conn.Close()
+            go io.Copy(io.Discard, conn)
+            for {
+                if _, err := conn.Write(data); err != nil {
+                    return
+                }
+            }
+        }()
+    }
+}
@@ -0,0 +1,278 @@
+package main
+
+import (
+    "bytes"
+    "flag"
+    "fmt"
+    "io"
+    "net"
+    "os"
+    "regexp"
+    "strconv"
+    "sync/atomic"
+    "time"
+)
+
+// Checks the migration between the workers of the proxy: bulk downloads
+// that started on the same worker get a smaller share than the others,
+// until the proxy spreads them out, after which all downloads should be
+// about as fast.
+//
+// The kernel decides which worker accepts a connection, so the test reads
+// that from the verbose output of the proxy, and only keeps downloads with
+// two of them on one worker and none on another: one that has to move.
+// Start the proxy with --verbose and its output in a file, for example:
+//    ./l7knockknock --normalPort=5544 --listenPort=6633 --threads=4 --verbose PASSWORD > proxy.log &
+//    go run test/migration.go --port 6633 --backendPort 5544 --threads 4 --log proxy.log
+func main() {
+    port := flag.Int("port", 4000, "Port of the proxy to connect to.")
+    backendPort := flag.Int("backendPort", 4001, "Port to run the download backend on (the normal port of the proxy).")
+    threads := flag.Int("threads", 4, "Amount of threads of the proxy, there will be as many downloads.")
+    log := flag.String("log", "", "Output of the proxy, which has to run with --verbose.")
+    settle := flag.Duration("settle", 5 * time.Second, "How long the proxy gets to spread the downloads.")
+    duration := flag.Duration("duration", 2 * time.Second, "How long to measure after that.")
+    maxRatio := flag.Float64("maxRatio", 1.5, "Maximum ratio between the fastest and slowest download.")
+    flag.Parse()
+
+    if *threads < 2 || *log == "" {
+        fail(fmt.Errorf("needs the output of a proxy with at least 2 threads"))
+    }
+    l, err := net.Listen("tcp", ":" + strconv.Itoa(*backendPort))
+    if err != nil {
+        fail(err)
+    }
+    go downloadBackend(l)
+
+    output := &proxyOutput{path: *log}
+    for attempt := 1; ; attempt++ {
+        conns := place(*port, *threads, output)
+        received := make([]int64, len(conns))
+        for i, conn := range conns {
+            if _, err := conn.Write([]byte("GET")); err != nil {
+                fail(err)
+            }
+            go download(conn, &received[i])
+        }
+        first, migrated := untilMigrated(received, output, *settle)
+        if !migrated {
+            fail(fmt.Errorf("none of the downloads was migrated in %v", *settle))
+        }
+        if first == nil {
+            // it migrated before there was anything to measure, so try again once the loads are forgotten
+            for _, conn := range conns {
+                conn.Close()
+            }
+            if attempt == 3 {
+                fail(fmt.Errorf("the downloads were migrated too soon to measure them before"))
+            }
+            time.Sleep(3 * time.Second)
+            continue
+        }
+        fmt.Printf("before the migration: %s\n", describe(first))
+        time.Sleep(*settle)
+        last := window(received, *duration)
+        fmt.Printf("after %v: %s\n", *settle, describe(last))
+        if ratio(last) > *maxRatio {
+            fail(fmt.Errorf("the downloads did not even out, the fastest is %.1f times the slowest", ratio(last)))
+        }
+        if ratio(last) >= ratio(first) {
+            fail(fmt.Errorf("the migration did not improve the ratio between the fastest and slowest download"))
+        }
+        break
+    }
+    fmt.Println("OK")
+}
+
+// the output of the proxy from where the test started reading it
+type proxyOutput struct {
+    path string
+    offset int
+}
+
+func (output *proxyOutput) read() []byte {
+    content, err := os.ReadFile(output.path)
+    if err != nil {
+        fail(err)
+    }
+    return content[output.offset:]
+}
+
+// the worker that accepted the connection from the local port
+func (output *proxyOutput) acceptedBy(port int) int {
+    line := regexp.MustCompile(fmt.Sprintf(`(?m)^Worker (\d+) accepted a connection from port %d$`, port))
+    for tries := 0; tries < 200; tries++ {
+        if match := line.FindSubmatch(output.read()); match != nil {
+            worker, _ := strconv.Atoi(string(match[1]))
+            return worker
+        }
+        time.Sleep(10 * time.Millisecond)
+    }
+    fail(fmt.Errorf("the proxy did not report the connection from port %d", port))
+    return -1
+}
+
+func (output *proxyOutput) migrated() bool {
+    return bytes.Contains(output.read(), []byte("Migrated a bulk flow"))
+}
+
+// connects until one worker has two of the connections, one other worker
+// none and the rest one each, and closes the connections it doesn't need
+func place(port int, threads int, output *proxyOutput) []net.Conn {
+    output.offset += len(output.read())
+    byWorker := make([][]net.Conn, threads)
+    for tries := 0; tries < 20 * threads; tries++ {
+        conn, err := net.Dial("tcp", ":" + strconv.Itoa(port))
+        if err != nil {
+            fail(err)
+        }
+        worker := output.acceptedBy(conn.LocalAddr().(*net.TCPAddr).Port)
+        if worker < 0 || worker >= threads {
+            fail(fmt.Errorf("the proxy has more than %d threads", threads))
+        }
+        byWorker[worker] = append(byWorker[worker], conn)
+        if chosen := choose(byWorker); chosen != nil {
+            keep := make(map[net.Conn]bool)
+            for _, conn := range chosen {
+                keep[conn] = true
+            }
+            for _, conns := range byWorker {
+                for _, conn := range conns {
+                    if !keep[conn] {
+                        conn.Close()
+                    }
+                }
+            }
+            output.offset += len(output.read())
+            return chosen
+        }
+    }
+    fail(fmt.Errorf("the proxy did not spread %d connections over its threads", 20 * threads))
+    return nil
+}
+
+func choose(byWorker [][]net.Conn) []net.Conn {
+    crowded := -1
+    used := 0
+    for worker, conns := range byWorker {
+        if len(conns) > 0 {
+            used++
+        }
+        if len(conns) >= 2 && crowded == -1 {
+            crowded = worker
+        }
+    }
+    if crowded == -1 || used < len(byWorker) - 1 {
+        return nil
+    }
+    chosen := []net.Conn{byWorker[crowded][0], byWorker[crowded][1]}
+    for worker, conns := range byWorker {
+        if worker != crowded && len(conns) > 0 && len(chosen) < len(byWorker) {
+            chosen = append(chosen, conns[0])
+        }
+    }
+    return chosen
+}
+
+// MB/s of every download until the proxy reports the first migration, nil
+// when that was too soon to measure
+func untilMigrated(received []int64, output *proxyOutput, timeout time.Duration) ([]float64, bool) {
+    // let the connections get up to speed
+    time.Sleep(50 * time.Millisecond)
+    before := snapshot(received)
+    started := time.Now()
+    for !output.migrated() {
+        if time.Since(started) > timeout {
+            return nil, false
+        }
+        time.Sleep(10 * time.Millisecond)
+    }
+    elapsed := time.Since(started)
+    if elapsed < 100 * time.Millisecond {
+        return nil, true
+    }
+    return rates(before, snapshot(received), elapsed.Seconds()), true
+}
+
+func snapshot(received []int64) []int64 {
+    result := make([]int64, len(received))
+    for i := range received {
+        result[i] = atomic.LoadInt64(&received[i])
+    }
+    return result
+}
+
+func rates(before []int64, after []int64, elapsed float64) []float64 {
+    result := make([]float64, len(before))
+    for i := range before {
+        if after[i] == before[i] {
+            fail(fmt.Errorf("download %d stalled", i))
+        }
+        result[i] = float64(after[i] - before[i]) / 1024 / 1024 / elapsed
+    }
+    return result
+}
+
+func fail(err error) {
+    fmt.Println("ERROR", err)
+    os.Exit(1)
+}
+
+// MB/s of every download during the window
+func window(received []int64, duration time.Duration) []float64 {
+    before := snapshot(received)
+    started := time.Now()
+    time.Sleep(duration)
+    return rates(before, snapshot(received), time.Since(started).Seconds())
+}
+
+func ratio(rates []float64) float64 {
+    fastest, slowest := rates[0], rates[0]
+    for _, rate := range rates {
+        if rate > fastest {
+            fastest = rate
+        }
+        if rate < slowest {
+            slowest = rate
+        }
+    }
+    return fastest / slowest
+}
+
+func describe(rates []float64) string {
+    result := ""
+    for _, rate := range rates {
+        result += fmt.Sprintf("%.0f ", rate)
+    }
+    return fmt.Sprintf("%sMB/s (fastest/slowest %.2f)", result, ratio(rates))
+}
+
+func download(conn net.Conn, received *int64) {
+    buffer := make([]byte, 64 * 1024)
+    for {
+        n, err := conn.Read(buffer)
+        atomic.AddInt64(received, int64(n))
+        if err != nil {
+            return
+        }
+    }
+}
+
+// sends as much as the client will take
+func downloadBackend(l net.Listener) {
+    data := make([]byte, 64 * 1024)
+    for {
+        conn, err := l.Accept()
+        if err != nil {
+            return
+        }
+        go func() {
+            defer conn.Close()
+            go io.Copy(io.Discard, conn)
+            for {
+                if _, err := conn.Write(data); err != nil {
+                    return
+                }
+            }
+        }()
+    }
+}
@@ -0,0 +1,537 @@
+package main
+
+import (
+    "bufio"
+    "encoding/binary"
+    "flag"
+    "fmt"
+    "io"
+    "math/rand"
+    "net"
+    "os"
+    "sort"
+    "strconv"
+    "sync"
+    "sync/atomic"
+    "time"
+)
+
+// Replays a recording of l7knockknock --record against a test instance of
+// the proxy, with stub backends that send as much as the real ones did, at
+// the recorded times or --speed times faster. Every replayed connection
+// starts with an 8 byte id (after the knock on the hidden route), which
+// tells the stub backend what to send.
+//
+// It can also write a synthetic recording (--generate), and compare two
+// recordings (--compare), to check that a replay recorded again has the
+// same shape.
+//
+// Record with the splice engine, then replay against a test instance:
+//    ./l7knockknock --record=/tmp/traffic.rec PASSWORD
+//    ./l7knockknock --normalPort=5544 --hiddenPort=5545 --listenPort=6633 PASSWORD &
+//    go run test/replay.go --file /tmp/traffic.rec --port 6633 --normalPort 5544 --hiddenPort 5545 --knock PASSWORD --speed 2
+
+const (
+    magic = "L7KREC1\n"
+
+    eventAccept = 1
+    eventRoute = 2
+    eventBytes = 3
+    eventClose = 4
+
+    routeNormal = 0
+    routeHidden = 1
+    routeSilent = 2
+    routeTarpit = 3
+    // closed before the proxy chose a route, like most scanner probes
+    routeNone = 4
+
+    idSize = 8
+)
+
+var routeNames = []string{"normal", "hidden", "silent", "tarpit", "none"}
+
+type interval struct {
+    index uint64
+    up uint64
+    down uint64
+}
+
+type connection struct {
+    accept uint64
+    route uint64
+    close uint64
+    kind uint64
+    closed bool
+    intervals []interval
+}
+
+type recording struct {
+    interval uint64
+    connections []*connection
+}
+
+func main() {
+    file := flag.String("file", "", "The recording to replay.")
+    generate := flag.String("generate", "", "Write a synthetic recording to this file instead.")
+    compare := flag.String("compare", "", "Compare the --file with this recording instead.")
+    connections := flag.Int("connections", 200, "Amount of connections of a synthetic recording.")
+    duration := flag.Duration("duration", 5 * time.Second, "Length of a synthetic recording.")
+    port := flag.Int("port", 4000, "Port of the proxy to connect to.")
+    normalPort := flag.Int("normalPort", 4001, "Port to run the normal stub backend on.")
+    hiddenPort := flag.Int("hiddenPort", 4002, "Port to run the hidden stub backend on.")
+    knock := flag.String("knock", "PASSWORD", "The knock of the proxy.")
+    knockTimeout := flag.Duration("knockTimeout", time.Second, "The knock timeout of the proxy, silent connections wait this long.")
+    tarpit := flag.String("tarpit", "SSH-2.0-", "What connections that were tarpitted send.")
+    speed := flag.Float64("speed", 1, "How much faster than recorded to replay.")
+    flag.Parse()
+
+    if *generate != "" {
+        if err := write(*generate, synthetic(*connections, *duration, *knockTimeout)); err != nil {
+            fail(err)
+        }
+        fmt.Printf("wrote %d connections to %s\n", *connections, *generate)
+        return
+    }
+    original, err := read(*file)
+    if err != nil {
+        fail(err)
+    }
+    if *compare != "" {
+        replayed, err := read(*compare)
+        if err != nil {
+            fail(err)
+        }
+        if err := same(summarize(original), summarize(replayed)); err != nil {
+            fail(err)
+        }
+        fmt.Println("OK")
+        return
+    }
+    replay(original, *port, *normalPort, *hiddenPort, []byte(*knock), []byte(*tarpit), *knockTimeout, *speed)
+}
+
+func fail(err error) {
+    fmt.Println("ERROR", err)
+    os.Exit(1)
+}
+
+/*
+ * the file format, see knock-record.h
+ */
+
+func read(path string) (*recording, error) {
+    f, err := os.Open(path)
+    if err != nil {
+        return nil, err
+    }
+    defer f.Close()
+    r := bufio.NewReader(f)
+    header := make([]byte, len(magic))
+    if _, err := io.ReadFull(r, header); err != nil || string(header) != magic {
+        return nil, fmt.Errorf("%s is not a recording", path)
+    }
+    result := &recording{}
+    if result.interval, err = binary.ReadUvarint(r); err != nil || result.interval == 0 {
+        return nil, fmt.Errorf("%s has no interval", path)
+    }
+    numbers := map[byte]int{eventAccept: 2, eventRoute: 3, eventBytes: 4, eventClose: 2}
+    for {
+        event, err := r.ReadByte()
+        if err == io.EOF {
+            break
+        }
+        if numbers[event] == 0 {
+            return nil, fmt.Errorf("unknown event %d in %s", event, path)
+        }
+        values := make([]uint64, numbers[event])
+        for i := range values {
+            if values[i], err = binary.ReadUvarint(r); err != nil {
+                break
+            }
+        }
+        if err != nil {
+            // the proxy was still writing (or was killed), keep what is complete
+            break
+        }
+        if event == eventAccept {
+            if values[0] != uint64(len(result.connections)) {
+                return nil, fmt.Errorf("connection %d accepted out of order in %s", values[0], path)
+            }
+            result.connections = append(result.connections, &connection{accept: values[1], kind: routeNone})
+            continue
+        }
+        if values[0] >= uint64(len(result.connections)) {
+            return nil, fmt.Errorf("event for unknown connection %d in %s", values[0], path)
+        }
+        c := result.connections[values[0]]
+        switch event {
+        case eventRoute:
+            c.route, c.kind = values[1], values[2]
+        case eventBytes:
+            c.intervals = append(c.intervals, interval{values[1], values[2], values[3]})
+        case eventClose:
+            c.close, c.closed = values[1], true
+        }
+    }
+    return result, nil
+}
+
+func write(path string, rec *recording) error {
+    f, err := os.Create(path)
+    if err != nil {
+        return err
+    }
+    w := bufio.NewWriter(f)
+    w.WriteString(magic)
+    number := make([]byte, binary.MaxVarintLen64)
+    event := func(kind byte, values ...uint64) {
+        w.WriteByte(kind)
+        for _, value := range values {
+            w.Write(number[:binary.PutUvarint(number, value)])
+        }
+    }
+    w.Write(number[:binary.PutUvarint(number, rec.interval)])
+    for i, c := range rec.connections {
+        id := uint64(i)
+        event(eventAccept, id, c.accept)
+        if c.kind != routeNone {
+            event(eventRoute, id, c.route, c.kind)
+        }
+        for _, step := range c.intervals {
+            event(eventBytes, id, step.index, step.up, step.down)
+        }
+        event(eventClose, id, c.close)
+    }
+    if err := w.Flush(); err != nil {
+        f.Close()
+        return err
+    }
+    return f.Close()
+}
+
+// a mix of page loads, interactive sessions on the hidden route, protocols
+// where the server talks first and scanner probes
+func synthetic(count int, duration time.Duration, knockTimeout time.Duration) *recording {
+    r := rand.New(rand.NewSource(1))
+    rec := &recording{interval: 100}
+    for i := 0; i < count; i++ {
+        c := &connection{accept: uint64(r.Int63n(duration.Milliseconds())), closed: true}
+        switch p := r.Intn(100); {
+        case p < 60:
+            c.kind, c.route = routeNormal, c.accept + uint64(1 + r.Intn(20))
+            start := c.route / rec.interval
+            c.intervals = append(c.intervals, interval{start, uint64(300 + r.Intn(500)), 0})
+            steps := uint64(1 + r.Intn(3))
+            for k := uint64(1); k <= steps; k++ {
+                c.intervals = append(c.intervals, interval{start + k, 0, uint64(10000 + r.Intn(100000))})
+            }
+            c.close = (start + steps + uint64(1 + r.Intn(10))) * rec.interval
+        case p < 75:
+            c.kind, c.route = routeHidden, c.accept + uint64(1 + r.Intn(5))
+            index := c.route / rec.interval
+            for k := 0; k < 5 + r.Intn(15); k++ {
+                index += uint64(1 + r.Intn(3))
+                c.intervals = append(c.intervals, interval{index, uint64(30 + r.Intn(70)), uint64(30 + r.Intn(500))})
+            }
+            c.close = (index + 1) * rec.interval
+        case p < 85:
+            c.kind, c.route = routeSilent, c.accept + uint64(knockTimeout.Milliseconds())
+            index := c.route / rec.interval
+            c.intervals = append(c.intervals, interval{index, 0, uint64(20 + r.Intn(40))})
+            c.intervals = append(c.intervals, interval{index + 1, uint64(100 + r.Intn(1000)), uint64(100 + r.Intn(5000))})
+            c.close = (index + 2) * rec.interval
+        default:
+            c.kind = routeNone
+            c.close = c.accept + uint64(50 + r.Intn(250))
+        }
+        rec.connections = append(rec.connections, c)
+    }
+    sort.Slice(rec.connections, func(i, j int) bool { return rec.connections[i].accept < rec.connections[j].accept })
+    return rec
+}
+
+/*
+ * replaying
+ */
+
+type replayer struct {
+    rec *recording
+    started time.Time
+    speed float64
+    sent int64
+    received int64
+    lateMs int64
+}
+
+func (p *replayer) at(ms uint64) time.Time {
+    return p.started.Add(time.Duration(float64(ms) / p.speed * float64(time.Millisecond)))
+}
+
+func (p *replayer) wait(ms uint64) {
+    time.Sleep(time.Until(p.at(ms)))
+}
+
+// waits for the time of a new connection, and remembers how late it was
+func (p *replayer) waitToConnect(ms uint64) {
+    late := time.Since(p.at(ms))
+    if late < 0 {
+        time.Sleep(-late)
+    }
+    for late := late.Milliseconds(); late > 0; {
+        current := atomic.LoadInt64(&p.lateMs)
+        if late <= current || atomic.CompareAndSwapInt64(&p.lateMs, current, late) {
+            break
+        }
+    }
+}
+
+func (c *connection) end(rec *recording) uint64 {
+    if c.closed {
+        return c.close
+    }
+    last := c.accept
+    if len(c.intervals) > 0 {
+        last = (c.intervals[len(c.intervals) - 1].index + 1) * rec.interval
+    }
+    return last
+}
+
+func replay(rec *recording, port int, normalPort int, hiddenPort int, knock []byte, tarpit []byte, knockTimeout time.Duration, speed float64) {
+    p := &replayer{rec: rec, speed: speed}
+    for _, backendPort := range []int{normalPort, hiddenPort} {
+        l, err := net.Listen("tcp", ":" + strconv.Itoa(backendPort))
+        if err != nil {
+            fail(err)
+        }
+        go p.backend(l)
+    }
+    // from the first connection on, not from when the proxy was started
+    var first uint64
+    if len(rec.connections) > 0 {
+        first = rec.connections[0].accept
+        for _, c := range rec.connections {
+            if c.accept < first {
+                first = c.accept
+            }
+        }
+    }
+    p.started = time.Now().Add(100 * time.Millisecond - time.Duration(float64(first) / speed * float64(time.Millisecond)))
+
+    var wg sync.WaitGroup
+    var failures int64
+    counts := make([]int, len(routeNames))
+    for i, c := range rec.connections {
+        if c.kind < uint64(len(counts)) {
+            counts[c.kind]++
+        }
+        wg.Add(1)
+        go func(id uint64, c *connection) {
+            defer wg.Done()
+            if err := p.client(id, c, port, knock, tarpit, knockTimeout); err != nil {
+                if atomic.AddInt64(&failures, 1) <= 10 {
+                    fmt.Printf("connection %d (%s): %v\n", id, routeNames[c.kind], err)
+                }
+            }
+        }(uint64(i), c)
+    }
+    wg.Wait()
+    fmt.Printf("replayed %d connections in %.1f s at %gx: ", len(rec.connections), time.Since(p.started).Seconds(), speed)
+    for kind, count := range counts {
+        fmt.Printf("%d %s, ", count, routeNames[kind])
+    }
+    fmt.Printf("%.1f MB up, %.1f MB down, at most %d ms late\n", float64(p.sent) / 1e6, float64(p.received) / 1e6, p.lateMs)
+    if failures > 0 {
+        fail(fmt.Errorf("%d connections did not replay", failures))
+    }
+    fmt.Println("OK")
+}
+
+func (p *replayer) client(id uint64, c *connection, port int, knock []byte, tarpit []byte, knockTimeout time.Duration) error {
+    p.waitToConnect(c.accept)
+    conn, err := net.Dial("tcp", ":" + strconv.Itoa(port))
+    if err != nil {
+        return err
+    }
+    defer conn.Close()
+    dialed := time.Now()
+    if c.kind == routeNone || c.kind == routeTarpit {
+        if c.kind == routeTarpit {
+            p.wait(c.route)
+            if _, err := conn.Write(tarpit); err != nil {
+                return err
+            }
+        }
+        p.wait(c.end(p.rec))
+        return nil
+    }
+
+    p.wait(c.route)
+    if c.kind == routeSilent {
+        // it should still be silent when the proxy gives up on the knock
+        time.Sleep(time.Until(dialed.Add(knockTimeout + 200 * time.Millisecond)))
+    }
+    first := make([]byte, idSize)
+    binary.BigEndian.PutUint64(first, id)
+    if c.kind == routeHidden {
+        first = append(append([]byte{}, knock...), first...)
+    }
+    if _, err := conn.Write(first); err != nil {
+        return err
+    }
+    var expected uint64
+    for _, step := range c.intervals {
+        expected += step.down
+    }
+    // the proxy closes both sides when one does, so the client can only close when it has everything
+    var received uint64
+    complete := make(chan struct{})
+    go func() {
+        buffer := make([]byte, 64 * 1024)
+        for {
+            n, err := conn.Read(buffer)
+            atomic.AddInt64(&p.received, int64(n))
+            if atomic.AddUint64(&received, uint64(n)) >= expected || err != nil {
+                close(complete)
+                return
+            }
+        }
+    }()
+
+    // the id counts as the first bytes the client sent
+    skip := uint64(idSize)
+    for _, step := range c.intervals {
+        up := step.up
+        if skip > 0 {
+            taken := skip
+            if taken > up {
+                taken = up
+            }
+            up -= taken
+            skip -= taken
+        }
+        if up == 0 {
+            continue
+        }
+        p.wait(step.index * p.rec.interval)
+        if err := writeZeros(conn, up); err != nil {
+            return err
+        }
+        atomic.AddInt64(&p.sent, int64(up))
+    }
+    p.wait(c.end(p.rec))
+    if expected > 0 {
+        select {
+        case <-complete:
+        case <-time.After(10 * time.Second):
+        }
+    }
+    if n := atomic.LoadUint64(&received); n != expected {
+        return fmt.Errorf("received %d of the %d bytes", n, expected)
+    }
+    return nil
+}
+
+// reads the id, sends what the recorded backend sent, and closes once the client did
+func (p *replayer) backend(l net.Listener) {
+    for {
+        conn, err := l.Accept()
+        if err != nil {
+            return
+        }
+        go func() {
+            defer conn.Close()
+            first := make([]byte, idSize)
+            if _, err := io.ReadFull(conn, first); err != nil {
+                return
+            }
+            id := binary.BigEndian.Uint64(first)
+            if id >= uint64(len(p.rec.connections)) {
+                return
+            }
+            done := make(chan struct{})
+            go func() {
+                io.Copy(io.Discard, conn)
+                close(done)
+            }()
+            for _, step := range p.rec.connections[id].intervals {
+                if step.down == 0 {
+                    continue
+                }
+                time.Sleep(time.Until(p.at(step.index * p.rec.interval)))
+                if err := writeZeros(conn, step.down); err != nil {
+                    return
+                }
+            }
+            <-done
+        }()
+    }
+}
+
+var zeros = make([]byte, 64 * 1024)
+
+func writeZeros(conn net.Conn, size uint64) error {
+    for size > 0 {
+        chunk := uint64(len(zeros))
+        if chunk > size {
+            chunk = size
+        }
+        if _, err := conn.Write(zeros[:chunk]); err != nil {
+            return err
+        }
+        size -= chunk
+    }
+    return nil
+}
+
+/*
+ * comparing
+ */
+
+type summary struct {
+    connections [5]int
+    up [5]uint64
+    down [5]uint64
+}
+
+func summarize(rec *recording) summary {
+    var result summary
+    for _, c := range rec.connections {
+        if c.kind >= uint64(len(result.connections)) {
+            continue
+        }
+        result.connections[c.kind]++
+        for _, step := range c.intervals {
+            result.up[c.kind] += step.up
+            result.down[c.kind] += step.down
+        }
+    }
+    return result
+}
+
+// the same connections per route, and about the same bytes (the replay adds its ids)
+func same(original summary, replayed summary) error {
+    for kind, name := range routeNames {
+        fmt.Printf("%s: %d connections, %d bytes up, %d down; replayed %d connections, %d bytes up, %d down\n", name,
+            original.connections[kind], original.up[kind], original.down[kind],
+            replayed.connections[kind], replayed.up[kind], replayed.down[kind])
+    }
+    for kind, name := range routeNames {
+        if original.connections[kind] != replayed.connections[kind] {
+            return fmt.Errorf("%d %s connections were replayed as %d", original.connections[kind], name, replayed.connections[kind])
+        }
+        slack := uint64(idSize * original.connections[kind])
+        if !near(original.up[kind], replayed.up[kind], slack) || !near(original.down[kind], replayed.down[kind], 0) {
+            return fmt.Errorf("the bytes of the %s connections differ", name)
+        }
+    }
+    return nil
+}
+
+func near(a uint64, b uint64, slack uint64) bool {
+    difference := float64(a) - float64(b)
+    if difference < 0 {
+        difference = -difference
+    }
+    return difference <= float64(slack) + 0.01 * float64(a)
+}
@@ -0,0 +1,223 @@
+package main
+
+import (
+    "flag"
+    "fmt"
+    "io"
+    "io/ioutil"
+    "net"
+    "os"
+    "strconv"
+    "strings"
+    "sync"
+    "time"
+)
+
+// Measures what idle connections cost the proxy, per route, in steps up to
+// C100K: resident memory of the proxy, kernel slab memory, descriptors
+// (and how many of them are pipes) and the CPU the event loop uses while
+// all of them are idle. Prints a csv curve, and fails if a connection costs
+// more memory than the budget.
+//
+// The slab memory is that of the whole machine, so it also contains the
+// sockets of this test on the other side of the proxy.
+//
+// Start the proxy with its normal and hidden port pointing to --normalPort
+// and --hiddenPort, and a --proxyTimeout longer than the test, for example:
+//    ./l7knockknock --normalPort=5544 --hiddenPort=5545 --listenPort=6633 --proxyTimeout=600 PASSWORD &
+//    go run test/scaling.go --port 6633 --normalPort 5544 --hiddenPort 5545 --knock PASSWORD --pid $!
+// Every connection needs a descriptor on both sides of the proxy in this
+// test, and four more in the proxy, so raise the limits accordingly.
+func main() {
+    port := flag.Int("port", 4000, "Port of the proxy to connect to.")
+    normalPort := flag.Int("normalPort", 4001, "Port to run the normal echo backend on.")
+    hiddenPort := flag.Int("hiddenPort", 4002, "Port to run the hidden echo backend on.")
+    knock := flag.String("knock", "PASSWORD", "The knock of the proxy.")
+    tarpit := flag.String("tarpit", "", "A tarpit fingerprint of the proxy, to also measure tarpitted connections.")
+    pid := flag.Int("pid", 0, "Pid of the proxy to measure.")
+    steps := flag.String("connections", "1000,10000,50000,100000", "Amount of idle connections to measure with")
+    idle := flag.Duration("idle", 3 * time.Second, "How long to measure the CPU use of the idle proxy")
+    budget := flag.Int("budget", 32 * 1024, "Maximum bytes of memory (proxy and slab) per connection")
+    parallel := flag.Int("parallel", 64, "Amount of connections to open at the same time")
+    flag.Parse()
+
+    for _, backendPort := range []int{*normalPort, *hiddenPort} {
+        l, err := net.Listen("tcp", ":" + strconv.Itoa(backendPort))
+        if err != nil {
+            fmt.Println("ERROR", err)
+            os.Exit(1)
+        }
+        go echoBackend(l)
+    }
+
+    routes := map[string][]byte{
+        "normal": []byte("GET / HTTP/1.1\r\n"),
+        "hidden": []byte(*knock + "x"),
+    }
+    order := []string{"normal", "hidden"}
+    if *tarpit != "" {
+        routes["tarpit"] = []byte(*tarpit)
+        order = append(order, "tarpit")
+    }
+
+    failed := false
+    fmt.Println("route,connections,rss_kb,slab_kb,fds,pipes,idle_cpu_ms_per_s,bytes_per_connection")
+    for _, route := range order {
+        baseline := measure(*pid, 0)
+        var conns []net.Conn
+        for _, step := range strings.Split(*steps, ",") {
+            wanted, err := strconv.Atoi(step)
+            if err != nil {
+                fmt.Println("ERROR", err)
+                os.Exit(1)
+            }
+            conns = append(conns, open(*port, routes[route], route != "tarpit", wanted - len(conns), *parallel)...)
+            time.Sleep(500 * time.Millisecond)
+
+            current := measure(*pid, *idle)
+            perConnection := ((current.rss - baseline.rss) + (current.slab - baseline.slab)) * 1024 / len(conns)
+            fmt.Printf("%s,%d,%d,%d,%d,%d,%.2f,%d\n", route, len(conns), current.rss, current.slab, current.fds, current.pipes, current.cpu, perConnection)
+            if perConnection > *budget {
+                fmt.Printf("ERROR %s connections use %d bytes each, more than the budget of %d\n", route, perConnection, *budget)
+                failed = true
+            }
+        }
+        for _, conn := range conns {
+            conn.Close()
+        }
+        // give the proxy time to close its side
+        time.Sleep(time.Second)
+    }
+    if failed {
+        os.Exit(1)
+    }
+}
+
+// opens connections that send their first data and then stay idle
+func open(port int, first []byte, echoed bool, amount int, parallel int) []net.Conn {
+    result := make([]net.Conn, amount)
+    var wg sync.WaitGroup
+    next := make(chan int)
+    for w := 0; w < parallel; w++ {
+        wg.Add(1)
+        go func() {
+            defer wg.Done()
+            buffer := make([]byte, 1)
+            for i := range next {
+                conn, err := net.Dial("tcp", ":" + strconv.Itoa(port))
+                if err == nil {
+                    _, err = conn.Write(first)
+                }
+                if err == nil && echoed {
+                    // wait for the echo of the last byte, so the backend connection exists
+                    _, err = io.ReadFull(conn, buffer)
+                    if err == nil && buffer[0] != first[len(first) - 1] {
+                        err = fmt.Errorf("unexpected echo %q", buffer)
+                    }
+                }
+                if err != nil {
+                    fmt.Println("ERROR", err)
+                    os.Exit(1)
+                }
+                result[i] = conn
+            }
+        }()
+    }
+    for i := 0; i < amount; i++ {
+        next <- i
+    }
+    close(next)
+    wg.Wait()
+    return result
+}
+
+func echoBackend(l net.Listener) {
+    for {
+        conn, err := l.Accept()
+        if err != nil {
+            return
+        }
+        go func() {
+            defer conn.Close()
+            buffer := make([]byte, 64)
+            for {
+                n, err := conn.Read(buffer)
+                if err != nil {
+                    return
+                }
+                // only echo the last byte, the hidden backend doesn't get the knock
+                if _, err := conn.Write(buffer[n - 1:n]); err != nil {
+                    return
+                }
+            }
+        }()
+    }
+}
+
+type measurement struct {
+    rss int
+    slab int
+    fds int
+    pipes int
+    cpu float64
+}
+
+func measure(pid int, idle time.Duration) measurement {
+    var result measurement
+    result.rss = procField("/proc/" + strconv.Itoa(pid) + "/status", "VmRSS:")
+    result.slab = procField("/proc/meminfo", "Slab:")
+
+    fdDir := "/proc/" + strconv.Itoa(pid) + "/fd"
+    fds, err := ioutil.ReadDir(fdDir)
+    if err != nil {
+        fmt.Println("ERROR", err)
+        os.Exit(1)
+    }
+    result.fds = len(fds)
+    for _, fd := range fds {
+        if target, err := os.Readlink(fdDir + "/" + fd.Name()); err == nil && strings.HasPrefix(target, "pipe:") {
+            result.pipes++
+        }
+    }
+
+    if idle > 0 {
+        before := cpuTicks(pid)
+        time.Sleep(idle)
+        used := time.Duration(cpuTicks(pid) - before) * 10 * time.Millisecond
+        result.cpu = float64(used.Milliseconds()) / idle.Seconds()
+    }
+    return result
+}
+
+// a field in kB of a /proc file like /proc/meminfo
+func procField(file string, name string) int {
+    content, err := ioutil.ReadFile(file)
+    if err != nil {
+        fmt.Println("ERROR", err)
+        os.Exit(1)
+    }
+    for _, line := range strings.Split(string(content), "\n") {
+        if strings.HasPrefix(line, name) {
+            fields := strings.Fields(line)
+            value, _ := strconv.Atoi(fields[1])
+            return value
+        }
+    }
+    fmt.Println("ERROR", name, "not found in", file)
+    os.Exit(1)
+    return 0
+}
+
+// user + system time of the process, in clock ticks (USER_HZ = 100)
+func cpuTicks(pid int) int {
+    stat, err := ioutil.ReadFile("/proc/" + strconv.Itoa(pid) + "/stat")
+    if err != nil {
+        fmt.Println("ERROR", err)
+        os.Exit(1)
+    }
+    // skip past the command name, it might contain spaces
+    fields := strings.Fields(string(stat[strings.LastIndexByte(string(stat), ')') + 2:]))
+    utime, _ := strconv.Atoi(fields[11])
+    stime, _ := strconv.Atoi(fields[12])
+    return utime + stime
+}
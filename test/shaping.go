@@ -0,0 +1,137 @@
+package main
+
+import (
+    "flag"
+    "fmt"
+    "io"
+    "net"
+    "os"
+    "strconv"
+    "sync"
+    "sync/atomic"
+    "time"
+)
+
+// Checks the rate limits of the proxy: a single download on the normal
+// route is limited to the connection rate, several of them together to the
+// route rate, and meanwhile a download on the (unlimited) hidden route is
+// still fast.
+//
+// Start the proxy with limits on the normal route only, for example:
+//    ./l7knockknock --normalPort=5544 --hiddenPort=5545 --listenPort=6633 --rateLimit=normal:512:256 PASSWORD &
+//    go run test/shaping.go --port 6633 --normalPort 5544 --hiddenPort 5545 --knock PASSWORD --routeRate 512 --connectionRate 256
+func main() {
+    port := flag.Int("port", 4000, "Port of the proxy to connect to.")
+    normalPort := flag.Int("normalPort", 4001, "Port to run the normal backend on.")
+    hiddenPort := flag.Int("hiddenPort", 4002, "Port to run the hidden backend on.")
+    knock := flag.String("knock", "PASSWORD", "The knock of the proxy.")
+    routeRate := flag.Int("routeRate", 512, "Rate limit of the normal route in KB/s.")
+    connectionRate := flag.Int("connectionRate", 256, "Rate limit of a normal connection in KB/s.")
+    downloads := flag.Int("downloads", 4, "Amount of downloads at the same time on the normal route.")
+    duration := flag.Duration("duration", 2 * time.Second, "How long to measure.")
+    flag.Parse()
+
+    for _, backendPort := range []int{*normalPort, *hiddenPort} {
+        l, err := net.Listen("tcp", ":" + strconv.Itoa(backendPort))
+        if err != nil {
+            fail(err)
+        }
+        go downloadBackend(l)
+    }
+
+    single := measure(*port, []byte("GET"), 1, *duration)
+    fmt.Printf("one normal download: %.0f KB/s\n", single)
+    check("one normal download", single, *connectionRate)
+
+    var wg sync.WaitGroup
+    var hidden float64
+    wg.Add(1)
+    go func() {
+        defer wg.Done()
+        // let the normal downloads get going first
+        time.Sleep(*duration / 4)
+        hidden = measure(*port, []byte(*knock), 1, *duration / 2)
+    }()
+    total := measure(*port, []byte("GET"), *downloads, *duration)
+    wg.Wait()
+    fmt.Printf("%d normal downloads: %.0f KB/s, hidden download meanwhile: %.0f KB/s\n", *downloads, total, hidden)
+    expected := *routeRate
+    if *downloads * *connectionRate < expected {
+        expected = *downloads * *connectionRate
+    }
+    check("normal downloads together", total, expected)
+    if hidden < float64(4 * *routeRate) {
+        fail(fmt.Errorf("the hidden route got %.0f KB/s, it is not limited and should be faster", hidden))
+    }
+    fmt.Println("OK")
+}
+
+func fail(err error) {
+    fmt.Println("ERROR", err)
+    os.Exit(1)
+}
+
+// the rate may not be more than the limit, but also not far below it
+func check(what string, rate float64, limit int) {
+    if rate > float64(limit) * 1.25 || rate < float64(limit) * 0.5 {
+        fail(fmt.Errorf("%s got %.0f KB/s, the limit is %d KB/s", what, rate, limit))
+    }
+}
+
+// KB/s received by the downloads together, after the first burst
+func measure(port int, first []byte, downloads int, duration time.Duration) float64 {
+    var received int64
+    var counting int32
+    var wg sync.WaitGroup
+    stop := time.Now().Add(duration + duration / 4)
+    for i := 0; i < downloads; i++ {
+        conn, err := net.Dial("tcp", ":" + strconv.Itoa(port))
+        if err != nil {
+            fail(err)
+        }
+        if _, err := conn.Write(first); err != nil {
+            fail(err)
+        }
+        wg.Add(1)
+        go func() {
+            defer wg.Done()
+            defer conn.Close()
+            conn.SetReadDeadline(stop)
+            buffer := make([]byte, 64 * 1024)
+            for {
+                n, err := conn.Read(buffer)
+                if atomic.LoadInt32(&counting) == 1 {
+                    atomic.AddInt64(&received, int64(n))
+                }
+                if err != nil {
+                    return
+                }
+            }
+        }()
+    }
+    time.Sleep(duration / 4)
+    atomic.StoreInt32(&counting, 1)
+    started := time.Now()
+    wg.Wait()
+    return float64(atomic.LoadInt64(&received)) / 1024 / time.Since(started).Seconds()
+}
+
+// sends as much as the client will take
+func downloadBackend(l net.Listener) {
+    data := make([]byte, 64 * 1024)
+    for {
+        conn, err := l.Accept()
+        if err != nil {
+            return
+        }
+        go func() {
+            defer conn.Close()
+            go io.Copy(io.Discard, conn)
+            for {
+                if _, err := conn.Write(data); err != nil {
+                    return
+                }
+            }
+        }()
+    }
+}
@@ -0,0 +1,290 @@
+package main
+
+import (
+    "bytes"
+    "flag"
+    "fmt"
+    "io"
+    "io/ioutil"
+    "math/rand"
+    "net"
+    "os"
+    "strconv"
+    "strings"
+    "sync"
+    "sync/atomic"
+    "time"
+)
+
+// Drives a lot of connections with a mix of routes, timeouts, resets and
+// failing backends through the proxy, in rounds. After every round it waits
+// until the proxy timed out everything that was left, and samples the
+// descriptors, the pipes among them (the splice engine has two for every
+// proxy), resident memory and heap (VmData) of the proxy. Any descriptor or
+// pipe more than before the first round is a leak, and so is memory that
+// grew in every round after the first.
+//
+// Start the proxy with short timeouts, so that the rounds can be short:
+//    ./l7knockknock --normalPort=5544 --hiddenPort=5545 --listenPort=6633 --proxyTimeout=1 --knockTimeout=1 PASSWORD &
+//    go run test/soak.go --port 6633 --normalPort 5544 --hiddenPort 5545 --knock PASSWORD --pid $!
+func main() {
+    port := flag.Int("port", 4000, "Port of the proxy to connect to.")
+    normalPort := flag.Int("normalPort", 4001, "Port to run the normal echo backend on.")
+    hiddenPort := flag.Int("hiddenPort", 4002, "Port to run the hidden echo backend on.")
+    knock := flag.String("knock", "PASSWORD", "The knock of the proxy.")
+    pid := flag.Int("pid", 0, "Pid of the proxy to monitor.")
+    connections := flag.Int("connections", 1000000, "Amount of connections to make in total")
+    rounds := flag.Int("rounds", 20, "Amount of rounds to split the connections in")
+    parallel := flag.Int("parallel", 100, "Amount of connections at the same time")
+    timeouts := flag.Int("timeouts", 2, "Seconds it takes the proxy to time out a connection (knock plus proxy timeout)")
+    maxGrowth := flag.Int("maxGrowth", 0, "KB the proxy may grow after the first round, when it grew in every round")
+    flag.Parse()
+
+    for _, backendPort := range []int{*normalPort, *hiddenPort} {
+        l, err := net.Listen("tcp", ":" + strconv.Itoa(backendPort))
+        if err != nil {
+            fmt.Println("ERROR", err)
+            os.Exit(1)
+        }
+        go echoBackend(l)
+    }
+
+    quiet := time.Duration(*timeouts + 2) * time.Second
+    baseline := sample(*pid)
+    var samples []proxyState
+    var failures int64
+    fmt.Println("round,connections,seconds,max_fds,max_pipes,fds,pipes,rss_kb,data_kb")
+    for round := 1; round <= *rounds; round++ {
+        started := time.Now()
+        maxFds, maxPipes := int64(0), int64(0)
+        done := make(chan bool)
+        go func() {
+            for {
+                select {
+                case <-done:
+                    return
+                case <-time.After(100 * time.Millisecond):
+                    current := sample(*pid)
+                    if fds := int64(current.fds); fds > atomic.LoadInt64(&maxFds) {
+                        atomic.StoreInt64(&maxFds, fds)
+                    }
+                    if pipes := int64(current.pipes); pipes > atomic.LoadInt64(&maxPipes) {
+                        atomic.StoreInt64(&maxPipes, pipes)
+                    }
+                }
+            }
+        }()
+
+        var wg, waiting sync.WaitGroup
+        report := func(err error) {
+            if err != nil && atomic.AddInt64(&failures, 1) <= 10 {
+                fmt.Println("ERROR", err)
+            }
+        }
+        next := make(chan int64)
+        for w := 0; w < *parallel; w++ {
+            wg.Add(1)
+            go func() {
+                defer wg.Done()
+                for seed := range next {
+                    wait, err := lifecycle(*port, *knock, rand.New(rand.NewSource(seed)), quiet)
+                    report(err)
+                    if wait != nil {
+                        // don't keep a worker busy while the proxy times it out
+                        waiting.Add(1)
+                        go func() {
+                            defer waiting.Done()
+                            report(wait())
+                        }()
+                    }
+                }
+            }()
+        }
+        perRound := *connections / *rounds
+        for i := 0; i < perRound; i++ {
+            next <- int64(round * perRound + i)
+        }
+        close(next)
+        wg.Wait()
+        waiting.Wait()
+        close(done)
+        took := time.Since(started)
+
+        // everything the clients left open has to time out
+        time.Sleep(quiet)
+        current := sample(*pid)
+        samples = append(samples, current)
+        fmt.Printf("%d,%d,%.1f,%d,%d,%d,%d,%d,%d\n", round, round * perRound, took.Seconds(), atomic.LoadInt64(&maxFds), atomic.LoadInt64(&maxPipes), current.fds, current.pipes, current.rss, current.data)
+
+        if current.fds > baseline.fds {
+            fmt.Printf("ERROR the proxy has %d descriptors open, %d more than before\n", current.fds, current.fds - baseline.fds)
+            os.Exit(1)
+        }
+        if current.pipes > baseline.pipes {
+            fmt.Printf("ERROR the proxy has %d pipes open, %d more than before\n", current.pipes, current.pipes - baseline.pipes)
+            os.Exit(1)
+        }
+    }
+    if failures > 0 {
+        fmt.Printf("ERROR %d connections did not behave as expected\n", failures)
+        os.Exit(1)
+    }
+    if len(samples) > 2 {
+        // the first round warms up the allocator
+        rssGrows, dataGrows := true, true
+        for i := 2; i < len(samples); i++ {
+            rssGrows = rssGrows && samples[i].rss > samples[i - 1].rss
+            dataGrows = dataGrows && samples[i].data > samples[i - 1].data
+        }
+        last := samples[len(samples) - 1]
+        if rssGrows && last.rss - samples[0].rss > *maxGrowth {
+            fmt.Printf("ERROR the RSS of the proxy grew every round, from %d KB to %d KB\n", samples[0].rss, last.rss)
+            os.Exit(1)
+        }
+        if dataGrows && last.data - samples[0].data > *maxGrowth {
+            fmt.Printf("ERROR the heap of the proxy grew every round, from %d KB to %d KB\n", samples[0].data, last.data)
+            os.Exit(1)
+        }
+    }
+    fmt.Println("OK")
+}
+
+const resetMarker = "RESET"
+
+// one connection, with behavior picked at random, connections that wait for
+// the proxy to close them return a function that does the waiting
+func lifecycle(port int, knock string, r *rand.Rand, quiet time.Duration) (func() error, error) {
+    conn, err := net.Dial("tcp", ":" + strconv.Itoa(port))
+    if err != nil {
+        return nil, err
+    }
+    conn.SetDeadline(time.Now().Add(quiet + 5 * time.Second))
+    waitForClose := func(what string) func() error {
+        return func() error {
+            defer conn.Close()
+            if _, err := io.Copy(ioutil.Discard, conn); isTimeout(err) {
+                return fmt.Errorf("%s: %v", what, err)
+            }
+            return nil
+        }
+    }
+
+    payload := make([]byte, len(resetMarker) + r.Intn(32 * 1024))
+    r.Read(payload)
+    if bytes.HasPrefix(payload, []byte(resetMarker)) {
+        payload[0] = 'x'
+    }
+    kind := r.Intn(100)
+    switch {
+    case kind < 40:
+        // normal route
+        defer conn.Close()
+        return nil, echo(conn, payload, payload)
+    case kind < 70:
+        // hidden route
+        defer conn.Close()
+        return nil, echo(conn, append([]byte(knock), payload...), payload)
+    case kind < 80:
+        // the client resets halfway
+        defer conn.Close()
+        if _, err := conn.Write(payload[:len(payload) / 2 + 1]); err != nil {
+            return nil, err
+        }
+        return nil, conn.(*net.TCPConn).SetLinger(0)
+    case kind < 85:
+        // the backend resets halfway
+        conn.Write(append([]byte(resetMarker), payload...))
+        return waitForClose("proxy did not close after the backend reset"), nil
+    case kind < 90:
+        // never sends anything, the proxy has to time it out
+        return waitForClose("idle connection was not closed by the proxy"), nil
+    case kind < 95:
+        // only the start of the knock
+        conn.Write([]byte(knock[:len(knock) / 2]))
+        return waitForClose("connection with half a knock was not closed by the proxy"), nil
+    default:
+        // closes before sending anything
+        return nil, conn.Close()
+    }
+}
+
+func echo(conn net.Conn, send []byte, expected []byte) error {
+    go conn.Write(send)
+    received := make([]byte, len(expected))
+    if _, err := io.ReadFull(conn, received); err != nil {
+        return err
+    }
+    if !bytes.Equal(received, expected) {
+        return fmt.Errorf("received different bytes than were send")
+    }
+    return nil
+}
+
+func isTimeout(err error) bool {
+    netErr, ok := err.(net.Error)
+    return ok && netErr.Timeout()
+}
+
+func echoBackend(l net.Listener) {
+    for {
+        conn, err := l.Accept()
+        if err != nil {
+            return
+        }
+        go func() {
+            defer conn.Close()
+            start := make([]byte, len(resetMarker))
+            n, err := io.ReadFull(conn, start)
+            if err == nil && string(start) == resetMarker {
+                conn.(*net.TCPConn).SetLinger(0)
+                return
+            }
+            if _, err := conn.Write(start[:n]); err != nil {
+                return
+            }
+            io.Copy(conn, conn)
+        }()
+    }
+}
+
+type proxyState struct {
+    fds int
+    pipes int
+    rss int
+    data int
+}
+
+func sample(pid int) proxyState {
+    var result proxyState
+    fds, err := ioutil.ReadDir("/proc/" + strconv.Itoa(pid) + "/fd")
+    if err != nil {
+        fmt.Println("ERROR", err)
+        os.Exit(1)
+    }
+    result.fds = len(fds)
+    for _, fd := range fds {
+        // a descriptor closed since the listing has no link anymore
+        if target, err := os.Readlink("/proc/" + strconv.Itoa(pid) + "/fd/" + fd.Name()); err == nil && strings.HasPrefix(target, "pipe:") {
+            result.pipes++
+        }
+    }
+    status, err := ioutil.ReadFile("/proc/" + strconv.Itoa(pid) + "/status")
+    if err != nil {
+        fmt.Println("ERROR", err)
+        os.Exit(1)
+    }
+    for _, line := range strings.Split(string(status), "\n") {
+        fields := strings.Fields(line)
+        if len(fields) < 2 {
+            continue
+        }
+        value, _ := strconv.Atoi(fields[1])
+        switch fields[0] {
+        case "VmRSS:":
+            result.rss = value
+        case "VmData:":
+            result.data = value
+        }
+    }
+    return result
+}
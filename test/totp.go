@@ -0,0 +1,58 @@
+package main
+
+import (
+    "crypto/hmac"
+    "crypto/sha1"
+    "encoding/binary"
+    "flag"
+    "fmt"
+    "io"
+    "net"
+    "os"
+    "strconv"
+    "time"
+)
+
+// Knocks with the current TOTP, and with one that should have expired.
+func main() {
+    port := flag.Int("port", 4000, "Port of the proxy to connect to.")
+    secret := flag.String("secret", "PASSWORD", "The knock string the proxy was started with")
+    period := flag.Int("period", 30, "The --totp period of the proxy")
+    flag.Parse()
+
+    window := uint64(time.Now().Unix()) / uint64(*period)
+    if !knock(*port, token(*secret, window)) {
+        fmt.Println("ERROR: current token was not accepted")
+        os.Exit(1)
+    }
+    if knock(*port, token(*secret, window - 2)) {
+        fmt.Println("ERROR: expired token was accepted")
+        os.Exit(1)
+    }
+    fmt.Println("OK")
+}
+
+func token(secret string, window uint64) string {
+    counter := make([]byte, 8)
+    binary.BigEndian.PutUint64(counter, window)
+    mac := hmac.New(sha1.New, []byte(secret))
+    mac.Write(counter)
+    sum := mac.Sum(nil)
+    offset := sum[len(sum) - 1] & 0xf
+    code := binary.BigEndian.Uint32(sum[offset:]) & 0x7fffffff
+    return fmt.Sprintf("%08d", code % 100000000)
+}
+
+func knock(port int, token string) bool {
+    conn, err := net.Dial("tcp", ":" + strconv.Itoa(port))
+    if err != nil {
+        fmt.Println("ERROR", err)
+        os.Exit(1)
+    }
+    defer conn.Close()
+    conn.Write([]byte(token))
+    conn.SetReadDeadline(time.Now().Add(2 * time.Second))
+    result := make([]byte, 5)
+    _, err = io.ReadFull(conn, result)
+    return err == nil && string(result) == "HELLO"
+}
@@ -0,0 +1,251 @@
+package main
+
+import (
+    "bytes"
+    "flag"
+    "fmt"
+    "io"
+    "net"
+    "os"
+    "strconv"
+    "strings"
+    "sync"
+    "sync/atomic"
+    "time"
+)
+
+// Compares the throughput of bulk downloads through a proxy that copies its
+// output to the kernel with one that sends it with MSG_ZEROCOPY, and the CPU
+// time both spend per GB. Every byte is checked, as a chain that is released
+// before the kernel sent it shows up as corrupted data. With --stallTimeout
+// it also checks that the zero copy proxy closes a download that stops
+// reading.
+//
+// Start two proxies of the libevent engine on the same backend, one with
+// --zeroCopy, for example:
+//    ./l7knockknock --normalPort=5544 --listenPort=6633 PASSWORD &
+//    ./l7knockknock --normalPort=5544 --listenPort=6634 --zeroCopy PASSWORD &
+//    go run test/zerocopy.go --copy :6633 --zeroCopy :6634 --backendPort 5544 --pids $(pgrep -d, l7knockknock)
+//
+// On loopback the kernel copies anyway (and the proxy goes back to normal
+// sends once it notices), so to see the difference run the backend part
+// on the machine of the proxies and the downloads on another one:
+//    go run test/zerocopy.go --backendPort 5544                       (next to the proxies)
+//    go run test/zerocopy.go --copy proxy:6633 --zeroCopy proxy:6634  (elsewhere)
+func main() {
+    copyAddress := flag.String("copy", "", "Address of the proxy that copies.")
+    zeroCopyAddress := flag.String("zeroCopy", "", "Address of the proxy with --zeroCopy.")
+    backendPort := flag.Int("backendPort", 0, "Port to run the download backend on (the normal port of the proxies), 0 to not run it.")
+    pids := flag.String("pids", "", "Pids of the copy and zero copy proxy, to measure their CPU time.")
+    downloads := flag.Int("downloads", 4, "Amount of downloads at the same time.")
+    duration := flag.Duration("duration", 5 * time.Second, "How long to measure every proxy.")
+    rounds := flag.Int("rounds", 3, "Times to measure both proxies, alternating.")
+    receiveBuffer := flag.Int("receiveBuffer", 0, "Receive buffer of the downloads in bytes, a small one makes the output of the proxy queue up like behind a slower link, 0 for the default.")
+    stallTimeout := flag.Duration("stallTimeout", 0, "The --proxyTimeout of the zero copy proxy, to check that it closes a download that stops reading, 0 to skip that.")
+    flag.Parse()
+
+    if *backendPort != 0 {
+        l, err := net.Listen("tcp", ":" + strconv.Itoa(*backendPort))
+        if err != nil {
+            fail(err)
+        }
+        if *copyAddress == "" && *zeroCopyAddress == "" {
+            downloadBackend(l)
+            return
+        }
+        go downloadBackend(l)
+    }
+
+    addresses := []string{*copyAddress, *zeroCopyAddress}
+    names := []string{"copy", "zero copy"}
+    processes := []int{0, 0}
+    if *pids != "" {
+        for i, pid := range strings.SplitN(*pids, ",", 2) {
+            processes[i], _ = strconv.Atoi(pid)
+        }
+    }
+    rates := make([]float64, 2)
+    cpus := make([]float64, 2)
+    for round := 0; round < *rounds; round++ {
+        for i, address := range addresses {
+            if address == "" {
+                continue
+            }
+            rate, cpu := measure(address, processes[i], *downloads, *receiveBuffer, *duration)
+            fmt.Printf("%-9s %7.0f MB/s %7.2f CPU s/GB\n", names[i], rate, cpu)
+            rates[i] += rate / float64(*rounds)
+            cpus[i] += cpu / float64(*rounds)
+        }
+    }
+    fmt.Println("mode,mb_per_s,cpu_s_per_gb")
+    for i, address := range addresses {
+        if address != "" {
+            fmt.Printf("%s,%.0f,%.2f\n", names[i], rates[i], cpus[i])
+        }
+    }
+    if *zeroCopyAddress != "" && *stallTimeout > 0 {
+        stalled(*zeroCopyAddress, *stallTimeout)
+    }
+    fmt.Println("OK")
+}
+
+func fail(err error) {
+    fmt.Println("ERROR", err)
+    os.Exit(1)
+}
+
+// byte i of every download, a prime length so it doesn't line up with any buffer
+const patternLength = 251
+
+var pattern = func() []byte {
+    result := make([]byte, patternLength + 256 * 1024)
+    for i := range result {
+        result[i] = byte(i % patternLength)
+    }
+    return result
+}()
+
+// MB/s of all downloads together, and CPU seconds of the proxy per GB
+func measure(address string, pid int, downloads int, receiveBuffer int, duration time.Duration) (float64, float64) {
+    var received int64
+    var wg sync.WaitGroup
+    stop := make(chan struct{})
+    var conns []net.Conn
+    for i := 0; i < downloads; i++ {
+        conn, err := net.Dial("tcp", address)
+        if err != nil {
+            fail(err)
+        }
+        if receiveBuffer > 0 {
+            conn.(*net.TCPConn).SetReadBuffer(receiveBuffer)
+        }
+        if _, err := conn.Write([]byte("GET")); err != nil {
+            fail(err)
+        }
+        conns = append(conns, conn)
+        wg.Add(1)
+        go func() {
+            defer wg.Done()
+            download(conn, &received, stop)
+        }()
+    }
+    // let the connections get up to speed
+    time.Sleep(duration / 5)
+    before := atomic.LoadInt64(&received)
+    cpuBefore := cpuTime(pid)
+    started := time.Now()
+    time.Sleep(duration)
+    moved := atomic.LoadInt64(&received) - before
+    cpu := cpuTime(pid) - cpuBefore
+    elapsed := time.Since(started).Seconds()
+    close(stop)
+    for _, conn := range conns {
+        conn.Close()
+    }
+    wg.Wait()
+    if moved == 0 {
+        fail(fmt.Errorf("the downloads through %s stalled", address))
+    }
+    return float64(moved) / 1024 / 1024 / elapsed, cpu / (float64(moved) / 1024 / 1024 / 1024)
+}
+
+func download(conn net.Conn, received *int64, stop chan struct{}) {
+    buffer := make([]byte, 256 * 1024)
+    offset := 0
+    for {
+        n, err := conn.Read(buffer)
+        if n > 0 {
+            if !bytes.Equal(buffer[:n], pattern[offset % patternLength:offset % patternLength + n]) {
+                fail(fmt.Errorf("corrupted data after %d bytes", offset))
+            }
+            offset += n
+            atomic.AddInt64(received, int64(n))
+        }
+        if err != nil {
+            select {
+            case <-stop:
+                return
+            default:
+                fail(fmt.Errorf("download failed after %d bytes: %v", offset, err))
+            }
+        }
+    }
+}
+
+// user and system time of the process in seconds, 0 without a pid
+func cpuTime(pid int) float64 {
+    if pid == 0 {
+        return 0
+    }
+    stat, err := os.ReadFile("/proc/" + strconv.Itoa(pid) + "/stat")
+    if err != nil {
+        fail(err)
+    }
+    // the fields after the name, which can contain spaces
+    fields := strings.Fields(string(stat[bytes.LastIndexByte(stat, ')') + 2:]))
+    utime, _ := strconv.ParseFloat(fields[11], 64)
+    stime, _ := strconv.ParseFloat(fields[12], 64)
+    // clock ticks, which are 100 per second on about every Linux
+    return (utime + stime) / 100
+}
+
+// a download that stops reading, the zero copy proxy has to close it once its
+// write timeout passed, even though its output waits in the hold and not in
+// the bufferevent
+func stalled(address string, timeout time.Duration) {
+    conn, err := net.Dial("tcp", address)
+    if err != nil {
+        fail(err)
+    }
+    defer conn.Close()
+    // large enough that the socket of the proxy stays writable, a full one
+    // would time out the write of the bufferevent instead
+    conn.(*net.TCPConn).SetReadBuffer(1024 * 1024)
+    if _, err := conn.Write([]byte("GET")); err != nil {
+        fail(err)
+    }
+    // never read before the proxy should have given up, on loopback the
+    // kernel copies, and once the hold is sent new output skips it
+    buffer := make([]byte, 256 * 1024)
+    // the write timeout, plus the closing timeout of the other side
+    time.Sleep(timeout + 2 * time.Second)
+    // what was queued before the close still arrives, an open download never ends
+    conn.SetReadDeadline(time.Now().Add(5 * time.Second))
+    received := 0
+    for {
+        n, err := conn.Read(buffer)
+        received += n
+        if netErr, ok := err.(net.Error); ok && netErr.Timeout() {
+            fail(fmt.Errorf("the proxy kept a stalled download open for %v", timeout + 2 * time.Second))
+        }
+        if err != nil {
+            break
+        }
+        if received > 64 * 1024 * 1024 {
+            fail(fmt.Errorf("the proxy still sends to a download that stalled for %v", timeout + 2 * time.Second))
+        }
+    }
+    fmt.Printf("stalled download closed after %d more bytes\n", received)
+}
+
+// sends the pattern for as long as the client will take it
+func downloadBackend(l net.Listener) {
+    for {
+        conn, err := l.Accept()
+        if err != nil {
+            return
+        }
+        go func() {
+            defer conn.Close()
+            go io.Copy(io.Discard, conn)
+            offset := 0
+            for {
+                chunk := 64 * 1024
+                if _, err := conn.Write(pattern[offset:offset + chunk]); err != nil {
+                    return
+                }
+                offset = (offset + chunk) % patternLength
+            }
+        }()
+    }
+}